@@ -0,0 +1,355 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdint.h>
+
+#include "loadgen.h"
+
+/*
+ * Load generator for proxy.c. Starts a local sink server, drives concurrent CONNECT tunnels or
+ * plain GETs through the proxy, and reports latency percentiles, throughput and RSS per connection.
+ *
+ *   gcc -Wall -Wextra -O2 -pthread C/bench.c -o bench
+ *   ./bench --proxy 127.0.0.1:8000 --mode connect -c 64 -d 10 --hold 2000 --pid $(pidof proxy)
+ */
+
+enum bench_mode { MODE_CONNECT, MODE_GET };
+
+struct bench_config {
+    const char *proxy_host;
+    int proxy_port;
+    int mode;
+    int concurrency;
+    int duration;
+    size_t bytes;
+    int keepalive;
+    int hold;
+    int pid;
+    int sink_threads;
+    int sink_port;
+};
+
+static struct bench_config config = {
+    .proxy_host = "127.0.0.1",
+    .proxy_port = 8000,
+    .mode = MODE_CONNECT,
+    .concurrency = 64,
+    .duration = 10,
+    .bytes = 65536,
+    .keepalive = 0,
+    .hold = 0,
+    .pid = 0,
+    .sink_threads = 2,
+    .sink_port = 0,
+};
+
+struct client_stats {
+    pthread_t thread;
+    uint64_t *latencies;
+    size_t count;
+    size_t capacity;
+    uint64_t bytes;
+    uint64_t errors;
+};
+
+static volatile int stop_flag = 0;
+
+void start_sink(void) {
+    static int listeners[64];
+    if (config.sink_threads > 64) config.sink_threads = 64;
+
+    for (int i = 0; i < config.sink_threads; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int opt = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(config.sink_port);
+        if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+            perror("sink");
+            exit(EXIT_FAILURE);
+        }
+        if (config.sink_port == 0) {
+            socklen_t len = sizeof(addr);
+            getsockname(fd, (struct sockaddr *)&addr, &len);
+            config.sink_port = ntohs(addr.sin_port);
+        }
+
+        listeners[i] = fd;
+        pthread_t tid;
+        pthread_create(&tid, NULL, sink_main, &listeners[i]);
+        pthread_detach(tid);
+    }
+}
+
+int proxy_connect(void) {
+    return proxy_dial(config.proxy_host, config.proxy_port, 10);
+}
+
+/* Dials the proxy and establishes a tunnel to the sink. Returns the socket or -1. */
+int open_tunnel(void) {
+    char buf[1024];
+    size_t extra;
+    int fd = proxy_connect();
+    if (fd < 0) return -1;
+
+    int len = snprintf(buf, sizeof(buf), "CONNECT 127.0.0.1:%d HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n\r\n", config.sink_port, config.sink_port);
+    if (send_all(fd, buf, len) < 0 || read_head(fd, buf, sizeof(buf), &extra) != 200 || extra != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void record(struct client_stats *st, uint64_t latency) {
+    if (st->count == st->capacity) {
+        size_t capacity = st->capacity ? st->capacity * 2 : 4096;
+        uint64_t *grown = realloc(st->latencies, capacity * sizeof(*grown));
+        if (!grown) return;
+        st->latencies = grown;
+        st->capacity = capacity;
+    }
+    st->latencies[st->count++] = latency;
+}
+
+int run_connect(struct client_stats *st) {
+    uint64_t start = now_us();
+    int fd = open_tunnel();
+    if (fd < 0) return -1;
+    record(st, now_us() - start);
+
+    char line[32];
+    int len = snprintf(line, sizeof(line), "%zu\n", config.bytes);
+    int rc = send_all(fd, line, len) < 0 || drain(fd, config.bytes) < 0 ? -1 : 0;
+    if (rc == 0) st->bytes += config.bytes;
+    close(fd);
+    return rc;
+}
+
+int run_get(struct client_stats *st, int *fd) {
+    char buf[1024];
+    size_t extra;
+    uint64_t start = now_us();
+
+    if (*fd < 0) *fd = proxy_connect();
+    if (*fd < 0) return -1;
+
+    int len = snprintf(buf, sizeof(buf), "GET http://127.0.0.1:%d/%zu HTTP/1.1\r\nHost: 127.0.0.1:%d\r\n%s\r\n",
+                       config.sink_port, config.bytes, config.sink_port, config.keepalive ? "" : "Connection: close\r\n");
+    if (send_all(*fd, buf, len) < 0 || read_head(*fd, buf, sizeof(buf), &extra) != 200 || extra > config.bytes ||
+        drain(*fd, config.bytes - extra) < 0) {
+        close(*fd);
+        *fd = -1;
+        return -1;
+    }
+    record(st, now_us() - start);
+    st->bytes += config.bytes;
+
+    if (!config.keepalive) {
+        close(*fd);
+        *fd = -1;
+    }
+    return 0;
+}
+
+void *client_main(void *arg) {
+    struct client_stats *st = arg;
+    int fd = -1;
+
+    while (!stop_flag) {
+        int rc = config.mode == MODE_CONNECT ? run_connect(st) : run_get(st, &fd);
+        if (rc < 0) st->errors++;
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+uint64_t percentile(const uint64_t *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t rank = (size_t)(p * n);
+    return sorted[rank < n ? rank : n - 1];
+}
+
+long rss_kb(int pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/* Opens idle tunnels and reports how much the proxy's RSS grew per tunnel. */
+void measure_rss(void) {
+    int *fds = malloc(config.hold * sizeof(int));
+    if (!fds) return;
+
+    long before = rss_kb(config.pid);
+    int opened = 0;
+    for (; opened < config.hold; opened++) {
+        fds[opened] = open_tunnel();
+        if (fds[opened] < 0) break;
+    }
+    usleep(200000);
+    long after = rss_kb(config.pid);
+
+    if (before < 0 || after < 0) printf("rss:        could not read /proc/%d/status\n", config.pid);
+    else if (opened > 0) printf("rss:        %.2f KB per idle tunnel (%d tunnels, %ld KB -> %ld KB)\n", (double)(after - before) / opened, opened, before, after);
+    if (opened < config.hold) printf("rss:        only %d of %d tunnels opened\n", opened, config.hold);
+
+    for (int i = 0; i < opened; i++) close(fds[i]);
+    free(fds);
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -p, --proxy HOST:PORT    proxy to drive (default 127.0.0.1:8000)\n"
+            "  -m, --mode connect|get   CONNECT tunnels or plain GETs (default connect)\n"
+            "  -c, --concurrency N      concurrent clients (default 64)\n"
+            "  -d, --duration SECONDS   run time (default 10)\n"
+            "  -b, --bytes N            payload per tunnel or response (default 65536)\n"
+            "  -k, --keepalive          reuse client connections in get mode\n"
+            "      --hold N             open N idle tunnels afterwards to measure RSS\n"
+            "      --pid PID            proxy process for the RSS measurement\n"
+            "      --sink-threads N     sink server threads (default 2)\n"
+            "      --sink-port PORT     sink listen port (default: ephemeral)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--proxy") == 0) && i + 1 < argc) {
+            char *spec = argv[++i];
+            char *colon = strrchr(spec, ':');
+            if (colon) {
+                *colon = '\0';
+                config.proxy_port = atoi(colon + 1);
+            }
+            if (*spec) config.proxy_host = spec;
+        } else if ((strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "connect") == 0) {
+                config.mode = MODE_CONNECT;
+            } else if (strcmp(mode, "get") == 0) {
+                config.mode = MODE_GET;
+            } else {
+                fprintf(stderr, "Unknown mode: %s (expected connect or get)\n", mode);
+                return EXIT_FAILURE;
+            }
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--concurrency") == 0) && i + 1 < argc) {
+            config.concurrency = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--duration") == 0) && i + 1 < argc) {
+            config.duration = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bytes") == 0) && i + 1 < argc) {
+            config.bytes = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--keepalive") == 0) {
+            config.keepalive = 1;
+        } else if (strcmp(argv[i], "--hold") == 0 && i + 1 < argc) {
+            config.hold = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pid") == 0 && i + 1 < argc) {
+            config.pid = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sink-threads") == 0 && i + 1 < argc) {
+            config.sink_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sink-port") == 0 && i + 1 < argc) {
+            config.sink_port = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.concurrency < 1 || config.duration < 1 || config.sink_threads < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    start_sink();
+
+    struct client_stats *stats = calloc(config.concurrency, sizeof(*stats));
+    if (!stats) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t start = now_us();
+    for (int i = 0; i < config.concurrency; i++) {
+        if (pthread_create(&stats[i].thread, NULL, client_main, &stats[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    sleep(config.duration);
+    stop_flag = 1;
+    for (int i = 0; i < config.concurrency; i++) pthread_join(stats[i].thread, NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    size_t total = 0;
+    uint64_t bytes = 0, errors = 0;
+    for (int i = 0; i < config.concurrency; i++) {
+        total += stats[i].count;
+        bytes += stats[i].bytes;
+        errors += stats[i].errors;
+    }
+    uint64_t *all = malloc((total ? total : 1) * sizeof(*all));
+    if (!all) {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    size_t n = 0;
+    for (int i = 0; i < config.concurrency; i++) {
+        memcpy(all + n, stats[i].latencies, stats[i].count * sizeof(*all));
+        n += stats[i].count;
+        free(stats[i].latencies);
+    }
+    qsort(all, n, sizeof(*all), compare_u64);
+
+    printf("mode:       %s, %d clients, %zu bytes, %.1f s%s\n", config.mode == MODE_CONNECT ? "connect" : "get",
+           config.concurrency, config.bytes, elapsed, config.mode == MODE_GET && config.keepalive ? ", keep-alive" : "");
+    printf("completed:  %zu (%.0f/s), errors: %llu\n", n, n / elapsed, (unsigned long long)errors);
+    printf("%s p50 %llu us, p99 %llu us, p999 %llu us, max %llu us\n",
+           config.mode == MODE_CONNECT ? "setup:     " : "request:   ",
+           (unsigned long long)percentile(all, n, 0.50), (unsigned long long)percentile(all, n, 0.99),
+           (unsigned long long)percentile(all, n, 0.999), (unsigned long long)(n ? all[n - 1] : 0));
+    printf("throughput: %.3f Gbit/s\n", bytes * 8 / elapsed / 1e9);
+    free(all);
+
+    if (config.hold > 0 && config.mode == MODE_CONNECT && config.pid > 0) measure_rss();
+    else if (config.hold > 0) printf("rss:        needs --pid and connect mode\n");
+
+    free(stats);
+    return errors > 0 ? 2 : 0;
+}
@@ -0,0 +1,199 @@
+#ifndef ANONYNET_LOADGEN_H
+#define ANONYNET_LOADGEN_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <stdint.h>
+
+/*
+ * The sink server and proxy client helpers shared by bench.c and soak.c. Each tool is a single translation unit
+ * that includes this once, so the definitions live here rather than in a library.
+ */
+
+#define SINK_BUFFER 65536
+#define SINK_MAX_EVENTS 256
+#define SINK_REQUEST_MAX 1024
+
+struct sink_conn {
+    int fd;
+    char request[SINK_REQUEST_MAX];
+    size_t request_len;
+    char head[128];
+    size_t head_len;
+    size_t head_off;
+    size_t remaining;
+    int close_after;
+};
+
+static char sink_payload[SINK_BUFFER];
+
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Sink protocol: "GET /N" gets an N-byte HTTP response (keep-alive); "N\n" gets N raw bytes and a close. */
+int sink_parse(struct sink_conn *sc) {
+    char *end = memmem(sc->request, sc->request_len, "\r\n\r\n", 4);
+    if (sc->request_len >= 4 && memcmp(sc->request, "GET ", 4) == 0) {
+        if (!end) return sc->request_len < SINK_REQUEST_MAX ? 0 : -1;
+        /* The proxy forwards the absolute-form target, so skip any scheme and authority. */
+        char *target = sc->request + 4;
+        if (strncmp(target, "http://", 7) == 0) target = strchr(target + 7, '/');
+        sc->remaining = target && *target == '/' ? strtoull(target + 1, NULL, 10) : 0;
+        sc->close_after = memmem(sc->request, end - sc->request, "Connection: close", 17) != NULL;
+        sc->head_len = snprintf(sc->head, sizeof(sc->head), "HTTP/1.1 200 OK\r\nContent-Length: %zu\r\n%s\r\n",
+                                sc->remaining, sc->close_after ? "Connection: close\r\n" : "");
+        size_t consumed = end + 4 - sc->request;
+        memmove(sc->request, end + 4, sc->request_len - consumed);
+        sc->request_len -= consumed;
+    } else {
+        char *eol = memchr(sc->request, '\n', sc->request_len);
+        if (!eol) return sc->request_len < SINK_REQUEST_MAX ? 0 : -1;
+        sc->remaining = strtoull(sc->request, NULL, 10);
+        sc->head_len = 0;
+        sc->close_after = 1;
+        sc->request_len = 0;
+    }
+    sc->head_off = 0;
+    return 1;
+}
+
+/* Returns -1 to close, 0 to wait for more input, 1 while output is still pending. */
+int sink_write(struct sink_conn *sc) {
+    while (sc->head_off < sc->head_len) {
+        ssize_t sent = send(sc->fd, sc->head + sc->head_off, sc->head_len - sc->head_off, MSG_NOSIGNAL | (sc->remaining ? MSG_MORE : 0));
+        if (sent < 0) return errno == EAGAIN ? 1 : -1;
+        sc->head_off += sent;
+    }
+    while (sc->remaining > 0) {
+        size_t chunk = sc->remaining < SINK_BUFFER ? sc->remaining : SINK_BUFFER;
+        ssize_t sent = send(sc->fd, sink_payload, chunk, MSG_NOSIGNAL);
+        if (sent < 0) return errno == EAGAIN ? 1 : -1;
+        sc->remaining -= sent;
+    }
+    sc->head_len = sc->head_off = 0;
+    return sc->close_after ? -1 : 0;
+}
+
+/* Serves the sink protocol on the non-blocking listener arg points to, for as long as the process runs. */
+void *sink_main(void *arg) {
+    int listen_fd = *(int *)arg;
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    struct epoll_event events[SINK_MAX_EVENTS];
+    for (;;) {
+        int n = epoll_wait(epfd, events, SINK_MAX_EVENTS, -1);
+        for (int i = 0; i < n; i++) {
+            struct sink_conn *sc = events[i].data.ptr;
+            if (!sc) {
+                int fd;
+                while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    sc = calloc(1, sizeof(*sc));
+                    if (!sc) {
+                        close(fd);
+                        continue;
+                    }
+                    sc->fd = fd;
+                    struct epoll_event cev = {.events = EPOLLIN, .data.ptr = sc};
+                    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &cev);
+                }
+                continue;
+            }
+
+            int rc = 0;
+            if (sc->head_len == 0 && sc->remaining == 0) {
+                ssize_t got = recv(sc->fd, sc->request + sc->request_len, SINK_REQUEST_MAX - sc->request_len, 0);
+                if (got <= 0 && !(got < 0 && errno == EAGAIN)) rc = -1;
+                if (got > 0) sc->request_len += got;
+                while (rc == 0 && (rc = sink_parse(sc)) > 0) rc = sink_write(sc);
+            } else {
+                rc = sink_write(sc);
+                while (rc == 0 && sc->request_len > 0 && (rc = sink_parse(sc)) > 0) rc = sink_write(sc);
+            }
+
+            if (rc < 0) {
+                close(sc->fd);
+                free(sc);
+                continue;
+            }
+            struct epoll_event cev = {.events = rc > 0 ? EPOLLOUT : EPOLLIN, .data.ptr = sc};
+            epoll_ctl(epfd, EPOLL_CTL_MOD, sc->fd, &cev);
+        }
+    }
+    return NULL;
+}
+
+/* A blocking socket to the proxy whose reads and writes give up after timeout seconds; -1 if it cannot connect. */
+int proxy_dial(const char *host, int port, int timeout) {
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    struct timeval tv = {.tv_sec = timeout};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(fd, buf, len, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Reads a response head and returns its status: -1 if the proxy closed first, -2 if it went quiet past the
+ * timeout. Any body bytes read past the head are reported in *extra. */
+int read_head(int fd, char *buf, size_t size, size_t *extra) {
+    size_t len = 0;
+    while (len < size) {
+        ssize_t got = recv(fd, buf + len, size - len, 0);
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return -2;
+        if (got <= 0) return -1;
+        len += got;
+        char *end = memmem(buf, len, "\r\n\r\n", 4);
+        if (end) {
+            *extra = len - (end + 4 - buf);
+            return len >= 12 && memcmp(buf, "HTTP/1.", 7) == 0 ? atoi(buf + 9) : -1;
+        }
+    }
+    return -1;
+}
+
+int drain(int fd, size_t bytes) {
+    char buf[SINK_BUFFER];
+    while (bytes > 0) {
+        ssize_t got = recv(fd, buf, bytes < sizeof(buf) ? bytes : sizeof(buf), 0);
+        if (got <= 0) return -1;
+        bytes -= got;
+    }
+    return 0;
+}
+
+#endif
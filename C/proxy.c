@@ -1,311 +1,8608 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
 #include <errno.h>
 #include <netdb.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdint.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IORING_ACCEPT_MULTISHOT
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST 80
+#endif
 
 #define BUFFER_SIZE 8192
-#define MAX_CONNECTIONS 1000
+#define LISTEN_BACKLOG 4096
 #define DEFAULT_HOST "0.0.0.0"
 #define DEFAULT_PORT 8000
+#define EPOLL_MAX_EVENTS 256
+#define RELAY_BUDGET 16
+#define RELAY_BUFFER_MIN 4096
+#define RELAY_BUFFER_MAX (256 * 1024)
+#define RELAY_BUFFER_CLASSES 7
+#define RELAY_SHRINK_READS 16
+#define SPLICE_CHUNK 65536
+#define PIPE_POOL_MAX 64
+#define URING_ENTRIES 4096
+#define URING_BUFFERS 1024
+#define URING_MAX_FILE_SLOTS 65536
+#define DNS_SHARDS 64
+#define DNS_BUCKETS 256
+#define DNS_SHARD_CAPACITY 1024
+#define DNS_QUEUE_MAX 1024
+#define DNS_MAX_ADDRS 8
+#define POOL_BUCKETS 256
+#define POOL_IDLE_PER_HOST_MAX 64
+#define HTTP_MAX_HEADERS 64
+#define REGISTRY_MAX_SLOTS 65536
+#define SLAB_CHUNK_BYTES (256 * 1024)
+#define RATE_SHARDS 64
+#define RATE_SHARD_SLOTS 1024
+#define RATE_PROBE 16
+#define SHAPE_BURST_NS 100000000
+#define LOG_RING_SLOTS 256
+#define LOG_MSG_MAX 240
+#define LOG_FLUSH_INTERVAL_MS 20
+#define LOG_OUTPUT_BUFFER 65536
+#define METRICS_SHARDS 64
+#define METRICS_OUTPUT_BUFFER (128 * 1024)
+#define CONNECT_BUCKETS 12
+#define TRACE_BUCKETS 15
+#define TRACE_RING 256
+#define REGISTRY_NONE UINT32_MAX
+#define UPSTREAM_ATTEMPTS 3
+#define UPSTREAM_EWMA_SHIFT 2
+#define UPSTREAM_DEFAULT_US 1000000
+#define UPSTREAM_FAILURE_US 10000000
+#define UPSTREAM_REPLY_MAX (BUFFER_SIZE - 64)
+#define UPSTREAM_FILE_MAX (64 * 1024 * 1024)
+#define POLICY_FILE_MAX (64 * 1024 * 1024)
+#define POLICY_MAX_DEPTH 128
+#define AUTH_FILE_MAX (16 * 1024 * 1024)
+#define AUTH_SALT_MAX 64
+#define AUTH_CACHE_SHARDS 16
+#define AUTH_HASH_ITERATIONS 100000
+#define AUTH_QUEUE_MAX 1024
+#define AUTH_FAIL_SLOTS 4096
+#define AUTH_FAIL_FREE 3
+#define AUTH_FAIL_BASE_MS 250
+#define AUTH_FAIL_MAX_MS 30000
+#define CACHE_BLOCK 8192
+#define CACHE_KEY_MAX 1024
+#define CACHE_VARY_MAX 1024
+#define CACHE_SKETCH_ROWS 4
+#define CACHE_COALESCE_WAIT_MS 30000
+#define CACHE_HEURISTIC_MAX 86400
+#define UPSTREAM_PICK_SAMPLES 8
+#define UPSTREAM_BREAKER_FAILURES 3
+#define UPSTREAM_COOLDOWN_MS 5000
+#define UPSTREAM_COOLDOWN_MAX_MS 300000
+#define UPSTREAM_PROBE_BATCH 256
+#define TIMER_TICK_MS 10
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+#define FD_RESERVE 64
+#define ACCEPT_PAUSE_MS 50
+#define KEEPALIVE_PROBES 4
+#define DRAIN_POLL_MS 100
+#define UPGRADE_TIMEOUT_MS 10000
+#define NUMA_MAX_NODES 64
+
+enum engine_type { ENGINE_THREAD, ENGINE_EPOLL, ENGINE_URING };
+enum relay_mode { RELAY_COPY, RELAY_SPLICE };
+enum overload_mode { OVERLOAD_PAUSE, OVERLOAD_REJECT };
+enum steering_mode { STEER_NONE, STEER_INCOMING_CPU, STEER_CBPF };
+enum handoff_kind { HANDOFF_PROXY, HANDOFF_TRANSPARENT, HANDOFF_ADMIN, HANDOFF_END };
+enum log_level { LOG_LEVEL_OFF, LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_ACCESS };
+enum log_kind { LOG_KIND_ERROR, LOG_KIND_WARN, LOG_KIND_INFO, LOG_KIND_HTTP, LOG_KIND_HTTPS };
+enum log_format { LOG_FORMAT_TEXT, LOG_FORMAT_JSON };
+enum upstream_type { UPSTREAM_HTTP, UPSTREAM_SOCKS4, UPSTREAM_SOCKS5 };
+enum breaker_state { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+enum metric {
+    METRIC_ACCEPTED,
+    METRIC_CONNECTIONS,
+    METRIC_TUNNELS,
+    METRIC_REQUESTS,
+    METRIC_POOL_REUSED,
+    METRIC_BYTES_UP,
+    METRIC_BYTES_DOWN,
+    METRIC_DNS_HITS,
+    METRIC_DNS_MISSES,
+    METRIC_UPSTREAM_DIALS,
+    METRIC_UPSTREAM_EJECTIONS,
+    METRIC_UPSTREAM_RELOADS,
+    METRIC_CONNECTION_LIMIT,
+    METRIC_ACCEPT_PAUSES,
+    METRIC_DRAINING,
+    METRIC_BUFFER_GROWS,
+    METRIC_BUFFER_SHRINKS,
+    METRIC_POLICY_ALLOW,
+    METRIC_POLICY_DENY,
+    METRIC_POLICY_UPSTREAM,
+    METRIC_POLICY_DIRECT,
+    METRIC_POLICY_RULES,
+    METRIC_POLICY_RELOADS,
+    METRIC_AUTH_VERIFIED,
+    METRIC_AUTH_CACHED,
+    METRIC_AUTH_FAILED,
+    METRIC_AUTH_THROTTLED,
+    METRIC_AUTH_RELOADS,
+    METRIC_CACHE_HITS,
+    METRIC_CACHE_MISSES,
+    METRIC_CACHE_BYPASSES,
+    METRIC_CACHE_COALESCED,
+    METRIC_CACHE_STORED,
+    METRIC_CACHE_REJECTED,
+    METRIC_CACHE_EVICTIONS,
+    METRIC_CACHE_BYTES,
+    METRIC_SHAPE_TUNNEL,
+    METRIC_SHAPE_CLIENT,
+    METRIC_SHAPE_GLOBAL,
+    METRIC_STEER_MISSES,
+    METRIC_COUNT
+};
+enum error_cause {
+    ERROR_BAD_REQUEST,
+    ERROR_DNS,
+    ERROR_CONNECT,
+    ERROR_UPSTREAM_LIMIT,
+    ERROR_CAPACITY,
+    ERROR_RESOURCE,
+    ERROR_ACCEPT,
+    ERROR_UPSTREAM,
+    ERROR_CONNECT_TIMEOUT,
+    ERROR_HEADER_TIMEOUT,
+    ERROR_IDLE_TIMEOUT,
+    ERROR_LIFETIME,
+    ERROR_RATE_LIMIT,
+    ERROR_BANDWIDTH_LIMIT,
+    ERROR_POLICY,
+    ERROR_AUTH,
+    ERROR_COUNT
+};
+enum sockopt {
+    SOCKOPT_NODELAY,
+    SOCKOPT_DEFER_ACCEPT,
+    SOCKOPT_FASTOPEN,
+    SOCKOPT_SNDBUF,
+    SOCKOPT_RCVBUF,
+    SOCKOPT_NOTSENT_LOWAT,
+    SOCKOPT_KEEPALIVE,
+    SOCKOPT_COUNT
+};
+enum policy_action { POLICY_NONE, POLICY_ALLOW, POLICY_DENY, POLICY_UPSTREAM, POLICY_DIRECT, POLICY_ACTIONS };
+enum trace_stage {
+    TRACE_ACCEPTED,
+    TRACE_PARSED,
+    TRACE_RESOLVED,
+    TRACE_CONNECTED,
+    TRACE_ESTABLISHED,
+    TRACE_FIRST_UP,
+    TRACE_FIRST_DOWN,
+    TRACE_CLOSED,
+    TRACE_STAGES
+};
+
+struct proxy_config {
+    int engine;
+    int workers;
+    int relay;
+    int dns_threads;
+    int dns_ttl;
+    int dns_negative_ttl;
+    int pool_idle_per_host;
+    int pool_max_idle;
+    int pool_idle_timeout;
+    int pool_max_per_host;
+    int log_level;
+    int log_format;
+    const char *admin_host;
+    int admin_port;
+    const char *upstreams;
+    int health_interval;
+    int health_timeout;
+    const char *health_target;
+    int connect_timeout;
+    int connect_attempt_delay;
+    int header_timeout;
+    int idle_timeout;
+    int max_lifetime;
+    int rate_limit;
+    int rate_burst;
+    int bandwidth_limit;
+    int tunnel_bandwidth;
+    int global_bandwidth;
+    int max_connections;
+    int overload;
+    int transparent_port;
+    int tcp_nodelay;
+    int tcp_defer_accept;
+    int tcp_fastopen;
+    int tcp_sndbuf;
+    int tcp_rcvbuf;
+    int tcp_notsent_lowat;
+    int tcp_keepalive;
+    int drain_timeout;
+    int upgrade_fd;
+    int trace_sample;
+    int trace_slow;
+    const char *policy;
+    const char *users;
+    int auth_cache;
+    int auth_threads;
+    const char *cache_dir;
+    int cache_size;
+    int cache_object_max;
+    const char *cpus;
+    int steering;
+};
+
+static struct proxy_config config = {
+    .engine = ENGINE_THREAD,
+    .workers = 1,
+    .relay = RELAY_COPY,
+    .dns_threads = 4,
+    .dns_ttl = 60,
+    .dns_negative_ttl = 5,
+    .pool_idle_per_host = 8,
+    .pool_max_idle = 256,
+    .pool_idle_timeout = 30,
+    .pool_max_per_host = 0,
+    .log_level = LOG_LEVEL_ACCESS,
+    .log_format = LOG_FORMAT_TEXT,
+    .admin_host = "127.0.0.1",
+    .admin_port = 0,
+    .upstreams = NULL,
+    .health_interval = 10,
+    .health_timeout = 3000,
+    .health_target = NULL,
+    .connect_timeout = 10000,
+    .connect_attempt_delay = 250,
+    .header_timeout = 10,
+    .idle_timeout = 300,
+    .max_lifetime = 0,
+    .rate_limit = 0,
+    .rate_burst = 0,
+    .bandwidth_limit = 0,
+    .tunnel_bandwidth = 0,
+    .global_bandwidth = 0,
+    .max_connections = 0,
+    .overload = OVERLOAD_PAUSE,
+    .transparent_port = 0,
+    .tcp_nodelay = 1,
+    .tcp_defer_accept = 0,
+    .tcp_fastopen = 0,
+    .tcp_sndbuf = 0,
+    .tcp_rcvbuf = 0,
+    .tcp_notsent_lowat = 0,
+    .tcp_keepalive = 0,
+    .drain_timeout = 30,
+    .upgrade_fd = -1,
+    .trace_sample = 0,
+    .trace_slow = 0,
+    .policy = NULL,
+    .users = NULL,
+    .auth_cache = 4096,
+    .auth_threads = 2,
+    .cache_dir = NULL,
+    .cache_size = 256,
+    .cache_object_max = 8,
+    .cpus = NULL,
+    .steering = STEER_NONE,
+};
+
+enum conn_state { CONN_READ_REQUEST, CONN_VERIFYING, CONN_RESOLVING, CONN_CONNECTING, CONN_HANDSHAKE, CONN_RELAY, CONN_FLUSH_CLOSE, CONN_CLOSED };
+enum request_action { REQUEST_INCOMPLETE, REQUEST_RESPOND, REQUEST_RESOLVING, REQUEST_DIAL, REQUEST_REUSE, REQUEST_REJECT };
+enum body_kind { BODY_NONE, BODY_LENGTH, BODY_CHUNKED, BODY_UNTIL_CLOSE };
+enum chunk_state {
+    CHUNK_SIZE,
+    CHUNK_EXT,
+    CHUNK_SIZE_LF,
+    CHUNK_DATA,
+    CHUNK_DATA_CR,
+    CHUNK_DATA_LF,
+    CHUNK_TRAILER,
+    CHUNK_TRAILER_LF,
+    CHUNK_TRAILER_LINE
+};
+enum dns_state { DNS_PENDING, DNS_READY, DNS_FAILED };
+enum slot_phase { SLOT_HEADER, SLOT_DIALING, SLOT_RELAY };
+
+union sockaddr_any {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
+struct http_header {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+};
+
+/* A parsed request or response head; names and values point into the receive buffer. */
+struct http_message {
+    const char *method;
+    size_t method_len;
+    const char *target;
+    size_t target_len;
+    int minor_version;
+    int status;
+    size_t num_headers;
+    struct http_header headers[HTTP_MAX_HEADERS];
+};
+
+struct http_body {
+    int kind;
+    int state;
+    int digits;
+    int done;
+    int error;
+    uint64_t remaining;
+};
+
+struct response_head {
+    int status;
+    int keepalive;
+    struct http_body body;
+};
+
+struct http_exchange {
+    int active;
+    int head_request;
+    int client_keepalive;
+    int req_done;
+    int resp_head_done;
+    int resp_done;
+    struct http_body req_body;
+    struct response_head resp;
+};
+
+struct pool_idle {
+    int fd;
+    uint64_t since;
+};
+
+struct pool_host {
+    struct pool_host *next;
+    uint32_t hash;
+    int port;
+    int active;
+    int idle_count;
+    struct pool_idle idle[POOL_IDLE_PER_HOST_MAX];
+    char host[];
+};
+
+struct upstream_pool {
+    struct pool_host *buckets[POOL_BUCKETS];
+    int idle_total;
+    uint64_t last_sweep;
+};
+
+/* One client IP's buckets in GCRA form: each holds the time its debt is paid off, so a check is a single CAS. */
+struct rate_bucket {
+    uint32_t key;
+    uint64_t conn_tat;
+    uint64_t byte_tat;
+};
+
+struct rate_shard {
+    struct rate_bucket slots[RATE_SHARD_SLOTS];
+} __attribute__((aligned(64)));
+
+/* Monotonic stage times of one connection in microseconds, 0 for stages it never reached; all 0 while tracing is off.
+ * The names point into whoever owns the connection and are only read when it closes. */
+struct trace {
+    uint64_t at_us[TRACE_STAGES];
+    uint32_t queued_us;
+    const char *client_ip;
+    int client_port;
+    const char *host;
+    int port;
+};
+
+/* A finished connection as /traces reports it, with stage times relative to the accept. */
+struct trace_record {
+    int64_t time_ms;
+    char client[INET_ADDRSTRLEN + 6];
+    char target[272];
+    uint32_t queued_us;
+    int64_t stage_us[TRACE_STAGES];
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+};
+
+/* Borrowed from the worker's buffer slab only while bytes are held; NULL when the direction is idle. */
+struct relay_dir {
+    char *buf;
+    size_t off;
+    size_t len;
+    size_t fill;
+    int eof;
+    int shut;
+    int pipe_fds[2];
+    size_t piped;
+    int copy_only;
+    int fixed_buf;
+    int staged;
+    size_t size;
+    size_t want;
+    int small_reads;
+    int bytes_metric;
+    uint64_t bytes;
+    struct rate_bucket *rate;
+    uint64_t *tunnel_tat;
+    uint64_t resume_ms;
+    struct trace *trace;
+};
+
+struct upstream_table;
+
+/* One proxy from the upstream list; its latency average, pending dials and breaker are shared by all workers. */
+struct upstream {
+    union sockaddr_any addr;
+    struct upstream_table *table;
+    int type;
+    int port;
+    uint64_t ewma_us;
+    uint32_t pending;
+    uint32_t failures;
+    int breaker;
+    uint32_t cooldown_ms;
+    uint64_t open_until_ms;
+    char host[INET6_ADDRSTRLEN];
+};
+
+/* Published through an RCU pointer; each dial in progress holds a reference, as does the pointer itself. */
+struct upstream_table {
+    int count;
+    uint32_t refs;
+    struct upstream entries[];
+};
+
+/* A trie edge: the child of parent for one destination label, found by hashing the pair. */
+struct policy_edge {
+    uint32_t hash;
+    int32_t parent;
+    int32_t child;
+    uint32_t label;
+    uint32_t len;
+};
+
+/* Path-compressed radix node over IPv4 client addresses; the top len bits of prefix are significant. */
+struct policy_radix {
+    uint32_t prefix;
+    uint8_t len;
+    uint8_t action;
+    int32_t child[2];
+};
+
+/* A compiled --policy file. Destination suffixes form a trie keyed by label from the right, and each node with rules
+ * carries its own radix tree of client prefixes. Published through an RCU pointer, replaced whole on reload. */
+struct policy {
+    char *text;
+    struct policy_edge *edges;
+    uint32_t edge_mask;
+    int32_t nodes;
+    int32_t *roots;
+    struct policy_radix *radix;
+    int32_t radix_count;
+    int rules;
+    int actions[POLICY_ACTIONS];
+};
+
+enum auth_kind { AUTH_USER, AUTH_TOKEN };
+
+/* A user's password is stored as a PBKDF2-HMAC-SHA256 derivation; a bearer token, being random already, as its SHA-256. */
+struct auth_entry {
+    int kind;
+    uint32_t hash;
+    const char *name;
+    int iterations;
+    uint8_t salt[AUTH_SALT_MAX];
+    size_t salt_len;
+    uint8_t digest[32];
+};
+
+struct auth_cached {
+    uint8_t key[32];
+    int32_t chain;
+    int32_t prev;
+    int32_t next;
+};
+
+/* One lock's worth of the verified-credential LRU: chained buckets for lookup, a list from newest to oldest for eviction. */
+struct auth_shard {
+    pthread_mutex_t lock;
+    struct auth_cached *nodes;
+    int32_t *buckets;
+    uint32_t bucket_mask;
+    int32_t head;
+    int32_t tail;
+    int count;
+    int capacity;
+};
+
+/* A loaded --users file. Its cache goes with it, so a reload forgets every credential verified against the old store. */
+struct auth_store {
+    char *text;
+    struct auth_entry *entries;
+    int count;
+    int dummy_iterations;
+    int32_t *slots;
+    uint32_t slot_mask;
+    struct auth_shard shards[AUTH_CACHE_SHARDS];
+};
+
+/* Recent misses for one user name or client address; the slot is shared by whatever else hashes there. */
+struct auth_failure {
+    uint32_t key;
+    int count;
+    uint64_t seen_ms;
+    uint64_t until_ms;
+};
+
+/* A Proxy-Authorization value waiting for a verifier thread to derive its password hash. */
+struct auth_job {
+    struct auth_job *next;
+    struct conn *conn;
+    uint32_t client_addr;
+    size_t len;
+    char value[];
+};
+
+struct verifier {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct auth_job *head;
+    struct auth_job *tail;
+    int queued;
+};
+
+/* A stored response. The body sits in store blocks; the key, the head (hop-by-hop fields dropped, no blank line) and
+ * what the request sent for each Vary field share the allocation. Freed once evicted and no hit is still sending it. */
+struct cache_object {
+    struct cache_object *next;
+    struct cache_object *lru_prev;
+    struct cache_object *lru_next;
+    uint32_t hash;
+    int refs;
+    int indexed;
+    const char *key;
+    const char *head;
+    size_t head_len;
+    const char *vary_names;
+    const char *vary_values;
+    int64_t response_time;
+    int64_t initial_age;
+    int64_t lifetime;
+    uint64_t body_len;
+    uint32_t block_count;
+    uint32_t blocks[];
+};
+
+/* A key some client is fetching; lookups for it wait for that response instead of going upstream too. */
+struct cache_pending {
+    struct cache_pending *next;
+    uint32_t hash;
+    char key[];
+};
+
+/* Carried by a request from its lookup to its response. */
+struct cache_fill {
+    int cacheable;
+    uint32_t hash;
+    int64_t request_time;
+    struct cache_pending *pending;
+    char key[CACHE_KEY_MAX];
+};
+
+/* The --cache-dir store: an unlinked file of CACHE_BLOCK blocks mapped for writing and sent from with sendfile, an
+ * LRU index over it, and a count-min sketch of key popularity for TinyLFU admission. One lock covers all of it. */
+struct cache {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    int fd;
+    char *map;
+    uint32_t blocks;
+    uint32_t *free_blocks;
+    uint32_t free_count;
+    struct cache_object **buckets;
+    uint32_t bucket_mask;
+    struct cache_object *lru_head;
+    struct cache_object *lru_tail;
+    struct cache_pending *pending;
+    uint8_t *sketch;
+    uint32_t sketch_mask;
+    uint32_t sketch_ops;
+};
+
+struct sha256 {
+    uint32_t h[8];
+    uint8_t block[64];
+    uint64_t bytes;
+};
+
+struct policy_rule {
+    const char *destination;
+    uint32_t prefix;
+    int len;
+    int action;
+};
+
+struct upstream_probe {
+    size_t fill;
+    char buf[1024];
+};
+
+/* Per-thread read-side counter, odd while the thread is inside a read section. */
+struct rcu_reader {
+    struct rcu_reader *next;
+    int owned;
+    uint64_t ctr;
+};
+
+struct conn;
+
+struct timer {
+    struct timer *next;
+    struct timer **pprev;
+    uint64_t expires;
+    void *owner;
+};
+
+/* Hashed hierarchical timer wheel: a level's slots each span all the slots of the level below and cascade into it. */
+struct timer_wheel {
+    uint64_t now;
+    size_t count;
+    struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+};
+
+/* Thread engine: deadline state of a registry slot, guarded by the worker's timer lock. */
+struct slot_timer {
+    struct timer timer;
+    int phase;
+    int client_fd;
+    int remote_fd;
+    uint64_t accepted_ms;
+    uint64_t active_ms;
+};
+
+struct endpoint {
+    struct conn *conn;
+    int fd;
+};
+
+/* Addresses of a multi-address host and the attempts racing to them (RFC 8305); lives only while connecting. */
+struct dial {
+    struct dial *next;
+    int count;
+    int started;
+    uint64_t next_attempt_us;
+    union sockaddr_any addrs[DNS_MAX_ADDRS];
+    struct endpoint attempts[DNS_MAX_ADDRS];
+};
+
+struct conn {
+    struct worker *worker;
+    struct endpoint client;
+    struct endpoint remote;
+    int state;
+    int queued;
+    int inflight;
+    int connecting;
+    struct relay_dir up;
+    struct relay_dir down;
+    uint64_t tunnel_tat;
+    union sockaddr_any remote_addr;
+    int target_port;
+    int resolving;
+    int verifying;
+    int auth_verdict;
+    int dns_status;
+    struct conn *dns_next;
+    size_t head_scanned;
+    int tunnel;
+    int transparent;
+    int kept_alive;
+    uint64_t connect_start;
+    struct dial *dial;
+    struct timer timer;
+    uint64_t accepted_ms;
+    uint64_t request_ms;
+    uint64_t active_ms;
+    struct http_exchange http;
+    struct pool_host *pool_host;
+    struct upstream *upstream;
+    int attempts;
+    char *target_host;
+    char client_ip[INET_ADDRSTRLEN];
+    int client_port;
+    uint32_t client_addr;
+    struct trace trace;
+    struct conn *prev;
+    struct conn *next;
+    struct conn *ready_next;
+};
+
+struct dns_shard;
+
+struct dns_entry {
+    struct dns_entry *next;
+    struct dns_entry *job_next;
+    struct dns_shard *shard;
+    uint32_t hash;
+    int state;
+    uint64_t expires_ms;
+    int count;
+    union sockaddr_any addrs[DNS_MAX_ADDRS];
+    struct conn *waiters;
+    int sync_waiters;
+    struct dns_entry *lru_prev;
+    struct dns_entry *lru_next;
+    int listed;
+    char host[];
+};
+
+struct dns_shard {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int count;
+    struct dns_entry *buckets[DNS_BUCKETS];
+    struct dns_entry *lru_head;
+    struct dns_entry *lru_tail;
+};
+
+struct resolver {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct dns_entry *head;
+    struct dns_entry *tail;
+    int queued;
+    struct dns_shard shards[DNS_SHARDS];
+};
+
+struct mailbox {
+    pthread_mutex_t lock;
+    struct conn *head;
+    int efd;
+};
+
+struct pipe_pool {
+    pthread_mutex_t lock;
+    int count;
+    int fds[PIPE_POOL_MAX][2];
+};
+
+/* Fixed-size objects carved from large chunks; only the owning worker thread touches it. */
+struct slab {
+    size_t object_size;
+    void *free;
+    size_t in_use;
+    size_t allocated;
+};
+
+struct reactor {
+    struct worker *worker;
+    int epfd;
+    struct endpoint listener;
+    struct endpoint transparent;
+    struct endpoint mailbox;
+    struct conn *conns;
+    struct conn *ready;
+    struct conn *closed;
+    struct dial *retired_dials;
+    struct timer_wheel timers;
+    uint64_t now_ms;
+    uint64_t accept_resume_ms;
+    int draining;
+    int pooling;
+    struct upstream_pool pool;
+    struct slab conn_slab;
+    struct slab buffer_slabs[RELAY_BUFFER_CLASSES];
+};
+
+#ifdef HAVE_IO_URING
+struct uring {
+    int fd;
+    void *ring;
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;
+    unsigned to_submit;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    int multishot_accept;
+    int accept_armed[2];
+    int fixed_files;
+    unsigned file_slots;
+    char *buffers;
+    int free_buffers[URING_BUFFERS];
+    int free_buffer_count;
+    uint64_t mailbox_count;
+    struct __kernel_timespec connect_timeout;
+};
+#endif
+
+/* Live thread-engine client sockets. Free slots form a Treiber stack whose head carries an ABA tag. */
+struct registry_slot {
+    int fd;
+    uint32_t next;
+};
+
+struct conn_registry {
+    struct registry_slot *slots;
+    struct slot_timer *timers;
+    uint32_t size;
+    uint64_t free_head;
+};
+
+struct worker {
+    int id;
+    int cpu;
+    int node;
+    cpu_set_t node_cpus;
+    int listen_fd;
+    int transparent_fd;
+    pthread_t thread;
+    struct reactor reactor;
+    struct pipe_pool pipes;
+    struct mailbox mailbox;
+    struct conn_registry registry;
+    pthread_mutex_t timer_lock;
+};
+
+/* Listeners received from the process being upgraded, indexed by worker; -1 leaves a worker to bind its own. */
+struct handoff {
+    int *proxy_fds;
+    int *transparent_fds;
+    int count;
+    int admin_fd;
+};
+
+/* One listener per message on the upgrade socket; the descriptor itself rides along as SCM_RIGHTS. */
+struct handoff_msg {
+    int kind;
+    int index;
+};
+
+struct client_arg {
+    struct worker *worker;
+    struct rate_bucket *rate;
+    int fd;
+    int transparent;
+    struct trace trace;
+};
+
+/* Thread engine: a relayed connection, owned by its client thread together with both of its sockets. */
+struct tunnel {
+    struct worker *worker;
+    struct slot_timer *timer;
+    int slot;
+    int tunneled;
+    int client_fd;
+    int remote_fd;
+    struct relay_dir up;
+    struct relay_dir down;
+    uint64_t tunnel_tat;
+};
+
+struct log_entry {
+    int64_t time;
+    uint8_t kind;
+    uint8_t len;
+    char msg[LOG_MSG_MAX];
+};
+
+/* One per core, each on its own cache lines, so recording a metric never writes a line another core uses. */
+struct metrics_shard {
+    uint64_t counters[METRIC_COUNT];
+    uint64_t errors[ERROR_COUNT];
+    uint64_t connect_buckets[CONNECT_BUCKETS + 1];
+    uint64_t connect_sum_us;
+    uint64_t sockopts[SOCKOPT_COUNT][2];
+    uint64_t stage_buckets[TRACE_STAGES][TRACE_BUCKETS + 1];
+    uint64_t stage_sum_us[TRACE_STAGES];
+} __attribute__((aligned(64)));
+
+/* Single-producer ring owned by one thread at a time; the flusher is the only consumer. */
+struct log_ring {
+    struct log_ring *next;
+    int owned;
+    uint32_t head;
+    uint32_t tail;
+    uint64_t dropped;
+    struct log_entry entries[LOG_RING_SLOTS];
+};
 
-static int server_socket = -1;
 static volatile sig_atomic_t shutdown_flag = 0;
-static pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
-static int *all_connections = NULL;
-static int connection_count = 0;
+static struct worker *workers = NULL;
+static struct resolver resolver;
+static struct log_ring *log_rings = NULL;
+static int64_t log_clock = 0;
+static pthread_key_t log_ring_key;
+static pthread_once_t log_ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct log_ring *log_ring_self = NULL;
+static struct metrics_shard metrics_shards[METRICS_SHARDS];
+static __thread struct metrics_shard *metrics_self = NULL;
+static struct upstream_table *upstreams = NULL;
+static __thread uint64_t upstream_rng = 0;
+static pthread_mutex_t upstream_health_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t upstream_health_cond = PTHREAD_COND_INITIALIZER;
+static int upstream_reload_requested = 0;
+static struct policy *policy = NULL;
+static struct auth_store *auth_store = NULL;
+static struct verifier verifier = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+static pthread_mutex_t auth_fail_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct auth_failure auth_user_failures[AUTH_FAIL_SLOTS];
+static struct auth_failure auth_addr_failures[AUTH_FAIL_SLOTS];
+static struct cache cache = {.lock = PTHREAD_MUTEX_INITIALIZER, .filled = PTHREAD_COND_INITIALIZER, .fd = -1};
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t watch_cond = PTHREAD_COND_INITIALIZER;
+static int policy_reload_requested = 0;
+static int auth_reload_requested = 0;
+static struct rcu_reader *rcu_readers = NULL;
+static pthread_key_t rcu_reader_key;
+static pthread_once_t rcu_reader_key_once = PTHREAD_ONCE_INIT;
+static __thread struct rcu_reader *rcu_self = NULL;
+static struct rate_shard *rate_shards = NULL;
+static uint64_t global_byte_tat = 0;
+static int numa_nodes = 1;
+static int cpu_nodes[CPU_SETSIZE];
+static cpu_set_t node_cpus[NUMA_MAX_NODES];
+static uint32_t client_count = 0;
+static int draining = 0;
+static int handed_off = 0;
+static int admin_fd = -1;
+static struct handoff inherited = { .admin_fd = -1 };
+static char exe_path[PATH_MAX];
+static char **saved_argv = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct trace_record trace_ring[TRACE_RING];
+static uint64_t trace_written = 0;
+static uint64_t trace_finished = 0;
+
+static const struct {
+    const char *name;
+    const char *labels;
+    const char *type;
+    const char *help;
+} metric_info[] = {
+    [METRIC_ACCEPTED] = {"anonynet_accepted_connections_total", "", "counter", "Client connections accepted."},
+    [METRIC_CONNECTIONS] = {"anonynet_active_connections", "", "gauge", "Client connections currently open."},
+    [METRIC_TUNNELS] = {"anonynet_active_tunnels", "", "gauge", "CONNECT tunnels currently open."},
+    [METRIC_REQUESTS] = {"anonynet_http_requests_total", "", "counter", "Plain HTTP requests forwarded upstream."},
+    [METRIC_POOL_REUSED] = {"anonynet_upstream_pool_reused_total", "", "counter", "Plain HTTP requests sent on a pooled upstream connection."},
+    [METRIC_BYTES_UP] = {"anonynet_relayed_bytes_total", "{direction=\"upstream\"}", "counter", "Bytes read from one side and relayed to the other."},
+    [METRIC_BYTES_DOWN] = {"anonynet_relayed_bytes_total", "{direction=\"downstream\"}", "counter", ""},
+    [METRIC_DNS_HITS] = {"anonynet_dns_cache_lookups_total", "{result=\"hit\"}", "counter", "Resolver cache lookups, including negative hits."},
+    [METRIC_DNS_MISSES] = {"anonynet_dns_cache_lookups_total", "{result=\"miss\"}", "counter", ""},
+    [METRIC_UPSTREAM_DIALS] = {"anonynet_upstream_proxy_dials_total", "", "counter", "Connections dialed through an upstream proxy, retries included."},
+    [METRIC_UPSTREAM_EJECTIONS] = {"anonynet_upstream_proxy_ejections_total", "", "counter", "Times an upstream proxy's circuit breaker opened."},
+    [METRIC_UPSTREAM_RELOADS] = {"anonynet_upstream_list_reloads_total", "", "counter", "Upstream lists swapped in after a file change or SIGHUP."},
+    [METRIC_CONNECTION_LIMIT] = {"anonynet_connection_limit", "", "gauge", "Client connections admitted at once before accepting backs off."},
+    [METRIC_ACCEPT_PAUSES] = {"anonynet_accept_pauses_total", "", "counter", "Back-off intervals in which a worker left new clients in the backlog at the connection or fd limit."},
+    [METRIC_DRAINING] = {"anonynet_draining", "", "gauge", "1 once the process has stopped accepting and is waiting for open connections to finish."},
+    [METRIC_BUFFER_GROWS] = {"anonynet_relay_buffer_resizes_total", "{change=\"grow\"}", "counter", "Times a tunnel direction doubled or halved its relay buffer to fit the reads it saw."},
+    [METRIC_BUFFER_SHRINKS] = {"anonynet_relay_buffer_resizes_total", "{change=\"shrink\"}", "counter", ""},
+    [METRIC_POLICY_ALLOW] = {"anonynet_policy_decisions_total", "{action=\"allow\"}", "counter", "Requests and tunnels checked against the policy, by the action that applied."},
+    [METRIC_POLICY_DENY] = {"anonynet_policy_decisions_total", "{action=\"deny\"}", "counter", ""},
+    [METRIC_POLICY_UPSTREAM] = {"anonynet_policy_decisions_total", "{action=\"upstream\"}", "counter", ""},
+    [METRIC_POLICY_DIRECT] = {"anonynet_policy_decisions_total", "{action=\"direct\"}", "counter", ""},
+    [METRIC_POLICY_RULES] = {"anonynet_policy_rules", "", "gauge", "Rules in the policy currently in force."},
+    [METRIC_POLICY_RELOADS] = {"anonynet_policy_reloads_total", "", "counter", "Policies swapped in after a file change or SIGHUP."},
+    [METRIC_AUTH_VERIFIED] = {"anonynet_proxy_auth_total", "{result=\"verified\"}", "counter", "Proxy-Authorization checks by outcome; cached ones skipped the password hash."},
+    [METRIC_AUTH_CACHED] = {"anonynet_proxy_auth_total", "{result=\"cached\"}", "counter", ""},
+    [METRIC_AUTH_FAILED] = {"anonynet_proxy_auth_total", "{result=\"failed\"}", "counter", ""},
+    [METRIC_AUTH_THROTTLED] = {"anonynet_proxy_auth_total", "{result=\"throttled\"}", "counter", ""},
+    [METRIC_AUTH_RELOADS] = {"anonynet_user_store_reloads_total", "", "counter", "User stores swapped in after a file change or SIGHUP."},
+    [METRIC_CACHE_HITS] = {"anonynet_cache_lookups_total", "{result=\"hit\"}", "counter", "Plain-HTTP requests by what the response cache did with them."},
+    [METRIC_CACHE_MISSES] = {"anonynet_cache_lookups_total", "{result=\"miss\"}", "counter", ""},
+    [METRIC_CACHE_BYPASSES] = {"anonynet_cache_lookups_total", "{result=\"bypass\"}", "counter", ""},
+    [METRIC_CACHE_COALESCED] = {"anonynet_cache_coalesced_total", "", "counter", "Lookups that waited for another client's fetch of the same object instead of going upstream."},
+    [METRIC_CACHE_STORED] = {"anonynet_cache_admissions_total", "{result=\"stored\"}", "counter", "Cacheable responses stored, or turned away because their key was used less than the object they would evict."},
+    [METRIC_CACHE_REJECTED] = {"anonynet_cache_admissions_total", "{result=\"rejected\"}", "counter", ""},
+    [METRIC_CACHE_EVICTIONS] = {"anonynet_cache_evictions_total", "", "counter", "Stored responses evicted to make room."},
+    [METRIC_CACHE_BYTES] = {"anonynet_cache_bytes", "", "gauge", "Body bytes of the responses currently stored."},
+    [METRIC_SHAPE_TUNNEL] = {"anonynet_bandwidth_pauses_total", "{level=\"tunnel\"}", "counter", "Times a relay direction stopped reading until a bandwidth bucket had room, by the bucket that held it longest."},
+    [METRIC_SHAPE_CLIENT] = {"anonynet_bandwidth_pauses_total", "{level=\"client\"}", "counter", ""},
+    [METRIC_SHAPE_GLOBAL] = {"anonynet_bandwidth_pauses_total", "{level=\"global\"}", "counter", ""},
+    [METRIC_STEER_MISSES] = {"anonynet_steering_misses_total", "", "counter", "Connections accepted by a pinned worker on another CPU than the one their packets arrived on."},
+};
+
+static const char *close_reasons[ERROR_COUNT] = {
+    [ERROR_HEADER_TIMEOUT] = "Client sent no complete request in time",
+    [ERROR_IDLE_TIMEOUT] = "Closing idle connection",
+    [ERROR_LIFETIME] = "Connection reached its maximum lifetime",
+    [ERROR_RATE_LIMIT] = "Client over its connection rate limit",
+    [ERROR_BANDWIDTH_LIMIT] = "Client over its bandwidth limit",
+    [ERROR_POLICY] = "Destination denied by policy",
+    [ERROR_AUTH] = "Proxy authentication failed",
+};
+
+static const char bad_gateway_response[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char proxy_auth_response[] = "HTTP/1.1 407 Proxy Authentication Required\r\nProxy-Authenticate: Basic realm=\"AnonyNet\"\r\n"
+                                          "Content-Length: 0\r\nConnection: close\r\n\r\n";
+static const char gateway_timeout_response[] = "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char forbidden_response[] = "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char service_unavailable_response[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nRetry-After: 1\r\nConnection: close\r\n\r\n";
+
+static const char *error_cause_names[] = {
+    [ERROR_BAD_REQUEST] = "bad_request",
+    [ERROR_DNS] = "dns",
+    [ERROR_CONNECT] = "connect",
+    [ERROR_UPSTREAM_LIMIT] = "upstream_limit",
+    [ERROR_CAPACITY] = "capacity",
+    [ERROR_RESOURCE] = "resource",
+    [ERROR_ACCEPT] = "accept",
+    [ERROR_UPSTREAM] = "upstream_proxy",
+    [ERROR_CONNECT_TIMEOUT] = "connect_timeout",
+    [ERROR_HEADER_TIMEOUT] = "header_timeout",
+    [ERROR_IDLE_TIMEOUT] = "idle_timeout",
+    [ERROR_LIFETIME] = "max_lifetime",
+    [ERROR_RATE_LIMIT] = "rate_limit",
+    [ERROR_BANDWIDTH_LIMIT] = "bandwidth_limit",
+    [ERROR_POLICY] = "policy",
+    [ERROR_AUTH] = "auth",
+};
+
+static const char *sockopt_names[] = {
+    [SOCKOPT_NODELAY] = "nodelay",
+    [SOCKOPT_DEFER_ACCEPT] = "defer_accept",
+    [SOCKOPT_FASTOPEN] = "fastopen",
+    [SOCKOPT_SNDBUF] = "sndbuf",
+    [SOCKOPT_RCVBUF] = "rcvbuf",
+    [SOCKOPT_NOTSENT_LOWAT] = "notsent_lowat",
+    [SOCKOPT_KEEPALIVE] = "keepalive",
+};
+
+/* Upper bounds of the upstream connect latency buckets, in microseconds. */
+static const uint64_t connect_bucket_us[CONNECT_BUCKETS] = {
+    500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+
+/* Upper bounds of the connection stage buckets, in microseconds; closed spans whole connections, hence the long tail. */
+static const uint64_t trace_bucket_us[TRACE_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000, 2500000, 10000000, 60000000
+};
+
+/* Each stage is timed from the nearest stage before it that the connection reached, following from;
+ * accepted itself is the time spent in the listen queue. */
+static const struct {
+    const char *name;
+    int from;
+} trace_stages[TRACE_STAGES] = {
+    [TRACE_ACCEPTED] = {"accepted", TRACE_ACCEPTED},
+    [TRACE_PARSED] = {"request_parsed", TRACE_ACCEPTED},
+    [TRACE_RESOLVED] = {"dns_resolved", TRACE_PARSED},
+    [TRACE_CONNECTED] = {"upstream_connected", TRACE_RESOLVED},
+    [TRACE_ESTABLISHED] = {"established", TRACE_CONNECTED},
+    [TRACE_FIRST_UP] = {"first_byte_upstream", TRACE_ESTABLISHED},
+    [TRACE_FIRST_DOWN] = {"first_byte_downstream", TRACE_ESTABLISHED},
+    [TRACE_CLOSED] = {"closed", TRACE_ACCEPTED},
+};
+
+static const struct {
+    const char *color;
+    const char *name;
+    int level;
+} log_kinds[] = {
+    [LOG_KIND_ERROR] = {"\033[91m", "ERROR", LOG_LEVEL_ERROR},
+    [LOG_KIND_WARN] = {"\033[93m", "WARN", LOG_LEVEL_WARN},
+    [LOG_KIND_INFO] = {"\033[92m", "INFO", LOG_LEVEL_INFO},
+    [LOG_KIND_HTTP] = {"\033[94m", "HTTP", LOG_LEVEL_ACCESS},
+    [LOG_KIND_HTTPS] = {"\033[95m", "HTTPS", LOG_LEVEL_ACCESS},
+};
 
-void get_timestamp(char *buffer, size_t size) {
-    time_t now = time(NULL);
-    struct tm *tm_info = localtime(&now);
-    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", tm_info);
+void log_ring_release(void *arg) {
+    struct log_ring *ring = arg;
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
 }
 
-void log_msg(const char *level_color, const char *level, const char *msg) {
-    char timestamp[20];
-    get_timestamp(timestamp, sizeof(timestamp));
-    printf("%s[%s] [%s]\033[0m %s\n", level_color, timestamp, level, msg);
+void log_ring_key_init(void) {
+    pthread_key_create(&log_ring_key, log_ring_release);
 }
 
-#define LOG_INFO(msg) log_msg("\033[92m", "INFO", msg)
-#define LOG_WARN(msg) log_msg("\033[93m", "WARN", msg)
-#define LOG_ERROR(msg) log_msg("\033[91m", "ERROR", msg)
-#define LOG_HTTP(msg) log_msg("\033[94m", "HTTP", msg)
-#define LOG_HTTPS(msg) log_msg("\033[95m", "HTTPS", msg)
+/* Adopts a ring left behind by an exited thread, or links a new one onto the lock-free list. */
+struct log_ring *log_ring_get(void) {
+    if (log_ring_self) return log_ring_self;
+    pthread_once(&log_ring_key_once, log_ring_key_init);
 
-void *forward(void *arg) {
-    int *sockets = (int *)arg;
-    int src = sockets[0];
-    int dst = sockets[1];
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes;
+    struct log_ring *ring;
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(*ring));
+        if (!ring) return NULL;
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&log_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(log_ring_key, ring);
+    log_ring_self = ring;
+    return ring;
+}
 
-    while (!shutdown_flag) {
-        bytes = recv(src, buffer, BUFFER_SIZE, 0);
-        if (bytes <= 0) break;
-        if (send(dst, buffer, bytes, 0) <= 0) break;
+int log_enabled(int kind) {
+    return log_kinds[kind].level <= config.log_level;
+}
+
+/* Never blocks: the message is copied into this thread's ring, or counted as dropped when it is full. */
+void log_msg(int kind, const char *msg) {
+    if (!log_enabled(kind)) return;
+    struct log_ring *ring = log_ring_get();
+    if (!ring) return;
+
+    uint32_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return;
     }
 
-    close(src);
-    close(dst);
-    free(sockets);
-    return NULL;
+    struct log_entry *e = &ring->entries[head % LOG_RING_SLOTS];
+    int64_t now = __atomic_load_n(&log_clock, __ATOMIC_RELAXED);
+    e->time = now ? now : time(NULL);
+    e->kind = kind;
+    size_t len = strnlen(msg, LOG_MSG_MAX);
+    memcpy(e->msg, msg, len);
+    e->len = len;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
 }
 
-void cleanup_connection(int client_socket) {
-    pthread_mutex_lock(&connections_mutex);
-    for (int i = 0; i < connection_count; i++) {
-        if (all_connections[i] == client_socket) {
-            all_connections[i] = all_connections[--connection_count];
-            break;
+size_t log_format_entry(char *out, size_t size, const char *timestamp, int kind, const char *msg, size_t len) {
+    if (config.log_format == LOG_FORMAT_TEXT) {
+        return snprintf(out, size, "%s[%s] [%s]\033[0m %.*s\n", log_kinds[kind].color, timestamp, log_kinds[kind].name, (int)len, msg);
+    }
+
+    size_t n = snprintf(out, size, "{\"time\":\"%s\",\"level\":\"%s\",\"msg\":\"", timestamp, log_kinds[kind].name);
+    for (size_t i = 0; i < len && n + 8 < size; i++) {
+        unsigned char ch = msg[i];
+        if (ch == '"' || ch == '\\') {
+            out[n++] = '\\';
+            out[n++] = ch;
+        } else if (ch < 0x20) {
+            n += snprintf(out + n, size - n, "\\u%04x", ch);
+        } else {
+            out[n++] = ch;
         }
     }
-    pthread_mutex_unlock(&connections_mutex);
-    shutdown(client_socket, SHUT_RDWR);
-    close(client_socket);
+    return n + snprintf(out + n, size - n, "\"}\n");
 }
 
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    free(arg);
+void log_write(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t written = write(STDOUT_FILENO, buf, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += written;
+        len -= written;
+    }
+}
 
-    struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
-    getpeername(client_socket, (struct sockaddr *)&client_addr, &addr_len);
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    int client_port = ntohs(client_addr.sin_port);
+/* Drains every ring to stdout in batches. Timestamps are formatted once per distinct second. */
+void log_flush(void) {
+    static char out[LOG_OUTPUT_BUFFER];
+    static int64_t formatted_time = -1;
+    static char timestamp[32];
+    size_t used = 0;
 
-    pthread_mutex_lock(&connections_mutex);
-    all_connections = realloc(all_connections, (connection_count + 1) * sizeof(int));
-    all_connections[connection_count++] = client_socket;
-    pthread_mutex_unlock(&connections_mutex);
+    pthread_mutex_lock(&log_flush_lock);
+    for (struct log_ring *ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring; ring = ring->next) {
+        uint32_t tail = ring->tail;
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
 
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-    if (bytes <= 0) {
-        cleanup_connection(client_socket);
-        return NULL;
+        for (; tail != head; tail++) {
+            struct log_entry *e = &ring->entries[tail % LOG_RING_SLOTS];
+            if (e->time != formatted_time) {
+                time_t t = e->time;
+                struct tm tm_info;
+                localtime_r(&t, &tm_info);
+                strftime(timestamp, sizeof(timestamp), config.log_format == LOG_FORMAT_JSON ? "%Y-%m-%dT%H:%M:%S%z" : "%Y-%m-%d %H:%M:%S", &tm_info);
+                formatted_time = e->time;
+            }
+            if (used + LOG_MSG_MAX * 6 + 128 > sizeof(out)) {
+                log_write(out, used);
+                used = 0;
+            }
+            used += log_format_entry(out + used, sizeof(out) - used, timestamp, e->kind, e->msg, e->len);
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+        uint64_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            if (used + 256 > sizeof(out)) {
+                log_write(out, used);
+                used = 0;
+            }
+            char note[64];
+            int len = snprintf(note, sizeof(note), "%llu log messages dropped", (unsigned long long)dropped);
+            used += log_format_entry(out + used, sizeof(out) - used, timestamp, LOG_KIND_WARN, note, len);
+        }
     }
-    buffer[bytes] = '\0';
+    log_write(out, used);
+    pthread_mutex_unlock(&log_flush_lock);
+}
 
-    char *first_line = strtok(buffer, "\n");
-    if (!first_line) {
-        cleanup_connection(client_socket);
-        return NULL;
+void *log_flusher_main(void *arg) {
+    (void)arg;
+    struct timespec interval = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+    for (;;) {
+        __atomic_store_n(&log_clock, (int64_t)time(NULL), __ATOMIC_RELAXED);
+        log_flush();
+        nanosleep(&interval, NULL);
     }
+    return NULL;
+}
 
-    char method[16], path[256], protocol[16];
-    if (sscanf(first_line, "%15s %255s %15s", method, path, protocol) != 3) {
-        cleanup_connection(client_socket);
-        return NULL;
+void log_init(void) {
+    __atomic_store_n(&log_clock, (int64_t)time(NULL), __ATOMIC_RELAXED);
+    atexit(log_flush);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_flusher_main, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
     }
+    pthread_detach(tid);
+}
 
-    if (strcmp(method, "CONNECT") == 0) {
-        char host[256];
-        int port;
-        if (sscanf(path, "%255[^:]:%d", host, &port) != 2) {
-            cleanup_connection(client_socket);
-            return NULL;
-        }
+uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-        char log_msg_buf[512];
-        snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> CONNECT %s:%d", client_ip, client_port, host, port);
-        LOG_HTTPS(log_msg_buf);
+uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-        struct hostent *he = gethostbyname(host);
-        if (!he) {
-            LOG_ERROR("Failed to resolve host");
-            cleanup_connection(client_socket);
-            return NULL;
-        }
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct metrics_shard *metrics_local(void) {
+    if (!metrics_self) {
+        int cpu = sched_getcpu();
+        metrics_self = &metrics_shards[(cpu < 0 ? 0 : cpu) % METRICS_SHARDS];
+    }
+    return metrics_self;
+}
 
-        struct sockaddr_in remote_addr = {0};
-        remote_addr.sin_family = AF_INET;
-        remote_addr.sin_port = htons(port);
-        memcpy(&remote_addr.sin_addr, he->h_addr_list[0], he->h_length);
+/* Relaxed adds on a core-local line; gauges go through here too, with negative deltas. */
+void metrics_add(int metric, int64_t delta) {
+    __atomic_fetch_add(&metrics_local()->counters[metric], (uint64_t)delta, __ATOMIC_RELAXED);
+}
 
-        int remote_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (remote_socket < 0 || connect(remote_socket, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0) {
-            LOG_ERROR("Failed to connect to remote host");
-            cleanup_connection(client_socket);
-            return NULL;
-        }
+void metrics_error(int cause) {
+    __atomic_fetch_add(&metrics_local()->errors[cause], 1, __ATOMIC_RELAXED);
+}
 
-        const char *response = "HTTP/1.1 200 Connection Established\r\n\r\n";
-        send(client_socket, response, strlen(response), 0);
+void metrics_observe_connect(uint64_t elapsed_us) {
+    struct metrics_shard *m = metrics_local();
+    int bucket = 0;
+    while (bucket < CONNECT_BUCKETS && elapsed_us > connect_bucket_us[bucket]) bucket++;
+    __atomic_fetch_add(&m->connect_buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->connect_sum_us, elapsed_us, __ATOMIC_RELAXED);
+}
 
-        int *s1 = malloc(2 * sizeof(int));
-        int *s2 = malloc(2 * sizeof(int));
-        s1[0] = client_socket; s1[1] = remote_socket;
-        s2[0] = remote_socket; s2[1] = client_socket;
+void metrics_observe_stage(int stage, uint64_t elapsed_us) {
+    struct metrics_shard *m = metrics_local();
+    int bucket = 0;
+    while (bucket < TRACE_BUCKETS && elapsed_us > trace_bucket_us[bucket]) bucket++;
+    __atomic_fetch_add(&m->stage_buckets[stage][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&m->stage_sum_us[stage], elapsed_us, __ATOMIC_RELAXED);
+}
 
-        pthread_t t1, t2;
-        pthread_create(&t1, NULL, forward, s1);
-        pthread_create(&t2, NULL, forward, s2);
-        pthread_detach(t1);
-        pthread_detach(t2);
-    } else {
-        if (strcmp(method, "GET") == 0 && strcmp(path, "/") == 0) {
-            char log_msg_buf[256];
-            snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> health check", client_ip, client_port);
-            LOG_INFO(log_msg_buf);
+int trace_enabled(void) {
+    return config.trace_sample > 0 || config.trace_slow > 0;
+}
 
-            const char *response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK";
-            send(client_socket, response, strlen(response), 0);
-            cleanup_connection(client_socket);
-            return NULL;
+/* Stamps the accept. The kernel keeps no handshake time, so the listen-queue wait is read as the time since
+ * the client's last ACK: exact for a client that has sent nothing yet, otherwise a lower bound. */
+void trace_start(struct trace *t, int fd) {
+    memset(t, 0, sizeof(*t));
+    if (!trace_enabled()) return;
+    t->at_us[TRACE_ACCEPTED] = now_us();
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0) t->queued_us = info.tcpi_last_ack_recv * 1000;
+}
+
+/* Keeps the first time a stage is reached, so first bytes and keep-alive requests stamp once per connection. */
+void trace_mark(struct trace *t, int stage) {
+    if (t && t->at_us[TRACE_ACCEPTED] && !t->at_us[stage]) t->at_us[stage] = now_us();
+}
+
+/* Copies s into a JSON string body, dropping what would need escaping. */
+void trace_copy(char *out, size_t size, const char *s) {
+    size_t n = 0;
+    for (; *s && n + 1 < size; s++) {
+        if ((unsigned char)*s >= 0x20 && *s != '"' && *s != '\\' && *s != 0x7f) out[n++] = *s;
+    }
+    out[n] = '\0';
+}
+
+/* Feeds a closed connection's stages to the histograms, and keeps it for /traces when sampled or when its
+ * setup (accept to established, or to close if it never got there) ran past --trace-slow. */
+void trace_finish(struct trace *t, uint64_t up, uint64_t down) {
+    if (!t->at_us[TRACE_ACCEPTED]) return;
+    trace_mark(t, TRACE_CLOSED);
+    metrics_observe_stage(TRACE_ACCEPTED, t->queued_us);
+    for (int stage = TRACE_PARSED; stage < TRACE_STAGES; stage++) {
+        if (!t->at_us[stage]) continue;
+        int from = trace_stages[stage].from;
+        while (!t->at_us[from]) from = trace_stages[from].from;
+        metrics_observe_stage(stage, t->at_us[stage] - t->at_us[from]);
+    }
+
+    uint64_t setup_us = (t->at_us[TRACE_ESTABLISHED] ? t->at_us[TRACE_ESTABLISHED] : t->at_us[TRACE_CLOSED]) - t->at_us[TRACE_ACCEPTED] + t->queued_us;
+    uint64_t seq = __atomic_fetch_add(&trace_finished, 1, __ATOMIC_RELAXED);
+    int sampled = config.trace_sample > 0 && seq % config.trace_sample == 0;
+    if (!sampled && (config.trace_slow <= 0 || setup_us < (uint64_t)config.trace_slow * 1000)) return;
+
+    struct trace_record record;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    record.time_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    snprintf(record.client, sizeof(record.client), "%s:%d", t->client_ip ? t->client_ip : "", t->client_port);
+    char target[sizeof(record.target)] = "";
+    if (t->host) snprintf(target, sizeof(target), "%s:%d", t->host, t->port);
+    trace_copy(record.target, sizeof(record.target), target);
+    record.queued_us = t->queued_us;
+    for (int stage = 0; stage < TRACE_STAGES; stage++) record.stage_us[stage] = t->at_us[stage] ? (int64_t)(t->at_us[stage] - t->at_us[TRACE_ACCEPTED]) : -1;
+    record.bytes_up = up;
+    record.bytes_down = down;
+
+    pthread_mutex_lock(&trace_lock);
+    trace_ring[trace_written++ % TRACE_RING] = record;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/* The kept records, oldest first, one JSON object per line; stage times are microseconds after the accept. */
+size_t trace_render(char *out, size_t size) {
+    size_t n = 0;
+    pthread_mutex_lock(&trace_lock);
+    uint64_t first = trace_written > TRACE_RING ? trace_written - TRACE_RING : 0;
+    for (uint64_t i = first; i < trace_written && n < size; i++) {
+        const struct trace_record *record = &trace_ring[i % TRACE_RING];
+        n += snprintf(out + n, size - n, "{\"time\":%lld,\"client\":\"%s\",\"target\":\"%s\",\"queued_us\":%u", (long long)record->time_ms,
+                      record->client, record->target, record->queued_us);
+        for (int stage = TRACE_PARSED; stage < TRACE_STAGES && n < size; stage++) {
+            if (record->stage_us[stage] >= 0) n += snprintf(out + n, size - n, ",\"%s_us\":%lld", trace_stages[stage].name, (long long)record->stage_us[stage]);
         }
+        if (n < size) n += snprintf(out + n, size - n, ",\"bytes_up\":%llu,\"bytes_down\":%llu}\n", (unsigned long long)record->bytes_up, (unsigned long long)record->bytes_down);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return n < size ? n : size - 1;
+}
 
-        char *host_line = strstr(buffer, "Host:");
-        if (!host_line) {
-            LOG_WARN("No Host header");
-            cleanup_connection(client_socket);
-            return NULL;
+uint64_t metrics_sum(const uint64_t *first) {
+    size_t offset = first - (const uint64_t *)&metrics_shards[0];
+    uint64_t total = 0;
+    for (int i = 0; i < METRICS_SHARDS; i++) total += __atomic_load_n((const uint64_t *)&metrics_shards[i] + offset, __ATOMIC_RELAXED);
+    return total;
+}
+
+void metrics_sockopt(int option, int ok) {
+    __atomic_fetch_add(&metrics_local()->sockopts[option][!ok], 1, __ATOMIC_RELAXED);
+}
+
+/* Buffer sizes are read back: the kernel silently clamps them to net.core.[rw]mem_max. */
+int sockopt_set(int fd, int option, int level, int name, int value) {
+    int ok = setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+    if (ok && (option == SOCKOPT_SNDBUF || option == SOCKOPT_RCVBUF)) {
+        int actual = 0;
+        socklen_t len = sizeof(actual);
+        ok = getsockopt(fd, level, name, &actual, &len) == 0 && actual >= value;
+    }
+    metrics_sockopt(option, ok);
+    return ok ? 0 : -1;
+}
+
+/* The per-connection half of the socket profile. Accepted sockets are cloned from their
+ * listener with these already set, so only listeners and upstream sockets come through here. */
+void socket_tune(int fd) {
+    if (config.tcp_nodelay) sockopt_set(fd, SOCKOPT_NODELAY, IPPROTO_TCP, TCP_NODELAY, 1);
+    if (config.tcp_notsent_lowat > 0) sockopt_set(fd, SOCKOPT_NOTSENT_LOWAT, IPPROTO_TCP, TCP_NOTSENT_LOWAT, config.tcp_notsent_lowat);
+    if (config.tcp_sndbuf > 0) sockopt_set(fd, SOCKOPT_SNDBUF, SOL_SOCKET, SO_SNDBUF, config.tcp_sndbuf);
+    if (config.tcp_rcvbuf > 0) sockopt_set(fd, SOCKOPT_RCVBUF, SOL_SOCKET, SO_RCVBUF, config.tcp_rcvbuf);
+    if (config.tcp_keepalive > 0) {
+        int on = 1, probes = KEEPALIVE_PROBES;
+        int interval = config.tcp_keepalive / KEEPALIVE_PROBES > 0 ? config.tcp_keepalive / KEEPALIVE_PROBES : 1;
+        int ok = setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == 0 &&
+                 setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &config.tcp_keepalive, sizeof(config.tcp_keepalive)) == 0 &&
+                 setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval)) == 0 &&
+                 setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes)) == 0;
+        metrics_sockopt(SOCKOPT_KEEPALIVE, ok);
+    }
+}
+
+int remote_socket_open(int family, int flags) {
+    int fd = socket(family, SOCK_STREAM | flags, 0);
+    if (fd >= 0) socket_tune(fd);
+    return fd;
+}
+
+/* Prometheus text exposition format, summed across shards. */
+size_t metrics_render(char *out, size_t size) {
+    size_t n = 0;
+    for (int m = 0; m < METRIC_COUNT && n < size; m++) {
+        if (metric_info[m].help[0]) {
+            n += snprintf(out + n, size - n, "# HELP %s %s\n# TYPE %s %s\n", metric_info[m].name, metric_info[m].help, metric_info[m].name, metric_info[m].type);
         }
+        if (n < size) n += snprintf(out + n, size - n, "%s%s %lld\n", metric_info[m].name, metric_info[m].labels, (long long)metrics_sum(&metrics_shards[0].counters[m]));
+    }
 
-        char host[256];
-        sscanf(host_line, "Host: %255s", host);
+    uint64_t hits = metrics_sum(&metrics_shards[0].counters[METRIC_DNS_HITS]);
+    uint64_t misses = metrics_sum(&metrics_shards[0].counters[METRIC_DNS_MISSES]);
+    if (n < size) n += snprintf(out + n, size - n, "# HELP anonynet_dns_cache_hit_ratio Share of resolver lookups answered from the cache.\n"
+                                     "# TYPE anonynet_dns_cache_hit_ratio gauge\nanonynet_dns_cache_hit_ratio %.4f\n",
+                  hits + misses ? (double)hits / (hits + misses) : 0.0);
 
-        struct hostent *he = gethostbyname(host);
-        if (!he) {
-            LOG_ERROR("Failed to resolve host");
-            cleanup_connection(client_socket);
-            return NULL;
+    if (n < size) n += snprintf(out + n, size - n, "# HELP anonynet_errors_total Failed connections and requests by cause.\n# TYPE anonynet_errors_total counter\n");
+    for (int e = 0; e < ERROR_COUNT && n < size; e++) {
+        n += snprintf(out + n, size - n, "anonynet_errors_total{cause=\"%s\"} %llu\n", error_cause_names[e], (unsigned long long)metrics_sum(&metrics_shards[0].errors[e]));
+    }
+
+    if (n < size) n += snprintf(out + n, size - n, "# HELP anonynet_socket_options_total Socket profile options set, by whether the kernel took them as asked.\n"
+                                     "# TYPE anonynet_socket_options_total counter\n");
+    for (int o = 0; o < SOCKOPT_COUNT && n < size; o++) {
+        for (int failed = 0; failed < 2 && n < size; failed++) {
+            n += snprintf(out + n, size - n, "anonynet_socket_options_total{option=\"%s\",result=\"%s\"} %llu\n", sockopt_names[o], failed ? "failed" : "applied",
+                          (unsigned long long)metrics_sum(&metrics_shards[0].sockopts[o][failed]));
         }
+    }
 
-        struct sockaddr_in remote_addr = {0};
-        remote_addr.sin_family = AF_INET;
-        remote_addr.sin_port = htons(80);
-        memcpy(&remote_addr.sin_addr, he->h_addr_list[0], he->h_length);
+    if (n < size) n += snprintf(out + n, size - n, "# HELP anonynet_upstream_connect_seconds Time to establish upstream TCP connections.\n"
+                                     "# TYPE anonynet_upstream_connect_seconds histogram\n");
+    uint64_t cumulative = 0;
+    for (int b = 0; b <= CONNECT_BUCKETS && n < size; b++) {
+        cumulative += metrics_sum(&metrics_shards[0].connect_buckets[b]);
+        if (b < CONNECT_BUCKETS) n += snprintf(out + n, size - n, "anonynet_upstream_connect_seconds_bucket{le=\"%g\"} %llu\n", connect_bucket_us[b] / 1e6, (unsigned long long)cumulative);
+        else n += snprintf(out + n, size - n, "anonynet_upstream_connect_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)cumulative);
+    }
+    if (n < size) n += snprintf(out + n, size - n, "anonynet_upstream_connect_seconds_sum %.6f\nanonynet_upstream_connect_seconds_count %llu\n",
+                  metrics_sum(&metrics_shards[0].connect_sum_us) / 1e6, (unsigned long long)cumulative);
 
-        int remote_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (remote_socket < 0 || connect(remote_socket, (struct sockaddr *)&remote_addr, sizeof(remote_addr)) < 0) {
-            LOG_ERROR("Failed to connect to remote host");
-            cleanup_connection(client_socket);
-            return NULL;
+    if (!trace_enabled()) return n < size ? n : size - 1;
+    if (n < size) n += snprintf(out + n, size - n, "# HELP anonynet_connection_stage_seconds Time each connection took to reach a stage from the stage before it; closed is its whole life.\n"
+                                     "# TYPE anonynet_connection_stage_seconds histogram\n");
+    for (int stage = 0; stage < TRACE_STAGES && n < size; stage++) {
+        cumulative = 0;
+        for (int b = 0; b <= TRACE_BUCKETS && n < size; b++) {
+            cumulative += metrics_sum(&metrics_shards[0].stage_buckets[stage][b]);
+            if (b < TRACE_BUCKETS) n += snprintf(out + n, size - n, "anonynet_connection_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", trace_stages[stage].name, trace_bucket_us[b] / 1e6, (unsigned long long)cumulative);
+            else n += snprintf(out + n, size - n, "anonynet_connection_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", trace_stages[stage].name, (unsigned long long)cumulative);
         }
+        if (n < size) {
+            n += snprintf(out + n, size - n, "anonynet_connection_stage_seconds_sum{stage=\"%s\"} %.6f\nanonynet_connection_stage_seconds_count{stage=\"%s\"} %llu\n", trace_stages[stage].name,
+                          metrics_sum(&metrics_shards[0].stage_sum_us[stage]) / 1e6, trace_stages[stage].name, (unsigned long long)cumulative);
+        }
+    }
+    return n < size ? n : size - 1;
+}
 
-        send(remote_socket, buffer, bytes, 0);
+#define LOG_INFO(msg) log_msg(LOG_KIND_INFO, msg)
+#define LOG_WARN(msg) log_msg(LOG_KIND_WARN, msg)
+#define LOG_ERROR(msg) log_msg(LOG_KIND_ERROR, msg)
+#define LOG_HTTP(msg) log_msg(LOG_KIND_HTTP, msg)
+#define LOG_HTTPS(msg) log_msg(LOG_KIND_HTTPS, msg)
+
+int rate_bucket_idle(struct rate_bucket *b, uint64_t now) {
+    return __atomic_load_n(&b->conn_tat, __ATOMIC_RELAXED) <= now && __atomic_load_n(&b->byte_tat, __ATOMIC_RELAXED) <= now;
+}
 
-        int *s1 = malloc(2 * sizeof(int));
-        int *s2 = malloc(2 * sizeof(int));
-        s1[0] = client_socket; s1[1] = remote_socket;
-        s2[0] = remote_socket; s2[1] = client_socket;
+/* Keys are claimed by CAS and never cleared. A paid-off bucket is as good as a fresh one, so a full probe window
+ * takes one over for the new address; with none idle the client is admitted unmetered rather than refused. */
+struct rate_bucket *rate_lookup(uint32_t addr, uint64_t now) {
+    uint32_t h = addr * 2654435761u;
+    struct rate_shard *shard = &rate_shards[h >> 26];
+    uint32_t start = h >> 10;
+    struct rate_bucket *idle = NULL;
 
-        pthread_t t1, t2;
-        pthread_create(&t1, NULL, forward, s1);
-        pthread_create(&t2, NULL, forward, s2);
-        pthread_detach(t1);
-        pthread_detach(t2);
+    for (int i = 0; i < RATE_PROBE; i++) {
+        struct rate_bucket *b = &shard->slots[(start + i) % RATE_SHARD_SLOTS];
+        uint32_t key = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+        if (key == 0 && __atomic_compare_exchange_n(&b->key, &key, addr, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return b;
+        if (key == addr) return b;
+        if (!idle && rate_bucket_idle(b, now)) idle = b;
     }
 
+    if (idle) {
+        uint32_t key = __atomic_load_n(&idle->key, __ATOMIC_ACQUIRE);
+        if (key == addr) return idle;
+        if (rate_bucket_idle(idle, now) && __atomic_compare_exchange_n(&idle->key, &key, addr, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return idle;
+    }
     return NULL;
 }
 
-void shutdown_server(int sig) {
-    (void)sig;
-    shutdown_flag = 1;
-    LOG_WARN("Shutting down server...");
+/* Runs on the accepted socket before anything is read from it. Returns -1 to admit, otherwise the cause to refuse with;
+ * *bucket is where the connection's relayed bytes should be charged, or NULL when bandwidth is not metered. */
+int rate_admit(uint32_t addr, struct rate_bucket **bucket) {
+    *bucket = NULL;
+    if (!rate_shards) return -1;
+    uint64_t now = now_ns();
+    struct rate_bucket *b = rate_lookup(addr, now);
+    if (!b) return -1;
 
-    if (server_socket >= 0) close(server_socket);
+    /* An address that has relayed more than a second's worth of bytes ahead of its rate waits for the debt to clear. */
+    if (config.bandwidth_limit > 0 && __atomic_load_n(&b->byte_tat, __ATOMIC_RELAXED) > now + 1000000000) return ERROR_BANDWIDTH_LIMIT;
 
-    pthread_mutex_lock(&connections_mutex);
-    for (int i = 0; i < connection_count; i++) {
-        if (all_connections[i] >= 0) {
-            shutdown(all_connections[i], SHUT_RDWR);
-            close(all_connections[i]);
-        }
+    if (config.rate_limit > 0) {
+        uint64_t interval = 1000000000 / config.rate_limit;
+        uint64_t tolerance = interval * (config.rate_burst - 1);
+        uint64_t tat = __atomic_load_n(&b->conn_tat, __ATOMIC_RELAXED);
+        uint64_t next;
+        do {
+            uint64_t base = tat > now ? tat : now;
+            if (base - now > tolerance) return ERROR_RATE_LIMIT;
+            next = base + interval;
+        } while (!__atomic_compare_exchange_n(&b->conn_tat, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
     }
-    free(all_connections);
-    all_connections = NULL;
-    connection_count = 0;
-    pthread_mutex_unlock(&connections_mutex);
 
-    LOG_INFO("Proxy shutdown complete.");
-    exit(0);
+    if (config.bandwidth_limit > 0) *bucket = b;
+    return -1;
 }
 
-void start_proxy(const char *host, int port) {
-    struct sockaddr_in server_addr = {0};
+/* Moves a byte bucket's TAT on by the time its rate takes to pay for bytes. */
+void tat_charge(uint64_t *tat_at, int rate, size_t bytes, uint64_t now) {
+    uint64_t cost = (uint64_t)bytes * 1000000000 / rate;
+    uint64_t tat = __atomic_load_n(tat_at, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = (tat > now ? tat : now) + cost;
+    } while (!__atomic_compare_exchange_n(tat_at, &tat, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0) {
-        perror("socket");
-        exit(EXIT_FAILURE);
+/* Charges the client's bucket, if it is metered, and the global one. */
+void rate_charge(struct rate_bucket *b, size_t bytes) {
+    if (!b && config.global_bandwidth <= 0) return;
+    uint64_t now = now_ns();
+    if (b) tat_charge(&b->byte_tat, config.bandwidth_limit, bytes, now);
+    if (config.global_bandwidth > 0) tat_charge(&global_byte_tat, config.global_bandwidth, bytes, now);
+}
+
+/* Bytes a bucket lets through now, which may run SHAPE_BURST_NS of its rate ahead; 0 once it is that far in debt,
+ * with *until raised to when half the burst has come back, so a resumed read is not a sliver. */
+size_t shape_room(const uint64_t *tat_at, int rate, uint64_t now, uint64_t *until) {
+    uint64_t tat = __atomic_load_n(tat_at, __ATOMIC_RELAXED);
+    if (tat >= now + SHAPE_BURST_NS) {
+        if (tat - SHAPE_BURST_NS / 2 > *until) *until = tat - SHAPE_BURST_NS / 2;
+        return 0;
     }
+    uint64_t ahead = SHAPE_BURST_NS - (tat > now ? tat - now : 0);
+    size_t room = (uint64_t)rate * ahead / 1000000000;
+    return room > 0 ? room : 1;
+}
 
-    int opt = 1;
-    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+/* The hierarchical token bucket in front of every relay read: a byte has to fit under the tunnel's bucket, shared by
+ * both directions, its client's and the global one. Returns how much the direction may read now, SIZE_MAX when none
+ * is limited, or 0 after setting resume_ms to when the bucket furthest in debt has room again. Reads are only put
+ * off, never slept through, so the engine's own wakeup (epoll timer, io_uring timer, poll timeout) resumes them. */
+size_t shape_quota(struct relay_dir *d) {
+    if (!d->tunnel_tat && !d->rate && config.global_bandwidth <= 0) return SIZE_MAX;
+    uint64_t now = now_ns(), until = 0;
+    size_t quota = SIZE_MAX, room;
+    int held = -1;
 
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    inet_pton(AF_INET, host, &server_addr.sin_addr);
+    if (d->tunnel_tat) {
+        room = shape_room(d->tunnel_tat, config.tunnel_bandwidth, now, &until);
+        if (room < quota) quota = room;
+        if (!room) held = METRIC_SHAPE_TUNNEL;
+    }
+    if (d->rate) {
+        uint64_t before = until;
+        room = shape_room(&d->rate->byte_tat, config.bandwidth_limit, now, &until);
+        if (room < quota) quota = room;
+        if (!room && until != before) held = METRIC_SHAPE_CLIENT;
+    }
+    if (config.global_bandwidth > 0) {
+        uint64_t before = until;
+        room = shape_room(&global_byte_tat, config.global_bandwidth, now, &until);
+        if (room < quota) quota = room;
+        if (!room && until != before) held = METRIC_SHAPE_GLOBAL;
+    }
 
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("bind");
-        exit(EXIT_FAILURE);
+    if (quota > 0) {
+        d->resume_ms = 0;
+        return quota;
     }
+    if (!d->resume_ms) metrics_add(held, 1);
+    d->resume_ms = (until + 999999) / 1000000;
+    return 0;
+}
 
-    if (listen(server_socket, MAX_CONNECTIONS) < 0) {
-        perror("listen");
+void relay_count(struct relay_dir *d, size_t bytes) {
+    metrics_add(d->bytes_metric, bytes);
+    rate_charge(d->rate, bytes);
+    if (d->tunnel_tat) tat_charge(d->tunnel_tat, config.tunnel_bandwidth, bytes, now_ns());
+    if (!d->bytes) trace_mark(d->trace, d->bytes_metric == METRIC_BYTES_UP ? TRACE_FIRST_UP : TRACE_FIRST_DOWN);
+    d->bytes += bytes;
+}
+
+void rate_init(void) {
+    if (config.rate_limit <= 0 && config.bandwidth_limit <= 0) return;
+    if (config.rate_burst <= 0) config.rate_burst = config.rate_limit > 0 ? config.rate_limit : 1;
+    rate_shards = aligned_alloc(64, RATE_SHARDS * sizeof(*rate_shards));
+    if (!rate_shards) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
         exit(EXIT_FAILURE);
     }
+    memset(rate_shards, 0, RATE_SHARDS * sizeof(*rate_shards));
+}
 
-    char msg[128];
-    snprintf(msg, sizeof(msg), "Proxy server running on %s:%d", host, port);
-    LOG_INFO(msg);
-
-    signal(SIGINT, shutdown_server);
-    signal(SIGTERM, shutdown_server);
+void slab_init(struct slab *s, size_t object_size) {
+    s->object_size = (object_size + 63) & ~(size_t)63;
+    s->free = NULL;
+    s->in_use = s->allocated = 0;
+}
 
-    while (!shutdown_flag) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        int client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_len);
-        if (client_socket < 0) {
-            if (shutdown_flag) break;
-            perror("accept");
-            continue;
+void *slab_alloc(struct slab *s) {
+    if (!s->free) {
+        size_t count = SLAB_CHUNK_BYTES / s->object_size;
+        if (count == 0) count = 1;
+        char *chunk = aligned_alloc(64, count * s->object_size);
+        if (!chunk) return NULL;
+        for (size_t i = 0; i < count; i++) {
+            void **object = (void **)(chunk + i * s->object_size);
+            *object = s->free;
+            s->free = object;
         }
+        s->allocated += count;
+    }
 
-        int *client_ptr = malloc(sizeof(int));
-        if (!client_ptr) {
-            LOG_ERROR("Memory allocation failed");
-            close(client_socket);
-            continue;
-        }
+    void **object = s->free;
+    s->free = *object;
+    s->in_use++;
+    return object;
+}
 
-        *client_ptr = client_socket;
-        pthread_t tid;
-        if (pthread_create(&tid, NULL, handle_client, client_ptr) != 0) {
-            LOG_ERROR("Thread creation failed");
-            free(client_ptr);
-            close(client_socket);
-            continue;
-        }
-        pthread_detach(tid);
+void slab_free(struct slab *s, void *p) {
+    if (!p) return;
+    *(void **)p = s->free;
+    s->free = p;
+    s->in_use--;
+}
+
+int pipe_acquire(struct pipe_pool *pool, int fds[2]) {
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count > 0) {
+        pool->count--;
+        fds[0] = pool->fds[pool->count][0];
+        fds[1] = pool->fds[pool->count][1];
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC);
+}
+
+void pipe_release(struct pipe_pool *pool, int fds[2], int empty) {
+    if (fds[0] < 0) return;
+
+    pthread_mutex_lock(&pool->lock);
+    if (empty && pool->count < PIPE_POOL_MAX) {
+        pool->fds[pool->count][0] = fds[0];
+        pool->fds[pool->count][1] = fds[1];
+        pool->count++;
+        fds[0] = fds[1] = -1;
     }
+    pthread_mutex_unlock(&pool->lock);
 
-    shutdown_server(0);
+    if (fds[0] >= 0) {
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
 }
 
-int main(int argc, char *argv[]) {
-    const char *host = DEFAULT_HOST;
-    int port = DEFAULT_PORT;
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int splice_unsupported(int err) {
+    return err == EINVAL || err == ENOSYS || err == ESPIPE || err == EOPNOTSUPP;
+}
+
+/* Relay buffers come in doubling sizes from RELAY_BUFFER_MIN, one slab each; handler threads share their worker's
+ * reactor, so the thread engine takes them from the heap instead. */
+struct slab *relay_buf_slab(struct reactor *r, size_t size) {
+    return &r->buffer_slabs[__builtin_ctzl(size / RELAY_BUFFER_MIN)];
+}
+
+void relay_buf_free(struct reactor *r, struct relay_dir *d) {
+    if (!d->buf) return;
+    if (config.engine == ENGINE_THREAD) free(d->buf);
+    else slab_free(relay_buf_slab(r, d->size), d->buf);
+    d->buf = NULL;
+    d->off = 0;
+}
+
+/* Allocates the size relay_adapt() asked for, swapping out an empty buffer of another size; head parsing never sets want. */
+int relay_buf_acquire(struct reactor *r, struct relay_dir *d) {
+    size_t want = d->want ? d->want : BUFFER_SIZE;
+    if (d->buf && d->size != want && d->len == 0 && d->fill == 0) relay_buf_free(r, d);
+    if (!d->buf) {
+        d->buf = config.engine == ENGINE_THREAD ? malloc(want) : slab_alloc(relay_buf_slab(r, want));
+        d->size = want;
+    }
+    if (d->buf) return 0;
+    metrics_error(ERROR_RESOURCE);
+    LOG_ERROR("Memory allocation failed");
+    return -1;
+}
+
+/* Returns the buffer to the slab once nothing is held in it. */
+void relay_buf_release(struct reactor *r, struct relay_dir *d) {
+    if (!d->buf || d->len > 0 || d->fill > 0) return;
+    relay_buf_free(r, d);
+}
+
+/* Sizes the next buffer from this read: one that filled the buffer doubles it and a run of reads using under a quarter
+ * halves it, so bulk transfers move more per syscall while interactive tunnels stay small. */
+void relay_adapt(struct relay_dir *d, size_t bytes) {
+    if (bytes >= d->size / 4) d->small_reads = 0;
+    if (bytes == d->size && d->size < RELAY_BUFFER_MAX) {
+        d->want = d->size * 2;
+        metrics_add(METRIC_BUFFER_GROWS, 1);
+    } else if (bytes < d->size / 4 && ++d->small_reads >= RELAY_SHRINK_READS && d->size > RELAY_BUFFER_MIN) {
+        d->small_reads = 0;
+        d->want = d->size / 2;
+        metrics_add(METRIC_BUFFER_SHRINKS, 1);
+    }
+}
+
+int conn_queue_response(struct conn *c, const char *response) {
+    if (relay_buf_acquire(&c->worker->reactor, &c->down) < 0) return -1;
+    size_t len = strlen(response);
+    memcpy(c->down.buf, response, len);
+    c->down.off = 0;
+    c->down.len = len;
+    return 0;
+}
+
+int relay_flush(struct relay_dir *d, int dst) {
+    while (d->off < d->len) {
+        ssize_t sent = send(dst, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        d->off += sent;
+    }
+    d->off = d->len = 0;
+    return 1;
+}
+
+int relay_splice_flush(struct relay_dir *d, int dst) {
+    while (d->piped > 0) {
+        ssize_t out = splice(d->pipe_fds[0], NULL, dst, NULL, d->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (out < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        d->piped -= out;
+    }
+    return 1;
+}
+
+/* Returns 1 after moving data, 0 when src would block, -1 on error and -2 if splice() is unusable. */
+int relay_splice_read(struct pipe_pool *pool, struct relay_dir *d, int src, size_t quota) {
+    if (d->pipe_fds[0] < 0 && pipe_acquire(pool, d->pipe_fds) < 0) return -2;
+
+    ssize_t in = splice(src, NULL, d->pipe_fds[1], NULL, quota < SPLICE_CHUNK ? quota : SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (in > 0) {
+        d->piped = in;
+        relay_count(d, in);
+        return 1;
+    }
+
+    int err = errno;
+    pipe_release(pool, d->pipe_fds, 1);
+    if (in == 0) {
+        d->eof = 1;
+        return 1;
+    }
+    if (err == EAGAIN || err == EWOULDBLOCK) return 0;
+    if (err == EINTR) return 1;
+    return splice_unsupported(err) ? -2 : -1;
+}
+
+/* Returns -1 on error, 0 when waiting on the kernel or for bandwidth (resume_ms set), 1 when the read budget ran out. */
+int relay_pump(struct reactor *r, struct relay_dir *d, int src, int dst) {
+    for (int budget = RELAY_BUDGET; budget > 0; budget--) {
+        int flushed = relay_flush(d, dst);
+        if (flushed <= 0) return flushed;
+        flushed = relay_splice_flush(d, dst);
+        if (flushed <= 0) return flushed;
+
+        if (d->eof) {
+            if (!d->shut) {
+                shutdown(dst, SHUT_WR);
+                d->shut = 1;
+            }
+            return 0;
+        }
+
+        size_t quota = shape_quota(d);
+        if (!quota) return 0;
+
+        if (config.relay == RELAY_SPLICE && !d->copy_only) {
+            int rc = relay_splice_read(&r->worker->pipes, d, src, quota);
+            if (rc == -2) {
+                d->copy_only = 1;
+                continue;
+            }
+            if (rc <= 0) return rc;
+            continue;
+        }
+
+        if (relay_buf_acquire(r, d) < 0) return -1;
+        ssize_t bytes = recv(src, d->buf, quota < d->size ? quota : d->size, 0);
+        if (bytes > 0) {
+            d->len = bytes;
+            relay_count(d, bytes);
+            relay_adapt(d, bytes);
+        } else if (bytes == 0) {
+            d->eof = 1;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        } else if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 1;
+}
+
+/* Raises the soft fd limit to the hard one and fits the connection cap inside what is left after the fixed
+ * descriptors, so a surge runs into the cap rather than into EMFILE halfway through a connection. */
+void limits_init(void) {
+    struct rlimit nofile;
+    uint64_t fds = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        if (nofile.rlim_cur < nofile.rlim_max) {
+            struct rlimit raised = { nofile.rlim_max, nofile.rlim_max };
+            if (setrlimit(RLIMIT_NOFILE, &raised) == 0) nofile.rlim_cur = nofile.rlim_max;
+        }
+        fds = nofile.rlim_cur == RLIM_INFINITY ? (uint64_t)REGISTRY_MAX_SLOTS * 2 : nofile.rlim_cur;
+    }
+
+    /* A client and its remote, plus a pipe per direction when splicing; Happy Eyeballs extras are transient and ride the reserve. */
+    int per_conn = config.relay == RELAY_SPLICE ? 6 : 2;
+    uint64_t reserve = FD_RESERVE + (uint64_t)config.workers * (4 + config.pool_max_idle + (config.relay == RELAY_SPLICE ? PIPE_POOL_MAX * 2 : 0));
+    uint64_t budget = fds > reserve + per_conn ? (fds - reserve) / per_conn : 1;
+    if (budget > INT32_MAX) budget = INT32_MAX;
+
+    if (config.max_connections <= 0) {
+        config.max_connections = budget;
+    } else if ((uint64_t)config.max_connections > budget) {
+        config.max_connections = budget;
+        LOG_WARN("Connection cap lowered to fit the fd limit");
+    }
+    metrics_add(METRIC_CONNECTION_LIMIT, config.max_connections);
+
+    char msg[160];
+    snprintf(msg, sizeof(msg), "Connection cap %d (fd limit %llu, %llu MiB of relay buffers before any tunnel grows its own)", config.max_connections,
+             (unsigned long long)fds, ((unsigned long long)config.max_connections * 2 * BUFFER_SIZE + (1 << 20) - 1) >> 20);
+    LOG_INFO(msg);
+}
+
+/* One count across all workers; admitting is an increment that backs out when it overshoots the cap. */
+int capacity_acquire(void) {
+    if (__atomic_add_fetch(&client_count, 1, __ATOMIC_RELAXED) <= (uint32_t)config.max_connections) return 0;
+    __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+void capacity_release(void) {
+    __atomic_sub_fetch(&client_count, 1, __ATOMIC_RELAXED);
+}
+
+int capacity_full(void) {
+    return __atomic_load_n(&client_count, __ATOMIC_RELAXED) >= (uint32_t)config.max_connections;
+}
+
+/* The 503 fits any empty socket buffer, so the non-blocking send either lands whole or not at all. */
+void capacity_refuse(int fd) {
+    metrics_error(ERROR_CAPACITY);
+    LOG_WARN("Connection limit reached");
+    send(fd, service_unavailable_response, sizeof(service_unavailable_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(fd);
+}
+
+/* Counts a connection whose packets arrived on another CPU than its worker's, so steering that no longer
+ * matches the interrupt layout shows up. */
+void steer_check(const struct worker *w, int fd) {
+    if (config.steering == STEER_NONE || w->cpu < 0) return;
+    int cpu;
+    socklen_t len = sizeof(cpu);
+    if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0 && cpu != w->cpu) metrics_add(METRIC_STEER_MISSES, 1);
+}
+
+/* The acceptor's answer to a full table or an exhausted fd limit: leave new clients in the backlog for a while. */
+int accept_should_pause(int err) {
+    return err == EMFILE || err == ENFILE || err == ENOBUFS || err == ENOMEM;
+}
+
+/* A listener handed to a new process is only closed, never shut down: the same socket is accepting over there. */
+void listener_close(int *slot) {
+    int fd = __atomic_exchange_n(slot, -1, __ATOMIC_ACQ_REL);
+    if (fd < 0) return;
+    if (!__atomic_load_n(&handed_off, __ATOMIC_ACQUIRE)) shutdown(fd, SHUT_RDWR);
+    close(fd);
+}
+
+/* Checked by each engine after a mailbox wakeup; turns true once, when the main thread starts a drain. */
+int drain_pending(struct reactor *r) {
+    return !r->draining && __atomic_load_n(&draining, __ATOMIC_ACQUIRE);
+}
+
+int registry_init(struct conn_registry *reg) {
+    reg->size = config.max_connections;
+    if (reg->size > REGISTRY_MAX_SLOTS) reg->size = REGISTRY_MAX_SLOTS;
+
+    reg->slots = malloc(reg->size * sizeof(*reg->slots));
+    reg->timers = calloc(reg->size, sizeof(*reg->timers));
+    if (!reg->slots || !reg->timers) return -1;
+    for (uint32_t i = 0; i < reg->size; i++) {
+        reg->slots[i].fd = -1;
+        reg->slots[i].next = i + 1 < reg->size ? i + 1 : REGISTRY_NONE;
+        reg->timers[i].timer.owner = &reg->timers[i];
+        reg->timers[i].client_fd = reg->timers[i].remote_fd = -1;
+    }
+    reg->free_head = 0;
+    return 0;
+}
+
+/* O(1) and lock-free. Returns the slot holding fd, or -1 when the table is full. */
+int registry_add(struct conn_registry *reg, int fd) {
+    uint64_t head = __atomic_load_n(&reg->free_head, __ATOMIC_ACQUIRE);
+    uint32_t slot;
+
+    do {
+        slot = (uint32_t)head;
+        if (slot == REGISTRY_NONE) return -1;
+        uint32_t next = __atomic_load_n(&reg->slots[slot].next, __ATOMIC_RELAXED);
+        uint64_t tagged = ((head >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&reg->free_head, &head, tagged, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) break;
+    } while (1);
+
+    __atomic_store_n(&reg->slots[slot].fd, fd, __ATOMIC_RELEASE);
+    return slot;
+}
+
+void registry_remove(struct conn_registry *reg, int slot) {
+    if (slot < 0) return;
+    __atomic_store_n(&reg->slots[slot].fd, -1, __ATOMIC_RELEASE);
+
+    uint64_t head = __atomic_load_n(&reg->free_head, __ATOMIC_ACQUIRE);
+    uint64_t tagged;
+    do {
+        __atomic_store_n(&reg->slots[slot].next, (uint32_t)head, __ATOMIC_RELAXED);
+        tagged = ((head >> 32) + 1) << 32 | (uint32_t)slot;
+    } while (!__atomic_compare_exchange_n(&reg->free_head, &head, tagged, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+void timer_wheel_init(struct timer_wheel *tw, uint64_t now_ms) {
+    memset(tw, 0, sizeof(*tw));
+    tw->now = now_ms / TIMER_TICK_MS;
+}
+
+void timer_remove(struct timer_wheel *tw, struct timer *t) {
+    if (!t->pprev) return;
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->pprev = NULL;
+    tw->count--;
+}
+
+/* O(1). expires is an absolute tick; one already past fires on the next turn, one past the top level is clamped. */
+void timer_add(struct timer_wheel *tw, struct timer *t, uint64_t expires) {
+    uint64_t span = (uint64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS);
+    if (expires < tw->now) expires = tw->now;
+    if (expires - tw->now >= span) expires = tw->now + span - 1;
+
+    int level = 0;
+    while (expires - tw->now >= (uint64_t)1 << (TIMER_LEVEL_BITS * (level + 1))) level++;
+    struct timer **slot = &tw->slots[level][(expires >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1)];
+    t->expires = expires;
+    t->next = *slot;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    tw->count++;
+}
+
+void timer_cascade(struct timer_wheel *tw, int level, uint64_t index) {
+    struct timer *t = tw->slots[level][index];
+    tw->slots[level][index] = NULL;
+    while (t) {
+        struct timer *next = t->next;
+        t->pprev = NULL;
+        tw->count--;
+        timer_add(tw, t, t->expires);
+        t = next;
+    }
+}
+
+/* Turns the wheel up to now_ms and returns the timers that came due, unlinked and chained through next. */
+struct timer *timer_expire(struct timer_wheel *tw, uint64_t now_ms) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    struct timer *expired = NULL;
+    while (tw->now <= target) {
+        if (tw->count == 0) {
+            tw->now = target + 1;
+            break;
+        }
+        uint64_t tick = tw->now;
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if (tick & (((uint64_t)1 << (TIMER_LEVEL_BITS * level)) - 1)) break;
+            timer_cascade(tw, level, (tick >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1));
+        }
+        struct timer **slot = &tw->slots[0][tick & (TIMER_SLOTS - 1)];
+        while (*slot) {
+            struct timer *t = *slot;
+            timer_remove(tw, t);
+            t->next = expired;
+            expired = t;
+        }
+        tw->now++;
+    }
+    return expired;
+}
+
+/* Milliseconds until the wheel next needs a turn, at most max_ms. */
+int timer_next_ms(const struct timer_wheel *tw, uint64_t now_ms, int max_ms) {
+    if (tw->count == 0) return max_ms;
+    /* Stop at the first occupied slot or at the next cascade, whichever comes first. */
+    uint64_t tick = tw->now;
+    while ((tick & (TIMER_SLOTS - 1)) != 0 && !tw->slots[0][tick & (TIMER_SLOTS - 1)]) tick++;
+    uint64_t due = tick * TIMER_TICK_MS;
+    if (due <= now_ms) return 0;
+    return due - now_ms < (uint64_t)max_ms ? (int)(due - now_ms) : max_ms;
+}
+
+/* Thread engine: the slot's next deadline in ms, or 0 for none; dialing is bounded by the connect timeout instead. */
+uint64_t slot_deadline(const struct slot_timer *st) {
+    uint64_t deadline = 0;
+    if (st->phase == SLOT_HEADER && config.header_timeout > 0) {
+        deadline = st->accepted_ms + (uint64_t)config.header_timeout * 1000;
+    } else if (st->phase == SLOT_RELAY && config.idle_timeout > 0) {
+        deadline = __atomic_load_n(&st->active_ms, __ATOMIC_RELAXED) + (uint64_t)config.idle_timeout * 1000;
+    }
+    if (config.max_lifetime > 0) {
+        uint64_t end = st->accepted_ms + (uint64_t)config.max_lifetime * 1000;
+        if (!deadline || end < deadline) deadline = end;
+    }
+    return deadline;
+}
+
+/* Caller holds w->timer_lock. */
+void slot_timer_arm(struct worker *w, struct slot_timer *st) {
+    timer_remove(&w->reactor.timers, &st->timer);
+    uint64_t deadline = slot_deadline(st);
+    if (deadline) timer_add(&w->reactor.timers, &st->timer, (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+}
+
+/* Moves a live slot to its next phase; the remote socket joins it once the relay starts. */
+void slot_timer_set(struct worker *w, int slot, int phase, int client_fd, int remote_fd) {
+    struct slot_timer *st = &w->registry.timers[slot];
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&w->timer_lock);
+    if (phase == SLOT_HEADER) st->accepted_ms = now;
+    st->phase = phase;
+    st->client_fd = client_fd;
+    st->remote_fd = remote_fd;
+    __atomic_store_n(&st->active_ms, now, __ATOMIC_RELAXED);
+    slot_timer_arm(w, st);
+    pthread_mutex_unlock(&w->timer_lock);
+}
+
+/* Must run before the slot's sockets are closed, so an expiry never shuts down a reused descriptor. */
+void slot_timer_stop(struct worker *w, int slot) {
+    if (slot < 0) return;
+    struct slot_timer *st = &w->registry.timers[slot];
+    pthread_mutex_lock(&w->timer_lock);
+    timer_remove(&w->reactor.timers, &st->timer);
+    st->client_fd = st->remote_fd = -1;
+    pthread_mutex_unlock(&w->timer_lock);
+}
+
+/* Thread engine acceptor: shuts down the sockets of expired slots, which unblocks their threads. */
+void slot_timers_fire(struct worker *w) {
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&w->timer_lock);
+    for (struct timer *t = timer_expire(&w->reactor.timers, now), *next; t; t = next) {
+        next = t->next;
+        struct slot_timer *st = t->owner;
+        uint64_t deadline = slot_deadline(st);
+        if (!deadline || deadline > now) {
+            slot_timer_arm(w, st);
+            continue;
+        }
+        int cause = config.max_lifetime > 0 && now >= st->accepted_ms + (uint64_t)config.max_lifetime * 1000 ? ERROR_LIFETIME
+                  : st->phase == SLOT_HEADER ? ERROR_HEADER_TIMEOUT : ERROR_IDLE_TIMEOUT;
+        metrics_error(cause);
+        LOG_WARN(close_reasons[cause]);
+        if (st->client_fd >= 0) shutdown(st->client_fd, SHUT_RDWR);
+        if (st->remote_fd >= 0) shutdown(st->remote_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&w->timer_lock);
+}
+
+void tunnel_init(struct tunnel *t, struct worker *w, int slot, int client_fd, int remote_fd, struct rate_bucket *rate, int tunneled, struct trace *trace) {
+    memset(t, 0, sizeof(*t));
+    t->worker = w;
+    t->timer = &w->registry.timers[slot];
+    t->slot = slot;
+    t->tunneled = tunneled;
+    t->client_fd = client_fd;
+    t->remote_fd = remote_fd;
+    t->up.pipe_fds[0] = t->up.pipe_fds[1] = -1;
+    t->down.pipe_fds[0] = t->down.pipe_fds[1] = -1;
+    t->up.bytes_metric = METRIC_BYTES_UP;
+    t->down.bytes_metric = METRIC_BYTES_DOWN;
+    t->up.rate = t->down.rate = rate;
+    if (config.tunnel_bandwidth > 0) t->up.tunnel_tat = t->down.tunnel_tat = &t->tunnel_tat;
+    t->up.trace = t->down.trace = trace;
+}
+
+/* A direction waits to write while it holds bytes for its destination, and otherwise to read until its source ends;
+ * one paused by shaping waits for its resume time instead. Returns the ms to that, or -1 with none pending. */
+int tunnel_want(const struct relay_dir *d, struct pollfd *src, struct pollfd *dst, uint64_t now, int timeout) {
+    if (d->off < d->len || d->piped > 0) dst->events |= POLLOUT;
+    else if (d->resume_ms) {
+        int wait = d->resume_ms > now ? d->resume_ms - now : 0;
+        if (timeout < 0 || wait < timeout) timeout = wait;
+    } else if (!d->eof) src->events |= POLLIN;
+    return timeout;
+}
+
+/* Both directions go through relay_pump(), as on the epoll engine, so an EOF reaches the other peer as
+ * shutdown(SHUT_WR) and the relay ends only when both directions have, or on the first error. */
+void tunnel_run(struct tunnel *t) {
+    struct reactor *r = &t->worker->reactor;
+    set_nonblocking(t->client_fd);
+    set_nonblocking(t->remote_fd);
+
+    for (;;) {
+        uint64_t moved = t->up.bytes + t->down.bytes;
+        int up = relay_pump(r, &t->up, t->client_fd, t->remote_fd);
+        int down = up < 0 ? up : relay_pump(r, &t->down, t->remote_fd, t->client_fd);
+        if (up < 0 || down < 0 || (t->up.shut && t->down.shut)) break;
+        if (t->up.bytes + t->down.bytes != moved) __atomic_store_n(&t->timer->active_ms, now_ms(), __ATOMIC_RELAXED);
+        if (up > 0 || down > 0) continue;
+
+        struct pollfd fds[2] = { { .fd = t->client_fd }, { .fd = t->remote_fd } };
+        uint64_t now = now_ms();
+        int timeout = tunnel_want(&t->up, &fds[0], &fds[1], now, -1);
+        timeout = tunnel_want(&t->down, &fds[1], &fds[0], now, timeout);
+        for (int i = 0; i < 2; i++) {
+            if (!fds[i].events) fds[i].fd = -1;
+        }
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+    }
+}
+
+/* The only place either socket of a tunnel is closed, after its deadline can no longer touch them. */
+void tunnel_close(struct tunnel *t) {
+    struct worker *w = t->worker;
+    metrics_add(METRIC_CONNECTIONS, -1);
+    capacity_release();
+    if (t->tunneled) metrics_add(METRIC_TUNNELS, -1);
+    slot_timer_stop(w, t->slot);
+    registry_remove(&w->registry, t->slot);
+    pipe_release(&w->pipes, t->up.pipe_fds, t->up.piped == 0);
+    pipe_release(&w->pipes, t->down.pipe_fds, t->down.piped == 0);
+    relay_buf_free(&w->reactor, &t->up);
+    relay_buf_free(&w->reactor, &t->down);
+    trace_finish(t->up.trace, t->up.bytes, t->down.bytes);
+    close(t->client_fd);
+    close(t->remote_fd);
+}
+
+void cleanup_connection(struct worker *w, int slot, int client_socket, struct trace *trace) {
+    if (slot >= 0) metrics_add(METRIC_CONNECTIONS, -1);
+    trace_finish(trace, 0, 0);
+    capacity_release();
+    slot_timer_stop(w, slot);
+    registry_remove(&w->registry, slot);
+    shutdown(client_socket, SHUT_RDWR);
+    close(client_socket);
+}
+
+struct request {
+    char method[16];
+    char path[256];
+    char host[256];
+    int port;
+    int keepalive;
+    struct http_message msg;
+};
+
+static const char http_token_char[256] = {
+    ['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+};
+
+/* Returns the first control byte (below 0x20, or DEL) in [p, end), or end. */
+const char *http_scan_ctl(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i low = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i ctl = _mm_or_si128(_mm_cmpeq_epi8(_mm_subs_epu8(v, low), zero), _mm_cmpeq_epi8(v, del));
+        int mask = _mm_movemask_epi8(ctl);
+        if (mask) return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#endif
+    while (p < end && (unsigned char)*p >= 0x20 && *p != 0x7f) p++;
+    return p;
+}
+
+/* Finds the end of the line starting at p. Returns the byte after its LF, or NULL with *bad set if malformed. */
+const char *http_scan_line(const char *p, const char *end, int allow_tab, size_t *line_len, int *bad) {
+    const char *start = p;
+
+    for (;;) {
+        p = http_scan_ctl(p, end);
+        if (p == end) return NULL;
+        if (*p != '\t' || !allow_tab) break;
+        p++;
+    }
+    *line_len = p - start;
+    if (*p == '\n') return p + 1;
+    if (*p == '\r') {
+        if (p + 1 == end) return NULL;
+        if (p[1] == '\n') return p + 2;
+    }
+    *bad = 1;
+    return NULL;
+}
+
+const char *http_parse_headers(const char *p, const char *end, struct http_message *m, int *bad) {
+    m->num_headers = 0;
+    for (;;) {
+        size_t line_len;
+        const char *next = http_scan_line(p, end, 1, &line_len, bad);
+        if (!next) return NULL;
+        if (line_len == 0) return next;
+
+        /* Obsolete line folding and whitespace before the colon are both rejected (RFC 9112 section 5). */
+        const char *name = p;
+        const char *line_end = p + line_len;
+        while (p < line_end && http_token_char[(unsigned char)*p]) p++;
+        if (p == name || p == line_end || *p != ':' || m->num_headers == HTTP_MAX_HEADERS) {
+            *bad = 1;
+            return NULL;
+        }
+
+        struct http_header *h = &m->headers[m->num_headers++];
+        h->name = name;
+        h->name_len = p - name;
+        p++;
+        while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+        while (line_end > p && (line_end[-1] == ' ' || line_end[-1] == '\t')) line_end--;
+        h->value = p;
+        h->value_len = line_end - p;
+        p = next;
+    }
+}
+
+int http_parse_version(const char *p, size_t len, int *minor) {
+    if (len != 8 || memcmp(p, "HTTP/1.", 7) != 0 || p[7] < '0' || p[7] > '9') return -1;
+    *minor = p[7] - '0';
+    return 0;
+}
+
+/* Incremental and allocation-free: returns the head length, 0 if more bytes are needed, -1 if malformed. */
+int http_parse_request_head(const char *buf, size_t len, struct http_message *m) {
+    const char *p = buf;
+    const char *end = buf + len;
+    int bad = 0;
+    size_t line_len;
+
+    /* A client may send stray CRLFs between pipelined requests. */
+    while (p < end && (*p == '\r' || *p == '\n')) p++;
+
+    const char *next = http_scan_line(p, end, 0, &line_len, &bad);
+    if (!next) return bad ? -1 : 0;
+
+    const char *line_end = p + line_len;
+    m->method = p;
+    while (p < line_end && http_token_char[(unsigned char)*p]) p++;
+    m->method_len = p - m->method;
+    if (m->method_len == 0 || p == line_end || *p++ != ' ') return -1;
+
+    m->target = p;
+    while (p < line_end && *p != ' ') p++;
+    m->target_len = p - m->target;
+    if (m->target_len == 0 || p == line_end) return -1;
+    if (http_parse_version(p + 1, line_end - p - 1, &m->minor_version) < 0) return -1;
+    m->status = 0;
+
+    next = http_parse_headers(next, end, m, &bad);
+    if (!next) return bad ? -1 : 0;
+    return next - buf;
+}
+
+int http_parse_response_head(const char *buf, size_t len, struct http_message *m) {
+    const char *end = buf + len;
+    int bad = 0;
+    size_t line_len;
+
+    const char *next = http_scan_line(buf, end, 1, &line_len, &bad);
+    if (!next) return bad ? -1 : 0;
+
+    /* status-line = HTTP-version SP 3DIGIT SP [ reason-phrase ] */
+    if (line_len < 12 || http_parse_version(buf, 8, &m->minor_version) < 0 || buf[8] != ' ') return -1;
+    m->status = 0;
+    for (int i = 9; i < 12; i++) {
+        if (buf[i] < '0' || buf[i] > '9') return -1;
+        m->status = m->status * 10 + (buf[i] - '0');
+    }
+    if (line_len > 12 && buf[12] != ' ') return -1;
+    m->method = m->target = NULL;
+    m->method_len = m->target_len = 0;
+
+    next = http_parse_headers(next, end, m, &bad);
+    if (!next) return bad ? -1 : 0;
+    return next - buf;
+}
+
+const char *http_find_header(const struct http_message *m, const char *name, size_t *value_len) {
+    size_t name_len = strlen(name);
+    for (size_t i = 0; i < m->num_headers; i++) {
+        const struct http_header *h = &m->headers[i];
+        if (h->name_len == name_len && strncasecmp(h->name, name, name_len) == 0) {
+            *value_len = h->value_len;
+            return h->value;
+        }
+    }
+    return NULL;
+}
+
+/* Splits host[:port], accepting bracketed IPv6 literals. The port is left alone when absent. */
+int parse_authority(const char *s, size_t len, char *host, size_t host_size, int *port) {
+    const char *end = s + len;
+    const char *host_end;
+    const char *colon;
+
+    if (len > 0 && s[0] == '[') {
+        host_end = memchr(s, ']', len);
+        if (!host_end) return -1;
+        s++;
+        colon = host_end + 1 < end ? host_end + 1 : NULL;
+        if (colon && *colon != ':') return -1;
+    } else {
+        colon = memchr(s, ':', len);
+        host_end = colon ? colon : end;
+    }
+
+    size_t host_len = host_end - s;
+    if (host_len == 0 || host_len >= host_size) return -1;
+    memcpy(host, s, host_len);
+    host[host_len] = '\0';
+
+    if (colon) {
+        int value = 0;
+        const char *digit = colon + 1;
+        if (digit == end || end - digit > 5) return -1;
+        for (; digit < end; digit++) {
+            if (*digit < '0' || *digit > '9') return -1;
+            value = value * 10 + (*digit - '0');
+        }
+        if (value == 0 || value > 65535) return -1;
+        *port = value;
+    }
+    return 0;
+}
+
+int header_has_token(const char *value, size_t len, const char *token) {
+    size_t token_len = strlen(token);
+    const char *end = value + len;
+
+    while (value < end) {
+        while (value < end && (*value == ' ' || *value == '\t' || *value == ',')) value++;
+        const char *item = value;
+        while (value < end && *value != ',' && *value != ';') value++;
+        const char *item_end = value;
+        while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t')) item_end--;
+        if ((size_t)(item_end - item) == token_len && strncasecmp(item, token, token_len) == 0) return 1;
+        while (value < end && *value != ',') value++;
+    }
+    return 0;
+}
+
+/* Returns the head length, 0 if the head is still incomplete, -1 if the request is malformed. */
+int parse_request(const char *buf, size_t len, struct request *req) {
+    struct http_message *m = &req->msg;
+    int head_len = http_parse_request_head(buf, len, m);
+    if (head_len <= 0) return head_len;
+
+    size_t method_len = m->method_len < sizeof(req->method) ? m->method_len : sizeof(req->method) - 1;
+    memcpy(req->method, m->method, method_len);
+    req->method[method_len] = '\0';
+    size_t path_len = m->target_len < sizeof(req->path) ? m->target_len : sizeof(req->path) - 1;
+    memcpy(req->path, m->target, path_len);
+    req->path[path_len] = '\0';
+
+    size_t conn_len;
+    const char *connection = http_find_header(m, "Connection", &conn_len);
+    if (!connection) connection = http_find_header(m, "Proxy-Connection", &conn_len);
+    if (m->minor_version >= 1) req->keepalive = !(connection && header_has_token(connection, conn_len, "close"));
+    else req->keepalive = connection && header_has_token(connection, conn_len, "keep-alive");
+
+    req->host[0] = '\0';
+    req->port = 80;
+    if (strcmp(req->method, "CONNECT") == 0) {
+        req->port = 0;
+        if (parse_authority(m->target, m->target_len, req->host, sizeof(req->host), &req->port) < 0 || req->port == 0) return -1;
+        return head_len;
+    }
+
+    size_t host_len;
+    const char *host = http_find_header(m, "Host", &host_len);
+    if (host && parse_authority(host, host_len, req->host, sizeof(req->host), &req->port) < 0) req->host[0] = '\0';
+    return head_len;
+}
+
+int tls_copy_name(const unsigned char *name, size_t len, char *host, size_t host_size) {
+    if (len == 0 || len >= host_size) return -1;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char ch = name[i];
+        if (!((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9') || ch == '-' || ch == '.' || ch == '_')) return -1;
+    }
+    memcpy(host, name, len);
+    host[len] = '\0';
+    return 0;
+}
+
+/* Walks a ClientHello (RFC 8446 section 4.1.2) to its server_name extension (RFC 6066 section 3) without allocating;
+ * every length is checked against the bytes at hand. Returns 1 with host filled in, 0 while the first record is still
+ * arriving, and -1 if this is not a ClientHello or it names no usable host. */
+int tls_parse_sni(const unsigned char *p, size_t len, char *host, size_t host_size) {
+    if (len >= 1 && p[0] != 0x16) return -1;
+    if (len < 5) return 0;
+    size_t end = 5 + ((size_t)p[3] << 8 | p[4]);
+    int more = len < end;
+    if (more) end = len;
+
+    size_t pos = 5;
+    if (pos + 4 > end) return more ? 0 : -1;
+    if (p[pos] != 0x01) return -1;
+    pos += 4 + 2 + 32;
+    if (pos + 1 > end) return more ? 0 : -1;
+    pos += 1 + p[pos];
+    if (pos + 2 > end) return more ? 0 : -1;
+    pos += 2 + ((size_t)p[pos] << 8 | p[pos + 1]);
+    if (pos + 1 > end) return more ? 0 : -1;
+    pos += 1 + p[pos];
+    if (pos + 2 > end) return more ? 0 : -1;
+    size_t ext_end = pos + 2 + ((size_t)p[pos] << 8 | p[pos + 1]);
+    pos += 2;
+
+    while (pos + 4 <= ext_end) {
+        if (pos + 4 > end) return more ? 0 : -1;
+        size_t type = (size_t)p[pos] << 8 | p[pos + 1];
+        size_t ext_len = (size_t)p[pos + 2] << 8 | p[pos + 3];
+        pos += 4;
+        if (type != 0) {
+            pos += ext_len;
+            continue;
+        }
+        if (pos + ext_len > end) return more ? 0 : -1;
+
+        size_t list_end = pos + ext_len;
+        for (pos += 2; pos + 3 <= list_end; ) {
+            size_t name_len = (size_t)p[pos + 1] << 8 | p[pos + 2];
+            if (pos + 3 + name_len > list_end) return -1;
+            if (p[pos] == 0) return tls_copy_name(p + pos + 3, name_len, host, host_size) == 0 ? 1 : -1;
+            pos += 3 + name_len;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+/* Where an iptables REDIRECT was headed. A connection made straight to the transparent port reports its own
+ * local address, or nothing without conntrack, and counts as not redirected. */
+int original_dst(int fd, struct sockaddr_in *dst) {
+    struct sockaddr_in local;
+    socklen_t len = sizeof(*dst);
+    socklen_t local_len = sizeof(local);
+    if (getsockopt(fd, SOL_IP, SO_ORIGINAL_DST, dst, &len) < 0) return -1;
+    if (getsockname(fd, (struct sockaddr *)&local, &local_len) == 0 &&
+        local.sin_addr.s_addr == dst->sin_addr.s_addr && local.sin_port == dst->sin_port) return -1;
+    return 0;
+}
+
+/* A transparent tunnel goes to the SNI name on the redirected port, falling back to the redirected address for
+ * clients that send no name; 443 stands in for the port when the connection was not redirected. */
+int transparent_target(int fd, int have_sni, struct request *req) {
+    struct sockaddr_in dst;
+    int redirected = original_dst(fd, &dst) == 0;
+    req->port = redirected ? ntohs(dst.sin_port) : 443;
+    if (!have_sni) {
+        if (!redirected) return -1;
+        inet_ntop(AF_INET, &dst.sin_addr, req->host, sizeof(req->host));
+    }
+    return 0;
+}
+
+/* Message framing shared by requests and responses (RFC 9112 section 6.3); rejects ambiguous bodies. */
+int http_body_framing(const struct http_message *m, struct http_body *body) {
+    size_t te_len;
+    const char *te = http_find_header(m, "Transfer-Encoding", &te_len);
+    int has_length = 0;
+    uint64_t length = 0;
+
+    /* Repeated Content-Length headers are only tolerated when they all agree. */
+    for (size_t h = 0; h < m->num_headers; h++) {
+        const struct http_header *hdr = &m->headers[h];
+        if (hdr->name_len != 14 || strncasecmp(hdr->name, "Content-Length", 14) != 0) continue;
+
+        uint64_t value = 0;
+        if (hdr->value_len == 0 || hdr->value_len > 18) return -1;
+        for (size_t i = 0; i < hdr->value_len; i++) {
+            if (hdr->value[i] < '0' || hdr->value[i] > '9') return -1;
+            value = value * 10 + (hdr->value[i] - '0');
+        }
+        if (has_length && value != length) return -1;
+        has_length = 1;
+        length = value;
+    }
+
+    memset(body, 0, sizeof(*body));
+    if (te) {
+        if (has_length || !header_has_token(te, te_len, "chunked")) return -1;
+        body->kind = BODY_CHUNKED;
+        body->state = CHUNK_SIZE;
+        return 0;
+    }
+    if (has_length) {
+        body->kind = BODY_LENGTH;
+        body->remaining = length;
+        body->done = length == 0;
+        return 0;
+    }
+    body->kind = BODY_NONE;
+    body->done = 1;
+    return 0;
+}
+
+int hex_value(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+/* Returns how many of len bytes belong to the message; sets done at its end and error on bad chunking. */
+size_t http_body_feed(struct http_body *b, const char *data, size_t len) {
+    if (b->done || b->error) return 0;
+
+    if (b->kind == BODY_UNTIL_CLOSE) return len;
+    if (b->kind == BODY_LENGTH) {
+        size_t take = b->remaining < len ? b->remaining : len;
+        b->remaining -= take;
+        b->done = b->remaining == 0;
+        return take;
+    }
+    if (b->kind != BODY_CHUNKED) {
+        b->done = 1;
+        return 0;
+    }
+
+    size_t i = 0;
+    while (i < len && !b->done) {
+        char ch = data[i];
+        switch (b->state) {
+        case CHUNK_SIZE: {
+            int digit = hex_value(ch);
+            if (digit >= 0 && b->remaining < (1ULL << 56)) {
+                b->remaining = b->remaining * 16 + digit;
+                b->digits++;
+            } else if (b->digits && (ch == ';' || ch == ' ' || ch == '\t')) {
+                b->state = CHUNK_EXT;
+            } else if (b->digits && ch == '\r') {
+                b->state = CHUNK_SIZE_LF;
+            } else if (b->digits && ch == '\n') {
+                b->state = b->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            } else {
+                b->error = 1;
+                return i;
+            }
+            i++;
+            break;
+        }
+        case CHUNK_EXT:
+            if (ch == '\n') b->state = b->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_SIZE_LF:
+            if (ch != '\n') {
+                b->error = 1;
+                return i;
+            }
+            b->state = b->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+            i++;
+            break;
+        case CHUNK_DATA: {
+            size_t take = len - i < b->remaining ? len - i : b->remaining;
+            b->remaining -= take;
+            i += take;
+            if (b->remaining == 0) b->state = CHUNK_DATA_CR;
+            break;
+        }
+        case CHUNK_DATA_CR:
+            if (ch == '\r') {
+                b->state = CHUNK_DATA_LF;
+            } else if (ch == '\n') {
+                b->state = CHUNK_SIZE;
+                b->digits = 0;
+            } else {
+                b->error = 1;
+                return i;
+            }
+            i++;
+            break;
+        case CHUNK_DATA_LF:
+            if (ch != '\n') {
+                b->error = 1;
+                return i;
+            }
+            b->state = CHUNK_SIZE;
+            b->digits = 0;
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if (ch == '\n') b->done = 1;
+            else b->state = ch == '\r' ? CHUNK_TRAILER_LF : CHUNK_TRAILER_LINE;
+            i++;
+            break;
+        case CHUNK_TRAILER_LF:
+            if (ch != '\n') {
+                b->error = 1;
+                return i;
+            }
+            b->done = 1;
+            i++;
+            break;
+        case CHUNK_TRAILER_LINE:
+            if (ch == '\n') b->state = CHUNK_TRAILER;
+            i++;
+            break;
+        }
+    }
+    return i;
+}
+
+int parse_response_head(const struct http_message *m, int head_request, struct response_head *rh) {
+    rh->status = m->status;
+
+    size_t conn_len;
+    const char *connection = http_find_header(m, "Connection", &conn_len);
+    if (m->minor_version >= 1) rh->keepalive = !(connection && header_has_token(connection, conn_len, "close"));
+    else rh->keepalive = connection && header_has_token(connection, conn_len, "keep-alive");
+
+    if (head_request || rh->status < 200 || rh->status == 204 || rh->status == 304) {
+        memset(&rh->body, 0, sizeof(rh->body));
+        rh->body.kind = BODY_NONE;
+        rh->body.done = 1;
+        return 0;
+    }
+    if (http_body_framing(m, &rh->body) < 0) return -1;
+    if (rh->body.kind == BODY_NONE) {
+        rh->body.kind = BODY_UNTIL_CLOSE;
+        rh->body.done = 0;
+        rh->keepalive = 0;
+    }
+    return 0;
+}
+
+socklen_t sockaddr_len(const union sockaddr_any *addr) {
+    return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+}
+
+void sockaddr_set_port(union sockaddr_any *addr, int port) {
+    if (addr->sa.sa_family == AF_INET6) addr->in6.sin6_port = htons(port);
+    else addr->in.sin_port = htons(port);
+}
+
+uint32_t hash_string(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+void dns_copy_result(const struct dns_entry *e, union sockaddr_any *addr, int port) {
+    *addr = e->addrs[0];
+    sockaddr_set_port(addr, port);
+}
+
+int dns_copy_results(const struct dns_entry *e, union sockaddr_any *addrs, int port) {
+    for (int i = 0; i < e->count; i++) {
+        addrs[i] = e->addrs[i];
+        sockaddr_set_port(&addrs[i], port);
+    }
+    return e->count;
+}
+
+/* A host with several addresses gets a dial so the event engines can race them; without memory it just uses the first. */
+void dns_copy_to_conn(const struct dns_entry *e, struct conn *c, int port) {
+    dns_copy_result(e, &c->remote_addr, port);
+    if (e->count < 2 || !(c->dial = calloc(1, sizeof(*c->dial)))) return;
+    c->dial->count = dns_copy_results(e, c->dial->addrs, port);
+    for (int i = 0; i < DNS_MAX_ADDRS; i++) c->dial->attempts[i].fd = -1;
+}
+
+struct dns_entry *dns_find(struct dns_shard *shard, uint32_t hash, const char *host) {
+    for (struct dns_entry *e = shard->buckets[hash % DNS_BUCKETS]; e; e = e->next) {
+        if (e->hash == hash && strcmp(e->host, host) == 0) return e;
+    }
+    return NULL;
+}
+
+/* Resolved entries are listed from most to least recently answered; pending ones are off the list and never evicted. */
+void dns_lru_unlink(struct dns_shard *shard, struct dns_entry *e) {
+    if (!e->listed) return;
+    if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+    else shard->lru_head = e->lru_next;
+    if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+    else shard->lru_tail = e->lru_prev;
+    e->listed = 0;
+}
+
+void dns_lru_push(struct dns_shard *shard, struct dns_entry *e) {
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head) shard->lru_head->lru_prev = e;
+    shard->lru_head = e;
+    if (!shard->lru_tail) shard->lru_tail = e;
+    e->listed = 1;
+}
+
+/* Drops the least recently answered entries until the shard has room, skipping any a blocking lookup still reads. */
+void dns_evict(struct dns_shard *shard) {
+    for (struct dns_entry *e = shard->lru_tail, *prev; e && shard->count >= DNS_SHARD_CAPACITY; e = prev) {
+        prev = e->lru_prev;
+        if (e->sync_waiters > 0) continue;
+        dns_lru_unlink(shard, e);
+        struct dns_entry **link = &shard->buckets[e->hash % DNS_BUCKETS];
+        while (*link != e) link = &(*link)->next;
+        *link = e->next;
+        shard->count--;
+        free(e);
+    }
+}
+
+/* Caller holds shard->lock. Returns the entry to use, creating a pending one (and queueing it) on a miss, or NULL
+ * once DNS_QUEUE_MAX lookups are already waiting for a resolver thread. */
+struct dns_entry *dns_get_locked(struct dns_shard *shard, uint32_t hash, const char *host, uint64_t now) {
+    struct dns_entry *e = dns_find(shard, hash, host);
+    if (e && (e->state == DNS_PENDING || e->expires_ms > now)) return e;
+
+    struct dns_entry *fresh = NULL;
+    if (!e) {
+        if (shard->count >= DNS_SHARD_CAPACITY) dns_evict(shard);
+        size_t host_len = strlen(host);
+        e = fresh = calloc(1, sizeof(*e) + host_len + 1);
+        if (!e) return NULL;
+        e->hash = hash;
+        memcpy(e->host, host, host_len + 1);
+        e->shard = shard;
+    }
+
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.queued >= DNS_QUEUE_MAX) {
+        pthread_mutex_unlock(&resolver.lock);
+        free(fresh);
+        return NULL;
+    }
+    e->job_next = NULL;
+    if (resolver.tail) resolver.tail->job_next = e;
+    else resolver.head = e;
+    resolver.tail = e;
+    resolver.queued++;
+    pthread_cond_signal(&resolver.cond);
+    pthread_mutex_unlock(&resolver.lock);
+
+    if (fresh) {
+        e->next = shard->buckets[hash % DNS_BUCKETS];
+        shard->buckets[hash % DNS_BUCKETS] = e;
+        shard->count++;
+    }
+    dns_lru_unlink(shard, e);
+    e->state = DNS_PENDING;
+    return e;
+}
+
+int dns_parse_literal(const char *host, union sockaddr_any *addr, int port) {
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, host, &addr->in.sin_addr) == 1) {
+        addr->in.sin_family = AF_INET;
+    } else if (inet_pton(AF_INET6, host, &addr->in6.sin6_addr) == 1) {
+        addr->in6.sin6_family = AF_INET6;
+    } else {
+        return -1;
+    }
+    sockaddr_set_port(addr, port);
+    return 0;
+}
+
+/* Non-blocking lookup for the event engines; a pending conn is handed back through its worker's mailbox. */
+int dns_lookup_async(struct conn *c, const char *host, int port) {
+    if (dns_parse_literal(host, &c->remote_addr, port) == 0) return DNS_READY;
+
+    uint32_t hash = hash_string(host);
+    struct dns_shard *shard = &resolver.shards[hash % DNS_SHARDS];
+    uint64_t now = now_ms();
+
+    pthread_mutex_lock(&shard->lock);
+    struct dns_entry *e = dns_get_locked(shard, hash, host, now);
+    int state = e ? e->state : DNS_FAILED;
+    metrics_add(!e || state == DNS_PENDING ? METRIC_DNS_MISSES : METRIC_DNS_HITS, 1);
+    if (state == DNS_READY) {
+        dns_copy_to_conn(e, c, port);
+    } else if (state == DNS_PENDING) {
+        c->target_port = port;
+        c->dns_next = e->waiters;
+        e->waiters = c;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return state;
+}
+
+/* Blocking lookup for the thread engine; fills addrs (DNS_MAX_ADDRS slots) and returns how many, or -1. */
+int dns_resolve_all_sync(const char *host, int port, union sockaddr_any *addrs) {
+    if (dns_parse_literal(host, &addrs[0], port) == 0) return 1;
+
+    uint32_t hash = hash_string(host);
+    struct dns_shard *shard = &resolver.shards[hash % DNS_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    struct dns_entry *e = dns_get_locked(shard, hash, host, now_ms());
+    metrics_add(!e || e->state == DNS_PENDING ? METRIC_DNS_MISSES : METRIC_DNS_HITS, 1);
+    if (e) {
+        e->sync_waiters++;
+        while (e->state == DNS_PENDING) pthread_cond_wait(&shard->cond, &shard->lock);
+        e->sync_waiters--;
+    }
+    int rc = e && e->state == DNS_READY ? dns_copy_results(e, addrs, port) : -1;
+    pthread_mutex_unlock(&shard->lock);
+    return rc;
+}
+
+int dns_resolve_sync(const char *host, int port, union sockaddr_any *addr) {
+    union sockaddr_any addrs[DNS_MAX_ADDRS];
+    if (dns_resolve_all_sync(host, port, addrs) < 0) return -1;
+    *addr = addrs[0];
+    return 0;
+}
+
+void mailbox_post(struct mailbox *mb, struct conn *c) {
+    pthread_mutex_lock(&mb->lock);
+    c->dns_next = mb->head;
+    mb->head = c;
+    pthread_mutex_unlock(&mb->lock);
+
+    uint64_t one = 1;
+    if (write(mb->efd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+}
+
+struct conn *mailbox_take(struct mailbox *mb) {
+    uint64_t count;
+    while (read(mb->efd, &count, sizeof(count)) > 0) {}
+
+    pthread_mutex_lock(&mb->lock);
+    struct conn *head = mb->head;
+    mb->head = NULL;
+    pthread_mutex_unlock(&mb->lock);
+    return head;
+}
+
+void dns_finish(struct dns_entry *e, const struct addrinfo *res) {
+    struct dns_shard *shard = e->shard;
+    uint64_t now = now_ms();
+
+    /* Keep getaddrinfo's RFC 6724 order within each family but alternate families, starting with
+       the preferred one, so a dead family costs one attempt delay rather than a whole list (RFC 8305). */
+    const struct addrinfo *family[2][DNS_MAX_ADDRS];
+    int counts[2] = {0, 0};
+    int first = -1;
+    for (const struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+        int f = ai->ai_family == AF_INET6;
+        if (first < 0) first = f;
+        if (counts[f] < DNS_MAX_ADDRS) family[f][counts[f]++] = ai;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    e->count = 0;
+    for (int i = 0; e->count < DNS_MAX_ADDRS && (i < counts[0] || i < counts[1]); i++) {
+        for (int k = 0; k < 2 && e->count < DNS_MAX_ADDRS; k++) {
+            int f = k == 0 ? first : !first;
+            if (i < counts[f]) memcpy(&e->addrs[e->count++], family[f][i]->ai_addr, family[f][i]->ai_addrlen);
+        }
+    }
+    e->state = e->count > 0 ? DNS_READY : DNS_FAILED;
+    dns_lru_push(shard, e);
+    e->expires_ms = now + (uint64_t)(e->state == DNS_READY ? config.dns_ttl : config.dns_negative_ttl) * 1000;
+
+    struct conn *waiters = e->waiters;
+    e->waiters = NULL;
+    for (struct conn *c = waiters, *next; c; c = next) {
+        next = c->dns_next;
+        c->dns_status = e->state;
+        if (e->state == DNS_READY) dns_copy_to_conn(e, c, c->target_port);
+        mailbox_post(&c->worker->mailbox, c);
+    }
+    if (e->sync_waiters > 0) pthread_cond_broadcast(&shard->cond);
+    pthread_mutex_unlock(&shard->lock);
+}
+
+void *resolver_main(void *arg) {
+    (void)arg;
+    struct addrinfo hints = {0};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    for (;;) {
+        pthread_mutex_lock(&resolver.lock);
+        while (!resolver.head) pthread_cond_wait(&resolver.cond, &resolver.lock);
+        struct dns_entry *e = resolver.head;
+        resolver.head = e->job_next;
+        if (!resolver.head) resolver.tail = NULL;
+        resolver.queued--;
+        pthread_mutex_unlock(&resolver.lock);
+
+        /* Pending entries are never evicted, so e->host is stable without the shard lock. */
+        struct addrinfo *res = NULL;
+        if (getaddrinfo(e->host, NULL, &hints, &res) != 0) res = NULL;
+        dns_finish(e, res);
+        if (res) freeaddrinfo(res);
+    }
+    return NULL;
+}
+
+void dns_init(void) {
+    pthread_mutex_init(&resolver.lock, NULL);
+    pthread_cond_init(&resolver.cond, NULL);
+    for (int i = 0; i < DNS_SHARDS; i++) {
+        pthread_mutex_init(&resolver.shards[i].lock, NULL);
+        pthread_cond_init(&resolver.shards[i].cond, NULL);
+    }
+
+    for (int i = 0; i < config.dns_threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, resolver_main, NULL) != 0) {
+            metrics_error(ERROR_RESOURCE);
+            LOG_ERROR("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+}
+
+/* 1 once a non-blocking connect has finished, 0 while it is still pending, -1 if it failed. */
+int connect_status(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) return -1;
+    if (err == EINPROGRESS || err == EALREADY) return 0;
+    if (err != 0) return -1;
+
+    /* A connect still in flight reports no error either; only a peer address proves it finished. */
+    struct sockaddr_storage peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) < 0) return errno == ENOTCONN ? 0 : -1;
+    return 1;
+}
+
+/* Thread engine: races addrs per RFC 8305, starting the next one after each attempt delay or as soon as one fails.
+   Returns a blocking socket, or -1 with errno ETIMEDOUT once the connect timeout runs out. */
+int dial_blocking(const union sockaddr_any *addrs, int count) {
+    struct pollfd fds[DNS_MAX_ADDRS];
+    uint64_t now = now_us();
+    uint64_t deadline = now + (uint64_t)config.connect_timeout * 1000;
+    uint64_t next_attempt = now;
+    int started = 0, running = 0, winner = -1;
+
+    while (winner < 0 && now < deadline) {
+        if (started < count && (now >= next_attempt || running == 0)) {
+            const union sockaddr_any *addr = &addrs[started];
+            int fd = remote_socket_open(addr->sa.sa_family, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd >= 0 && connect(fd, &addr->sa, sockaddr_len(addr)) < 0 && errno != EINPROGRESS) {
+                close(fd);
+                fd = -1;
+            }
+            fds[started].fd = fd;
+            fds[started].events = POLLOUT;
+            fds[started++].revents = 0;
+            if (fd >= 0) running++;
+            next_attempt = fd >= 0 ? now + (uint64_t)config.connect_attempt_delay * 1000 : now;
+            continue;
+        }
+        if (running == 0) break;
+
+        uint64_t wake = started < count && next_attempt < deadline ? next_attempt : deadline;
+        int ready = poll(fds, started, (int)((wake - now + 999) / 1000));
+        if (ready < 0 && errno != EINTR) break;
+        for (int i = 0; i < started && ready > 0; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            ready--;
+            int rc = connect_status(fds[i].fd);
+            if (rc > 0) {
+                winner = i;
+                break;
+            }
+            if (rc < 0) {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                running--;
+                next_attempt = 0;
+            }
+        }
+        now = now_us();
+    }
+
+    int fd = winner >= 0 ? fds[winner].fd : -1;
+    for (int i = 0; i < started; i++) {
+        if (i != winner && fds[i].fd >= 0) close(fds[i].fd);
+    }
+    if (fd < 0) {
+        errno = now >= deadline ? ETIMEDOUT : ECONNREFUSED;
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
+
+void rcu_reader_release(void *arg) {
+    struct rcu_reader *r = arg;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+void rcu_reader_key_init(void) {
+    pthread_key_create(&rcu_reader_key, rcu_reader_release);
+}
+
+/* Same adoption scheme as the log rings: readers of exited threads are reused, never freed. */
+struct rcu_reader *rcu_reader_get(void) {
+    if (rcu_self) return rcu_self;
+    pthread_once(&rcu_reader_key_once, rcu_reader_key_init);
+
+    struct rcu_reader *r;
+    for (r = __atomic_load_n(&rcu_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) return NULL;
+        r->owned = 1;
+        r->next = __atomic_load_n(&rcu_readers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rcu_readers, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(rcu_reader_key, r);
+    rcu_self = r;
+    return r;
+}
+
+/* Read sections do not nest. The fence orders the counter bump before any load of a protected pointer. */
+int rcu_read_lock(void) {
+    struct rcu_reader *r = rcu_reader_get();
+    if (!r) return -1;
+    __atomic_store_n(&r->ctr, r->ctr + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return 0;
+}
+
+void rcu_read_unlock(void) {
+    __atomic_store_n(&rcu_self->ctr, rcu_self->ctr + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns once every read section that was running when it was called has ended. */
+void rcu_synchronize(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (struct rcu_reader *r = __atomic_load_n(&rcu_readers, __ATOMIC_ACQUIRE); r; r = r->next) {
+        uint64_t ctr = __atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE);
+        if (!(ctr & 1)) continue;
+        while (__atomic_load_n(&r->ctr, __ATOMIC_ACQUIRE) == ctr) sched_yield();
+    }
+}
+
+const char *json_skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    return p;
+}
+
+/* Copies a string or bare scalar into out, truncating; objects and arrays are skipped. Returns NULL if malformed. */
+const char *json_value(const char *p, const char *end, char *out, size_t size) {
+    size_t n = 0;
+    if (p < end && *p == '"') {
+        for (p++; p < end && *p != '"'; p++) {
+            if (*p == '\\' && ++p == end) return NULL;
+            if (n + 1 < size) out[n++] = *p;
+        }
+        if (p == end) return NULL;
+        p++;
+    } else if (p < end && (*p == '{' || *p == '[')) {
+        int depth = 0;
+        do {
+            if (*p == '"') {
+                for (p++; p < end && *p != '"'; p++) {
+                    if (*p == '\\' && ++p == end) return NULL;
+                }
+                if (p == end) return NULL;
+            } else if (*p == '{' || *p == '[') {
+                depth++;
+            } else if (*p == '}' || *p == ']') {
+                depth--;
+            }
+            p++;
+        } while (depth > 0 && p < end);
+        if (depth > 0) return NULL;
+    } else {
+        const char *start = p;
+        while (p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\r' && *p != '\n' && *p != '\t') {
+            if (n + 1 < size) out[n++] = *p;
+            p++;
+        }
+        if (p == start) return NULL;
+    }
+    if (size > 0) out[n] = '\0';
+    return p;
+}
+
+int upstream_add(struct upstream_table **table, int *capacity, const char *ip, const char *port, const char *type, const char *speed) {
+    struct upstream u = {0};
+    if (type[0] == '\0' || strcasecmp(type, "HTTP") == 0 || strcasecmp(type, "HTTPS") == 0) u.type = UPSTREAM_HTTP;
+    else if (strcasecmp(type, "SOCKS4") == 0 || strcasecmp(type, "SOCKS4A") == 0) u.type = UPSTREAM_SOCKS4;
+    else if (strcasecmp(type, "SOCKS5") == 0) u.type = UPSTREAM_SOCKS5;
+    else return -1;
+
+    u.port = atoi(port);
+    if (!ip[0] || u.port <= 0 || u.port > 65535 || strlen(ip) >= sizeof(u.host)) return -1;
+    if (dns_resolve_sync(ip, u.port, &u.addr) < 0) return -1;
+    strcpy(u.host, ip);
+    u.ewma_us = strtoull(speed, NULL, 10) * 1000;
+    if (u.ewma_us == 0) u.ewma_us = UPSTREAM_DEFAULT_US;
+
+    if ((*table)->count == *capacity) {
+        struct upstream_table *grown = realloc(*table, sizeof(**table) + 2 * *capacity * sizeof(struct upstream));
+        if (!grown) return -1;
+        *table = grown;
+        *capacity *= 2;
+    }
+    (*table)->entries[(*table)->count++] = u;
+    return 0;
+}
+
+/* Reads the scraper's working_proxies.json: an array of objects with ip_address, port, type and speed ("840 ms"). */
+struct upstream_table *upstream_parse(const char *p, const char *end, int *skipped) {
+    int capacity = 16;
+    struct upstream_table *table = malloc(sizeof(*table) + capacity * sizeof(struct upstream));
+    if (!table) return NULL;
+    table->count = 0;
+    table->refs = 1;
+    *skipped = 0;
+
+    p = json_skip_space(p, end);
+    if (p == end || *p != '[') goto bad;
+    for (p = json_skip_space(p + 1, end); p < end && *p != ']'; p = json_skip_space(p, end)) {
+        if (*p != '{') goto bad;
+        char ip[64] = "", port[16] = "", type[16] = "", speed[32] = "";
+        for (p = json_skip_space(p + 1, end); p < end && *p != '}'; p = json_skip_space(p, end)) {
+            char key[32], ignored[1];
+            if (*p != '"' || !(p = json_value(p, end, key, sizeof(key)))) goto bad;
+            p = json_skip_space(p, end);
+            if (p == end || *p != ':') goto bad;
+            p = json_skip_space(p + 1, end);
+
+            if (strcmp(key, "ip_address") == 0) p = json_value(p, end, ip, sizeof(ip));
+            else if (strcmp(key, "port") == 0) p = json_value(p, end, port, sizeof(port));
+            else if (strcmp(key, "type") == 0) p = json_value(p, end, type, sizeof(type));
+            else if (strcmp(key, "speed") == 0) p = json_value(p, end, speed, sizeof(speed));
+            else p = json_value(p, end, ignored, sizeof(ignored));
+            if (!p) goto bad;
+
+            p = json_skip_space(p, end);
+            if (p < end && *p == ',') p++;
+        }
+        if (p == end) goto bad;
+        p++;
+        if (upstream_add(&table, &capacity, ip, port, type, speed) < 0) (*skipped)++;
+
+        p = json_skip_space(p, end);
+        if (p < end && *p == ',') p++;
+    }
+    if (p == end) goto bad;
+    for (int i = 0; i < table->count; i++) table->entries[i].table = table;
+    return table;
+
+bad:
+    free(table);
+    return NULL;
+}
+
+struct upstream_table *upstream_load(const char *path) {
+    char msg[512];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        snprintf(msg, sizeof(msg), "Cannot open upstream list %s: %s", path, strerror(errno));
+        LOG_ERROR(msg);
+        return NULL;
+    }
+
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    char *data = size >= 0 && size <= UPSTREAM_FILE_MAX ? malloc(size + 1) : NULL;
+    size_t len = data && fseek(f, 0, SEEK_SET) == 0 ? fread(data, 1, size, f) : 0;
+    fclose(f);
+    int skipped = 0;
+    struct upstream_table *table = data && len == (size_t)size ? upstream_parse(data, data + len, &skipped) : NULL;
+    free(data);
+    if (!table) {
+        snprintf(msg, sizeof(msg), "Malformed upstream list %s", path);
+        LOG_ERROR(msg);
+        return NULL;
+    }
+
+    snprintf(msg, sizeof(msg), "Chaining through %d upstream prox%s from %s (%d skipped)", table->count, table->count == 1 ? "y" : "ies", path, skipped);
+    if (table->count == 0) LOG_WARN(msg);
+    else LOG_INFO(msg);
+    return table;
+}
+
+uint32_t upstream_random(void) {
+    if (!upstream_rng) upstream_rng = (now_us() ^ (uintptr_t)&upstream_rng) | 1;
+    upstream_rng ^= upstream_rng << 13;
+    upstream_rng ^= upstream_rng >> 7;
+    upstream_rng ^= upstream_rng << 17;
+    return upstream_rng >> 32;
+}
+
+uint64_t upstream_cost(struct upstream *u) {
+    return __atomic_load_n(&u->ewma_us, __ATOMIC_RELAXED) * (__atomic_load_n(&u->pending, __ATOMIC_RELAXED) + 1);
+}
+
+/* A tripped breaker lets traffic through again once its cooldown has run out. */
+int upstream_usable(struct upstream *u, uint64_t now) {
+    int state = __atomic_load_n(&u->breaker, __ATOMIC_RELAXED);
+    return state == BREAKER_CLOSED || (state == BREAKER_OPEN && now >= __atomic_load_n(&u->open_until_ms, __ATOMIC_RELAXED));
+}
+
+/* Power of two choices among usable upstreams: the one whose latency, scaled by its pending dials, is lower wins. */
+struct upstream *upstream_choose(struct upstream_table *t, uint64_t now) {
+    struct upstream *first = NULL, *second = NULL;
+    for (int tries = 0; tries < UPSTREAM_PICK_SAMPLES && !second && t->count > 0; tries++) {
+        struct upstream *u = &t->entries[upstream_random() % t->count];
+        if (u == first || !upstream_usable(u, now)) continue;
+        if (!first) first = u;
+        else second = u;
+    }
+    /* Sampling found nothing; scan before declaring every upstream down. */
+    for (int i = 0; i < t->count && !first; i++) {
+        if (upstream_usable(&t->entries[i], now)) first = &t->entries[i];
+    }
+    if (!first) return NULL;
+
+    struct upstream *u = second && upstream_cost(second) < upstream_cost(first) ? second : first;
+    int open = BREAKER_OPEN;
+    __atomic_compare_exchange_n(&u->breaker, &open, BREAKER_HALF_OPEN, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return u;
+}
+
+void upstream_table_put(struct upstream_table *t) {
+    if (__atomic_sub_fetch(&t->refs, 1, __ATOMIC_ACQ_REL) == 0) free(t);
+}
+
+/* The returned upstream, and its table, stay valid until upstream_release or upstream_observe. */
+struct upstream *upstream_pick(void) {
+    if (rcu_read_lock() < 0) return NULL;
+    struct upstream_table *t = __atomic_load_n(&upstreams, __ATOMIC_ACQUIRE);
+    struct upstream *u = t ? upstream_choose(t, now_ms()) : NULL;
+    if (u) {
+        __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&u->pending, 1, __ATOMIC_RELAXED);
+    }
+    rcu_read_unlock();
+    return u;
+}
+
+void upstream_put(struct upstream *u) {
+    __atomic_sub_fetch(&u->pending, 1, __ATOMIC_RELAXED);
+    upstream_table_put(u->table);
+}
+
+/* Ends a pick that never dialled, or whose dial was abandoned. If it was the half-open trial, the breaker goes back
+ * to open with its cooldown already run out, so the next pick gets to try instead of the upstream staying ejected. */
+void upstream_release(struct upstream *u) {
+    int half_open = BREAKER_HALF_OPEN;
+    __atomic_compare_exchange_n(&u->breaker, &half_open, BREAKER_OPEN, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    upstream_put(u);
+}
+
+void upstream_trip(struct upstream *u, int state) {
+    uint32_t cooldown = __atomic_load_n(&u->cooldown_ms, __ATOMIC_RELAXED);
+    cooldown = state == BREAKER_HALF_OPEN && cooldown ? cooldown * 2 : UPSTREAM_COOLDOWN_MS;
+    if (cooldown > UPSTREAM_COOLDOWN_MAX_MS) cooldown = UPSTREAM_COOLDOWN_MAX_MS;
+    __atomic_store_n(&u->cooldown_ms, cooldown, __ATOMIC_RELAXED);
+    __atomic_store_n(&u->open_until_ms, now_ms() + cooldown, __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&u->breaker, &state, BREAKER_OPEN, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) return;
+
+    metrics_add(METRIC_UPSTREAM_EJECTIONS, 1);
+    if (log_enabled(LOG_KIND_WARN)) {
+        char msg[128];
+        snprintf(msg, sizeof(msg), "Ejected upstream proxy %s:%d for %us", u->host, u->port, cooldown / 1000);
+        LOG_WARN(msg);
+    }
+}
+
+/* Folds one dial or probe into the latency average, where a failure counts as a very slow dial, and drives the breaker. */
+void upstream_record(struct upstream *u, uint64_t elapsed_us, int ok) {
+    int64_t sample = ok || elapsed_us > UPSTREAM_FAILURE_US ? (int64_t)elapsed_us : UPSTREAM_FAILURE_US;
+    uint64_t old = __atomic_load_n(&u->ewma_us, __ATOMIC_RELAXED);
+    uint64_t next;
+    do {
+        next = (uint64_t)((int64_t)old + (sample - (int64_t)old) / (1 << UPSTREAM_EWMA_SHIFT));
+    } while (!__atomic_compare_exchange_n(&u->ewma_us, &old, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    int state = __atomic_load_n(&u->breaker, __ATOMIC_RELAXED);
+    if (ok) {
+        __atomic_store_n(&u->failures, 0, __ATOMIC_RELAXED);
+        if (state != BREAKER_CLOSED && __atomic_compare_exchange_n(&u->breaker, &state, BREAKER_CLOSED, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&u->cooldown_ms, 0, __ATOMIC_RELAXED);
+            if (log_enabled(LOG_KIND_INFO)) {
+                char msg[128];
+                snprintf(msg, sizeof(msg), "Upstream proxy %s:%d recovered", u->host, u->port);
+                LOG_INFO(msg);
+            }
+        }
+        return;
+    }
+    uint32_t failures = __atomic_add_fetch(&u->failures, 1, __ATOMIC_RELAXED);
+    if (state == BREAKER_HALF_OPEN || (state == BREAKER_CLOSED && failures >= UPSTREAM_BREAKER_FAILURES)) upstream_trip(u, state);
+}
+
+/* Ends a dial started by upstream_pick and records how it went. */
+void upstream_observe(struct upstream *u, uint64_t elapsed_us, int ok) {
+    upstream_record(u, elapsed_us, ok);
+    upstream_put(u);
+}
+
+/* What goes out once connected: an HTTP CONNECT, a SOCKS4a request, or a SOCKS5 greeting pipelined with its request. */
+size_t upstream_handshake(const struct upstream *u, const char *host, int port, char *out, size_t size) {
+    size_t host_len = strlen(host);
+    unsigned char *b = (unsigned char *)out;
+    struct in_addr v4;
+    struct in6_addr v6;
+
+    switch (u->type) {
+    case UPSTREAM_HTTP: {
+        int v6_literal = strchr(host, ':') != NULL;
+        int n = snprintf(out, size, "CONNECT %s%s%s:%d HTTP/1.1\r\nHost: %s%s%s:%d\r\n\r\n",
+                         v6_literal ? "[" : "", host, v6_literal ? "]" : "", port, v6_literal ? "[" : "", host, v6_literal ? "]" : "", port);
+        return n > 0 && (size_t)n < size ? (size_t)n : 0;
+    }
+    case UPSTREAM_SOCKS4:
+        /* SOCKS4a: address 0.0.0.1 tells the proxy to resolve the name that follows the empty user id. */
+        if (host_len + 10 > size || strchr(host, ':')) return 0;
+        b[0] = 4;
+        b[1] = 1;
+        b[2] = port >> 8;
+        b[3] = port & 0xff;
+        b[8] = 0;
+        if (inet_pton(AF_INET, host, &v4) == 1) {
+            memcpy(b + 4, &v4, 4);
+            return 9;
+        }
+        memcpy(b + 4, "\0\0\0\1", 4);
+        memcpy(b + 9, host, host_len + 1);
+        return host_len + 10;
+    case UPSTREAM_SOCKS5: {
+        if (host_len > 255 || host_len + 10 > size) return 0;
+        size_t n = 0;
+        b[n++] = 5; b[n++] = 1; b[n++] = 0;
+        b[n++] = 5; b[n++] = 1; b[n++] = 0;
+        if (inet_pton(AF_INET, host, &v4) == 1) {
+            b[n++] = 1;
+            memcpy(b + n, &v4, 4);
+            n += 4;
+        } else if (inet_pton(AF_INET6, host, &v6) == 1) {
+            if (n + 18 > size) return 0;
+            b[n++] = 4;
+            memcpy(b + n, &v6, 16);
+            n += 16;
+        } else {
+            b[n++] = 3;
+            b[n++] = host_len;
+            memcpy(b + n, host, host_len);
+            n += host_len;
+        }
+        b[n++] = port >> 8;
+        b[n++] = port & 0xff;
+        return n;
+    }
+    }
+    return 0;
+}
+
+/* Returns the length of a complete, successful reply, 0 while it is still arriving, or -1 if the proxy refused. */
+int upstream_reply(const struct upstream *u, const char *buf, size_t len) {
+    const unsigned char *b = (const unsigned char *)buf;
+
+    switch (u->type) {
+    case UPSTREAM_HTTP: {
+        struct http_message msg;
+        int head_len = http_parse_response_head(buf, len, &msg);
+        if (head_len <= 0) return head_len;
+        return msg.status >= 200 && msg.status < 300 ? head_len : -1;
+    }
+    case UPSTREAM_SOCKS4:
+        if (len < 8) return 0;
+        return b[0] == 0 && b[1] == 0x5a ? 8 : -1;
+    case UPSTREAM_SOCKS5: {
+        if (len < 2) return 0;
+        if (b[0] != 5 || b[1] != 0) return -1;
+        if (len < 7) return 0;
+        if (b[2] != 5 || b[3] != 0) return -1;
+        size_t addr_len = b[5] == 1 ? 4 : b[5] == 4 ? 16 : b[5] == 3 ? 1 + (size_t)b[6] : 0;
+        if (addr_len == 0) return -1;
+        size_t total = 2 + 4 + addr_len + 2;
+        return len < total ? 0 : (int)total;
+    }
+    }
+    return -1;
+}
+
+/* Blocking handshake for the thread engine; bytes the proxy sent past its reply are moved to the front of buf. */
+int upstream_handshake_blocking(const struct upstream *u, int fd, const char *host, int port, char *buf, size_t *extra) {
+    size_t len = upstream_handshake(u, host, port, buf, UPSTREAM_REPLY_MAX);
+    if (len == 0 || send(fd, buf, len, MSG_NOSIGNAL) != (ssize_t)len) return -1;
+
+    size_t fill = 0;
+    for (;;) {
+        ssize_t bytes = recv(fd, buf + fill, UPSTREAM_REPLY_MAX - fill, 0);
+        if (bytes < 0 && errno == EINTR) continue;
+        if (bytes <= 0) return -1;
+        fill += bytes;
+
+        int reply_len = upstream_reply(u, buf, fill);
+        if (reply_len < 0) {
+            metrics_error(ERROR_UPSTREAM);
+            LOG_WARN("Upstream proxy refused the connection");
+            return -1;
+        }
+        if (reply_len > 0) {
+            *extra = fill - reply_len;
+            memmove(buf, buf + reply_len, *extra);
+            return 0;
+        }
+        if (fill >= UPSTREAM_REPLY_MAX) return -1;
+    }
+}
+
+/* Thread engine: dials through picked upstreams until one accepts. buf needs BUFFER_SIZE bytes. */
+int upstream_dial_blocking(const char *host, int port, int tunnel, char *buf, size_t *extra) {
+    *extra = 0;
+    for (int attempt = 0; attempt < UPSTREAM_ATTEMPTS; attempt++) {
+        struct upstream *u = upstream_pick();
+        if (!u) break;
+        metrics_add(METRIC_UPSTREAM_DIALS, 1);
+
+        uint64_t start = now_us();
+        int fd = dial_blocking(&u->addr, 1);
+        if (fd < 0) {
+            metrics_error(errno == ETIMEDOUT ? ERROR_CONNECT_TIMEOUT : ERROR_CONNECT);
+            LOG_ERROR("Failed to connect to upstream proxy");
+        } else {
+            metrics_observe_connect(now_us() - start);
+            if ((!tunnel && u->type == UPSTREAM_HTTP) || upstream_handshake_blocking(u, fd, host, port, buf, extra) == 0) {
+                upstream_observe(u, now_us() - start, 1);
+                return fd;
+            }
+        }
+        upstream_observe(u, now_us() - start, 0);
+        if (fd >= 0) close(fd);
+    }
+
+    metrics_error(ERROR_UPSTREAM);
+    LOG_ERROR("No upstream proxy available");
+    return -1;
+}
+
+/* Open circuits are left alone until their cooldown runs out; the probe then takes them half-open and acts as their
+ * trial, so a failure ejects them again with a doubled cooldown before any client pick can reach them. */
+int upstream_probe_due(struct upstream *u, uint64_t now) {
+    int state = __atomic_load_n(&u->breaker, __ATOMIC_RELAXED);
+    if (state != BREAKER_OPEN) return 1;
+    if (now < __atomic_load_n(&u->open_until_ms, __ATOMIC_RELAXED)) return 0;
+    /* Losing the race means a client pick already holds the trial. */
+    return __atomic_compare_exchange_n(&u->breaker, &state, BREAKER_HALF_OPEN, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Advances one probe: the connect, then with a health target the handshake. Returns 1 if healthy, -1 if not, 0 while waiting. */
+int upstream_probe_step(struct upstream *u, struct pollfd *pfd, struct upstream_probe *probe, const char *host, int port) {
+    if (pfd->events == POLLOUT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) return -1;
+        if (!host) return 1;
+
+        size_t request_len = upstream_handshake(u, host, port, probe->buf, sizeof(probe->buf));
+        if (request_len == 0 || send(pfd->fd, probe->buf, request_len, MSG_NOSIGNAL) != (ssize_t)request_len) return -1;
+        pfd->events = POLLIN;
+        return 0;
+    }
+
+    ssize_t bytes = recv(pfd->fd, probe->buf + probe->fill, sizeof(probe->buf) - probe->fill, 0);
+    if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (bytes <= 0) return -1;
+    probe->fill += bytes;
+    int reply_len = upstream_reply(u, probe->buf, probe->fill);
+    if (reply_len == 0) return probe->fill < sizeof(probe->buf) ? 0 : -1;
+    return reply_len > 0 ? 1 : -1;
+}
+
+/* Probes a batch of upstreams at once, scoring each by its answer or by the health timeout. */
+void upstream_probe_batch(struct upstream *batch, int count, const char *host, int port) {
+    static struct upstream_probe probes[UPSTREAM_PROBE_BATCH];
+    struct pollfd fds[UPSTREAM_PROBE_BATCH];
+    uint64_t start = now_us();
+    uint64_t deadline = start + (uint64_t)config.health_timeout * 1000;
+    int waiting = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct upstream *u = &batch[i];
+        fds[i].fd = -1;
+        fds[i].events = POLLOUT;
+        probes[i].fill = 0;
+        if (!upstream_probe_due(u, start / 1000)) continue;
+
+        int fd = socket(u->addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) continue;
+        if (connect(fd, &u->addr.sa, sockaddr_len(&u->addr)) == 0 || errno == EINPROGRESS) {
+            fds[i].fd = fd;
+            waiting++;
+        } else {
+            upstream_record(u, now_us() - start, 0);
+            close(fd);
+        }
+    }
+
+    while (waiting > 0) {
+        uint64_t now = now_us();
+        if (now >= deadline) break;
+        int ready = poll(fds, count, (int)((deadline - now + 999) / 1000));
+        if (ready < 0 && errno != EINTR) break;
+
+        for (int i = 0; i < count && ready > 0; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) continue;
+            ready--;
+            int rc = upstream_probe_step(&batch[i], &fds[i], &probes[i], host, port);
+            if (rc == 0) continue;
+            upstream_record(&batch[i], now_us() - start, rc > 0);
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            waiting--;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (fds[i].fd < 0) continue;
+        upstream_record(&batch[i], now_us() - start, 0);
+        close(fds[i].fd);
+    }
+}
+
+/* Without a health target a probe only checks that the proxy accepts TCP connections. */
+void upstream_probe_all(const char *host, int port) {
+    if (rcu_read_lock() < 0) return;
+    struct upstream_table *t = __atomic_load_n(&upstreams, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&t->refs, 1, __ATOMIC_RELAXED);
+    rcu_read_unlock();
+
+    for (int i = 0; i < t->count; i += UPSTREAM_PROBE_BATCH) {
+        upstream_probe_batch(&t->entries[i], t->count - i < UPSTREAM_PROBE_BATCH ? t->count - i : UPSTREAM_PROBE_BATCH, host, port);
+    }
+    upstream_table_put(t);
+}
+
+/* Only the health thread swaps tables, so the old one can be read here without a reference of its own. */
+void upstream_reload(void) {
+    struct upstream_table *t = upstream_load(config.upstreams);
+    if (!t) {
+        LOG_WARN("Keeping the current upstream list");
+        return;
+    }
+
+    /* Proxies that stay on the list keep their latency average and breaker. */
+    struct upstream_table *old = upstreams;
+    for (int i = 0; i < t->count; i++) {
+        struct upstream *u = &t->entries[i];
+        for (int j = 0; j < old->count; j++) {
+            struct upstream *prev = &old->entries[j];
+            if (prev->port != u->port || prev->type != u->type || strcmp(prev->host, u->host) != 0) continue;
+            u->ewma_us = __atomic_load_n(&prev->ewma_us, __ATOMIC_RELAXED);
+            u->failures = __atomic_load_n(&prev->failures, __ATOMIC_RELAXED);
+            u->breaker = __atomic_load_n(&prev->breaker, __ATOMIC_RELAXED);
+            u->cooldown_ms = __atomic_load_n(&prev->cooldown_ms, __ATOMIC_RELAXED);
+            u->open_until_ms = __atomic_load_n(&prev->open_until_ms, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    /* Readers that loaded the old pointer either hold a reference by now or are still in their read section. */
+    __atomic_store_n(&upstreams, t, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    upstream_table_put(old);
+    metrics_add(METRIC_UPSTREAM_RELOADS, 1);
+}
+
+void upstream_request_reload(void) {
+    pthread_mutex_lock(&upstream_health_lock);
+    upstream_reload_requested = 1;
+    pthread_cond_signal(&upstream_health_cond);
+    pthread_mutex_unlock(&upstream_health_lock);
+}
+
+int file_changed(const char *path, struct stat *seen) {
+    struct stat st;
+    if (stat(path, &st) < 0) return 0;
+    int changed = st.st_ino != seen->st_ino || st.st_size != seen->st_size ||
+                  st.st_mtim.tv_sec != seen->st_mtim.tv_sec || st.st_mtim.tv_nsec != seen->st_mtim.tv_nsec;
+    *seen = st;
+    return changed;
+}
+
+/* Reloads the list when asked to or when the file changes, and probes every upstream each health interval. */
+void *upstream_health_main(void *arg) {
+    (void)arg;
+    struct stat seen;
+    if (stat(config.upstreams, &seen) < 0) memset(&seen, 0, sizeof(seen));
+    uint64_t next_probe = 0;
+
+    char host[256];
+    int port = 0;
+    if (config.health_target) parse_authority(config.health_target, strlen(config.health_target), host, sizeof(host), &port);
+
+    for (;;) {
+        pthread_mutex_lock(&upstream_health_lock);
+        if (!upstream_reload_requested) {
+            struct timespec wake;
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec++;
+            pthread_cond_timedwait(&upstream_health_cond, &upstream_health_lock, &wake);
+        }
+        int reload = upstream_reload_requested;
+        upstream_reload_requested = 0;
+        pthread_mutex_unlock(&upstream_health_lock);
+
+        if (file_changed(config.upstreams, &seen) || reload) upstream_reload();
+        if (config.health_interval > 0 && now_ms() >= next_probe) {
+            upstream_probe_all(config.health_target ? host : NULL, port);
+            next_probe = now_ms() + (uint64_t)config.health_interval * 1000;
+        }
+    }
+    return NULL;
+}
+
+void start_upstream_health(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, upstream_health_main, NULL) != 0) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+}
+
+size_t upstream_render(char *out, size_t size) {
+    int states[3] = {0};
+    if (!config.upstreams || rcu_read_lock() < 0) return 0;
+    struct upstream_table *t = __atomic_load_n(&upstreams, __ATOMIC_ACQUIRE);
+    for (int i = 0; t && i < t->count; i++) states[__atomic_load_n(&t->entries[i].breaker, __ATOMIC_RELAXED)]++;
+    rcu_read_unlock();
+
+    int n = snprintf(out, size, "# HELP anonynet_upstream_proxies Upstream proxies on the list by circuit-breaker state.\n"
+                                "# TYPE anonynet_upstream_proxies gauge\n"
+                                "anonynet_upstream_proxies{state=\"closed\"} %d\n"
+                                "anonynet_upstream_proxies{state=\"open\"} %d\n"
+                                "anonynet_upstream_proxies{state=\"half_open\"} %d\n",
+                     states[BREAKER_CLOSED], states[BREAKER_OPEN], states[BREAKER_HALF_OPEN]);
+    if (n < 0) return 0;
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+static const char *policy_action_names[POLICY_ACTIONS] = {
+    [POLICY_ALLOW] = "allow",
+    [POLICY_DENY] = "deny",
+    [POLICY_UPSTREAM] = "upstream",
+    [POLICY_DIRECT] = "direct",
+};
+
+/* FNV-1a over the lowercased label, salted with the parent so equal labels under different suffixes spread out. */
+uint32_t policy_hash(int32_t parent, const char *label, uint32_t len) {
+    uint32_t hash = 2166136261u ^ ((uint32_t)parent * 2654435761u);
+    for (uint32_t i = 0; i < len; i++) {
+        unsigned char ch = label[i];
+        if (ch >= 'A' && ch <= 'Z') ch += 'a' - 'A';
+        hash = (hash ^ ch) * 16777619u;
+    }
+    return hash;
+}
+
+/* Returns the edge for the label under parent, or the empty slot where it belongs. The table is never more than half full. */
+struct policy_edge *policy_edge(const struct policy *p, int32_t parent, const char *label, uint32_t len, uint32_t hash) {
+    for (uint32_t i = hash & p->edge_mask;; i = (i + 1) & p->edge_mask) {
+        struct policy_edge *e = &p->edges[i];
+        if (e->child == 0) return e;
+        if (e->hash == hash && e->parent == parent && e->len == len && strncasecmp(p->text + e->label, label, len) == 0) return e;
+    }
+}
+
+/* Walks the labels of name from the right, filling path with the trie nodes matched. path[0] is the root. Returns the depth. */
+int policy_walk(struct policy *p, const char *name, int create, int32_t *path) {
+    size_t end = strlen(name);
+    if (end > 0 && name[end - 1] == '.') end--;
+    int depth = 0;
+    path[depth++] = 0;
+
+    while (end > 0 && depth <= POLICY_MAX_DEPTH) {
+        size_t start = end;
+        while (start > 0 && name[start - 1] != '.') start--;
+        if (start == end) break;
+
+        const char *label = name + start;
+        uint32_t len = end - start;
+        int32_t parent = path[depth - 1];
+        uint32_t hash = policy_hash(parent, label, len);
+        struct policy_edge *e = policy_edge(p, parent, label, len, hash);
+        if (e->child == 0) {
+            if (!create) break;
+            *e = (struct policy_edge){hash, parent, p->nodes++, label - p->text, len};
+        }
+        path[depth++] = e->child;
+        end = start > 0 ? start - 1 : 0;
+    }
+    return depth;
+}
+
+uint32_t policy_mask(int len) {
+    return len > 0 ? ~0u << (32 - len) : 0;
+}
+
+/* Inserts a client prefix below *at, splitting a compressed node where the new prefix leaves it. The same prefix again replaces the action. */
+void policy_radix_insert(struct policy *p, int32_t *at, uint32_t prefix, int len, int action) {
+    for (;;) {
+        if (*at < 0) {
+            p->radix[p->radix_count] = (struct policy_radix){prefix, len, action, {-1, -1}};
+            *at = p->radix_count++;
+            return;
+        }
+
+        struct policy_radix *n = &p->radix[*at];
+        int common = len < n->len ? len : n->len;
+        uint32_t diff = prefix ^ n->prefix;
+        if (diff && __builtin_clz(diff) < common) common = __builtin_clz(diff);
+
+        if (common == n->len && common == len) {
+            n->action = action;
+            return;
+        }
+        if (common == n->len) {
+            at = &n->child[(prefix >> (31 - n->len)) & 1];
+            continue;
+        }
+
+        int32_t below = *at;
+        int32_t top = p->radix_count++;
+        if (common == len) {
+            p->radix[top] = (struct policy_radix){prefix, len, action, {-1, -1}};
+        } else {
+            p->radix[top] = (struct policy_radix){prefix & policy_mask(common), common, POLICY_NONE, {-1, -1}};
+            p->radix[top].child[(prefix >> (31 - common)) & 1] = p->radix_count;
+            p->radix[p->radix_count++] = (struct policy_radix){prefix, len, action, {-1, -1}};
+        }
+        p->radix[top].child[(p->radix[below].prefix >> (31 - common)) & 1] = below;
+        *at = top;
+        return;
+    }
+}
+
+/* The longest client prefix with an action wins. addr is in host byte order. */
+int policy_radix_lookup(const struct policy *p, int32_t at, uint32_t addr) {
+    int action = POLICY_NONE;
+    while (at >= 0) {
+        const struct policy_radix *n = &p->radix[at];
+        if ((addr ^ n->prefix) & policy_mask(n->len)) break;
+        if (n->action != POLICY_NONE) action = n->action;
+        if (n->len == 32) break;
+        at = n->child[(addr >> (31 - n->len)) & 1];
+    }
+    return action;
+}
+
+/* The most specific destination suffix with a rule for this client decides; anything unmatched is allowed. An IPv4
+ * literal has no suffixes, so only a rule naming the whole address or "*" covers it. */
+int policy_lookup(struct policy *p, const char *host, uint32_t addr) {
+    int32_t path[POLICY_MAX_DEPTH + 1];
+    struct in_addr v4;
+    int literal = inet_pton(AF_INET, host, &v4) == 1;
+    for (int i = policy_walk(p, host, 0, path) - 1; i >= 0; i--) {
+        /* path[4] is only there when all four octets matched. */
+        if (literal && i > 0 && i != 4) continue;
+        if (p->roots[path[i]] < 0) continue;
+        int action = policy_radix_lookup(p, p->roots[path[i]], addr);
+        if (action != POLICY_NONE) return action;
+    }
+    return POLICY_ALLOW;
+}
+
+/* One rule: ACTION DESTINATION [CLIENT[/BITS]]. A destination covers its subdomains, and "*" covers everything. */
+int policy_parse_rule(char *line, struct policy_rule *rule, int *labels) {
+    char *save;
+    char *action = strtok_r(line, " \t\r", &save);
+    char *destination = action ? strtok_r(NULL, " \t\r", &save) : NULL;
+    char *client = destination ? strtok_r(NULL, " \t\r", &save) : NULL;
+    if (!destination || strtok_r(NULL, " \t\r", &save)) return -1;
+
+    rule->action = POLICY_NONE;
+    for (int i = POLICY_ALLOW; i < POLICY_ACTIONS; i++) {
+        if (strcasecmp(action, policy_action_names[i]) == 0) rule->action = i;
+    }
+    if (rule->action == POLICY_NONE) return -1;
+
+    if (strcmp(destination, "*") == 0) destination += 1;
+    else if (strncmp(destination, "*.", 2) == 0) destination += 2;
+    else if (destination[0] == '.') destination += 1;
+    *labels = *destination ? 1 : 0;
+    for (char *ch = destination; *ch; ch++) {
+        if (*ch >= 'A' && *ch <= 'Z') *ch += 'a' - 'A';
+        if (*ch == '.') (*labels)++;
+    }
+    if (*labels > POLICY_MAX_DEPTH) return -1;
+    rule->destination = destination;
+
+    rule->prefix = 0;
+    rule->len = 0;
+    if (client) {
+        char *bits = strchr(client, '/');
+        if (bits) *bits++ = '\0';
+        struct in_addr addr;
+        if (inet_pton(AF_INET, client, &addr) != 1) return -1;
+        rule->len = 32;
+        if (bits) {
+            char *rest;
+            long len = strtol(bits, &rest, 10);
+            if (rest == bits || *rest || len < 0 || len > 32) return -1;
+            rule->len = len;
+        }
+        rule->prefix = ntohl(addr.s_addr) & policy_mask(rule->len);
+    }
+    return 0;
+}
+
+void policy_free(struct policy *p) {
+    if (!p) return;
+    free(p->edges);
+    free(p->roots);
+    free(p->radix);
+    free(p->text);
+    free(p);
+}
+
+/* Takes ownership of text. Rules are parsed in place first so every table can be sized once before the trie is built. */
+struct policy *policy_compile(char *text, size_t len, int *skipped) {
+    struct policy *p = calloc(1, sizeof(*p));
+    struct policy_rule *rules = NULL;
+    int capacity = 0, labels = 0;
+    if (!p) goto fail;
+    p->text = text;
+    text[len] = '\0';
+    *skipped = 0;
+
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        line += strspn(line, " \t\r");
+        if (!*line) continue;
+
+        if (p->rules == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct policy_rule *grown = realloc(rules, capacity * sizeof(*rules));
+            if (!grown) goto fail;
+            rules = grown;
+        }
+        int rule_labels;
+        if (policy_parse_rule(line, &rules[p->rules], &rule_labels) < 0) {
+            (*skipped)++;
+            continue;
+        }
+        labels += rule_labels;
+        p->actions[rules[p->rules].action]++;
+        p->rules++;
+    }
+
+    uint32_t slots = 16;
+    while (slots < 2 * (uint32_t)labels) slots <<= 1;
+    p->edge_mask = slots - 1;
+    p->edges = calloc(slots, sizeof(*p->edges));
+    p->roots = malloc((labels + 1) * sizeof(*p->roots));
+    p->radix = malloc((2 * p->rules + 1) * sizeof(*p->radix));
+    if (!p->edges || !p->roots || !p->radix) goto fail;
+    for (int i = 0; i <= labels; i++) p->roots[i] = -1;
+    p->nodes = 1;
+
+    for (int i = 0; i < p->rules; i++) {
+        int32_t path[POLICY_MAX_DEPTH + 1];
+        struct policy_rule *rule = &rules[i];
+        int32_t node = path[policy_walk(p, rule->destination, 1, path) - 1];
+        policy_radix_insert(p, &p->roots[node], rule->prefix, rule->len, rule->action);
+    }
+    free(rules);
+    return p;
+
+fail:
+    free(rules);
+    if (p) policy_free(p);
+    else free(text);
+    return NULL;
+}
+
+struct policy *policy_load(const char *path) {
+    char msg[512];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        snprintf(msg, sizeof(msg), "Cannot open policy %s: %s", path, strerror(errno));
+        LOG_ERROR(msg);
+        return NULL;
+    }
+
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    char *data = size >= 0 && size <= POLICY_FILE_MAX ? malloc(size + 1) : NULL;
+    size_t len = data && fseek(f, 0, SEEK_SET) == 0 ? fread(data, 1, size, f) : 0;
+    fclose(f);
+    int skipped = 0;
+    struct policy *p = NULL;
+    if (data && len == (size_t)size) p = policy_compile(data, len, &skipped);
+    else free(data);
+    if (!p) {
+        snprintf(msg, sizeof(msg), "Cannot compile policy %s", path);
+        LOG_ERROR(msg);
+        return NULL;
+    }
+
+    snprintf(msg, sizeof(msg), "Enforcing %d policy rule%s from %s (%d skipped)", p->rules, p->rules == 1 ? "" : "s", path, skipped);
+    LOG_INFO(msg);
+    if (p->actions[POLICY_UPSTREAM] > 0 && !config.upstreams) LOG_WARN("Policy routes through upstreams but no upstream list is loaded");
+    return p;
+}
+
+/* Called for every CONNECT and plain request; client_addr is in network byte order. Fails closed if the table cannot be read. */
+int policy_decide(const char *host, uint32_t client_addr) {
+    if (!config.policy) return POLICY_ALLOW;
+    int action = POLICY_DENY;
+    if (rcu_read_lock() == 0) {
+        action = policy_lookup(__atomic_load_n(&policy, __ATOMIC_ACQUIRE), host, ntohl(client_addr));
+        rcu_read_unlock();
+    }
+    metrics_add(METRIC_POLICY_ALLOW + action - POLICY_ALLOW, 1);
+    return action;
+}
+
+/* Whether a permitted destination is reached through the upstream list. */
+int policy_chains(int action) {
+    return action == POLICY_UPSTREAM || (upstreams && action != POLICY_DIRECT);
+}
+
+/* Only the watch thread swaps policies; readers never keep a pointer past their read section. */
+void policy_reload(void) {
+    struct policy *p = policy_load(config.policy);
+    if (!p) {
+        LOG_WARN("Keeping the current policy");
+        return;
+    }
+
+    struct policy *old = policy;
+    __atomic_store_n(&policy, p, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    metrics_add(METRIC_POLICY_RULES, p->rules - old->rules);
+    metrics_add(METRIC_POLICY_RELOADS, 1);
+    policy_free(old);
+}
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+/* FIPS 180-4 section 6.2.2, one 64-byte block. */
+void sha256_compress(uint32_t *h, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = k + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        k = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+    h[5] += f;
+    h[6] += g;
+    h[7] += k;
+}
+
+void sha256_init(struct sha256 *s) {
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, iv, sizeof(iv));
+    s->bytes = 0;
+}
+
+void sha256_update(struct sha256 *s, const void *data, size_t len) {
+    const uint8_t *p = data;
+    while (len > 0) {
+        size_t fill = s->bytes % 64;
+        size_t take = 64 - fill < len ? 64 - fill : len;
+        memcpy(s->block + fill, p, take);
+        s->bytes += take;
+        p += take;
+        len -= take;
+        if (fill + take == 64) sha256_compress(s->h, s->block);
+    }
+}
+
+void sha256_final(struct sha256 *s, uint8_t *out) {
+    uint64_t bits = s->bytes * 8;
+    uint8_t pad[72] = {0x80};
+    size_t pad_len = (s->bytes % 64 < 56 ? 56 : 120) - s->bytes % 64;
+    for (int i = 0; i < 8; i++) pad[pad_len + i] = bits >> (56 - 8 * i);
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i] = s->h[i] >> 24;
+        out[4 * i + 1] = s->h[i] >> 16;
+        out[4 * i + 2] = s->h[i] >> 8;
+        out[4 * i + 3] = s->h[i];
+    }
+}
+
+void sha256(const void *data, size_t len, uint8_t *out) {
+    struct sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, data, len);
+    sha256_final(&s, out);
+}
+
+/* RFC 8018 section 5.2 with HMAC-SHA256 and a single 32-byte block. The keyed inner and outer states are computed
+ * once, so each iteration costs two compressions. */
+void pbkdf2_sha256(const void *password, size_t password_len, const uint8_t *salt, size_t salt_len, int iterations, uint8_t *out) {
+    uint8_t key[64] = {0}, pad[64];
+    if (password_len > 64) sha256(password, password_len, key);
+    else memcpy(key, password, password_len);
+
+    struct sha256 inner, outer, s;
+    for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+    sha256_init(&inner);
+    sha256_update(&inner, pad, 64);
+    for (int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+    sha256_init(&outer);
+    sha256_update(&outer, pad, 64);
+
+    uint8_t u[32];
+    static const uint8_t block_index[4] = {0, 0, 0, 1};
+    s = inner;
+    sha256_update(&s, salt, salt_len);
+    sha256_update(&s, block_index, 4);
+    sha256_final(&s, u);
+    s = outer;
+    sha256_update(&s, u, 32);
+    sha256_final(&s, u);
+    memcpy(out, u, 32);
+
+    for (int n = 1; n < iterations; n++) {
+        s = inner;
+        sha256_update(&s, u, 32);
+        sha256_final(&s, u);
+        s = outer;
+        sha256_update(&s, u, 32);
+        sha256_final(&s, u);
+        for (int i = 0; i < 32; i++) out[i] ^= u[i];
+    }
+}
+
+/* Compares without an early exit, so the time taken says nothing about where two digests differ. */
+int digest_equal(const uint8_t *a, const uint8_t *b, size_t len) {
+    uint8_t diff = 0;
+    for (size_t i = 0; i < len; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+int hex_decode(const char *s, size_t len, uint8_t *out, size_t out_size) {
+    if (len % 2 || len / 2 > out_size) return -1;
+    for (size_t i = 0; i < len; i++) {
+        char ch = s[i];
+        int v = ch >= '0' && ch <= '9' ? ch - '0' : ch >= 'a' && ch <= 'f' ? ch - 'a' + 10 : ch >= 'A' && ch <= 'F' ? ch - 'A' + 10 : -1;
+        if (v < 0) return -1;
+        if (i % 2) out[i / 2] |= v;
+        else out[i / 2] = v << 4;
+    }
+    return len / 2;
+}
+
+/* RFC 4648 section 4 with padding required. Returns the decoded length, or -1. */
+int base64_decode(const char *s, size_t len, uint8_t *out, size_t out_size) {
+    if (len % 4) return -1;
+    size_t n = 0;
+    for (size_t i = 0; i < len; i += 4) {
+        uint32_t bits = 0;
+        int pads = 0;
+        for (int j = 0; j < 4; j++) {
+            char ch = s[i + j];
+            int v = ch >= 'A' && ch <= 'Z' ? ch - 'A' : ch >= 'a' && ch <= 'z' ? ch - 'a' + 26 : ch >= '0' && ch <= '9' ? ch - '0' + 52 :
+                    ch == '+' ? 62 : ch == '/' ? 63 : -1;
+            if (ch == '=' && i + 4 == len && j >= 2) {
+                pads++;
+                v = 0;
+            } else if (v < 0 || pads) {
+                return -1;
+            }
+            bits = bits << 6 | v;
+        }
+        if (n + 3 - pads > out_size) return -1;
+        out[n++] = bits >> 16;
+        if (pads < 2) out[n++] = bits >> 8;
+        if (pads < 1) out[n++] = bits;
+    }
+    return n;
+}
+
+struct auth_cached *auth_cache_find(struct auth_shard *sh, const uint8_t *key) {
+    uint32_t bucket;
+    memcpy(&bucket, key, sizeof(bucket));
+    for (int32_t i = sh->buckets[bucket & sh->bucket_mask]; i >= 0; i = sh->nodes[i].chain) {
+        if (memcmp(sh->nodes[i].key, key, 32) == 0) return &sh->nodes[i];
+    }
+    return NULL;
+}
+
+void auth_cache_unlink(struct auth_shard *sh, int32_t i) {
+    struct auth_cached *n = &sh->nodes[i];
+    if (n->prev >= 0) sh->nodes[n->prev].next = n->next;
+    else sh->head = n->next;
+    if (n->next >= 0) sh->nodes[n->next].prev = n->prev;
+    else sh->tail = n->prev;
+}
+
+void auth_cache_push(struct auth_shard *sh, int32_t i) {
+    struct auth_cached *n = &sh->nodes[i];
+    n->prev = -1;
+    n->next = sh->head;
+    if (sh->head >= 0) sh->nodes[sh->head].prev = i;
+    sh->head = i;
+    if (sh->tail < 0) sh->tail = i;
+}
+
+/* A hit becomes the newest entry. */
+int auth_cache_lookup(struct auth_store *st, const uint8_t *key) {
+    struct auth_shard *sh = &st->shards[key[31] % AUTH_CACHE_SHARDS];
+    if (sh->capacity == 0) return 0;
+    pthread_mutex_lock(&sh->lock);
+    struct auth_cached *n = auth_cache_find(sh, key);
+    if (n) {
+        auth_cache_unlink(sh, n - sh->nodes);
+        auth_cache_push(sh, n - sh->nodes);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return n != NULL;
+}
+
+/* Once the shard is full the oldest entry gives up its node. */
+void auth_cache_insert(struct auth_store *st, const uint8_t *key) {
+    struct auth_shard *sh = &st->shards[key[31] % AUTH_CACHE_SHARDS];
+    if (sh->capacity == 0) return;
+    pthread_mutex_lock(&sh->lock);
+    if (!auth_cache_find(sh, key)) {
+        int32_t i;
+        uint32_t bucket;
+        if (sh->count < sh->capacity) {
+            i = sh->count++;
+        } else {
+            i = sh->tail;
+            auth_cache_unlink(sh, i);
+            memcpy(&bucket, sh->nodes[i].key, sizeof(bucket));
+            int32_t *link = &sh->buckets[bucket & sh->bucket_mask];
+            while (*link != i) link = &sh->nodes[*link].chain;
+            *link = sh->nodes[i].chain;
+        }
+        memcpy(sh->nodes[i].key, key, 32);
+        memcpy(&bucket, key, sizeof(bucket));
+        sh->nodes[i].chain = sh->buckets[bucket & sh->bucket_mask];
+        sh->buckets[bucket & sh->bucket_mask] = i;
+        auth_cache_push(sh, i);
+    }
+    pthread_mutex_unlock(&sh->lock);
+}
+
+uint32_t auth_slot_hash(int kind, const char *name, const uint8_t *digest) {
+    uint32_t hash;
+    if (kind == AUTH_TOKEN) memcpy(&hash, digest, sizeof(hash));
+    else hash = hash_string(name);
+    return hash;
+}
+
+/* Users are found by name, tokens by their digest. */
+struct auth_entry *auth_find(struct auth_store *st, int kind, const char *name, const uint8_t *digest) {
+    uint32_t hash = auth_slot_hash(kind, name, digest);
+    for (uint32_t i = hash & st->slot_mask; st->slots[i] >= 0; i = (i + 1) & st->slot_mask) {
+        struct auth_entry *e = &st->entries[st->slots[i]];
+        if (e->hash != hash || e->kind != kind) continue;
+        if (kind == AUTH_TOKEN ? digest_equal(e->digest, digest, 32) : strcmp(e->name, name) == 0) return e;
+    }
+    return NULL;
+}
+
+/* One entry: "user NAME pbkdf2-sha256$ITERATIONS$SALT$HASH" or "token LABEL sha256$HASH", salt and hashes in hex. */
+int auth_parse_entry(char *line, struct auth_entry *e) {
+    char *save;
+    char *kind = strtok_r(line, " \t\r", &save);
+    char *name = kind ? strtok_r(NULL, " \t\r", &save) : NULL;
+    char *hash = name ? strtok_r(NULL, " \t\r", &save) : NULL;
+    if (!hash || strtok_r(NULL, " \t\r", &save)) return -1;
+
+    memset(e, 0, sizeof(*e));
+    e->name = name;
+    if (strcmp(kind, "token") == 0 && strncmp(hash, "sha256$", 7) == 0) {
+        e->kind = AUTH_TOKEN;
+        return hex_decode(hash + 7, strlen(hash + 7), e->digest, sizeof(e->digest)) == 32 ? 0 : -1;
+    }
+    if (strcmp(kind, "user") != 0 || strncmp(hash, "pbkdf2-sha256$", 14) != 0 || strchr(name, ':')) return -1;
+
+    char *iterations = hash + 14;
+    char *salt = strchr(iterations, '$');
+    char *digest = salt ? strchr(salt + 1, '$') : NULL;
+    if (!digest) return -1;
+    e->kind = AUTH_USER;
+    e->iterations = atoi(iterations);
+    int salt_len = hex_decode(salt + 1, digest - salt - 1, e->salt, sizeof(e->salt));
+    if (e->iterations < 1 || salt_len < 0) return -1;
+    e->salt_len = salt_len;
+    return hex_decode(digest + 1, strlen(digest + 1), e->digest, sizeof(e->digest)) == 32 ? 0 : -1;
+}
+
+void auth_free(struct auth_store *st) {
+    if (!st) return;
+    for (int i = 0; i < AUTH_CACHE_SHARDS; i++) {
+        pthread_mutex_destroy(&st->shards[i].lock);
+        free(st->shards[i].nodes);
+        free(st->shards[i].buckets);
+    }
+    free(st->slots);
+    free(st->entries);
+    free(st->text);
+    free(st);
+}
+
+/* Takes ownership of text, which the entry names keep pointing into. A name listed twice keeps its last hash. */
+struct auth_store *auth_compile(char *text, size_t len, int *skipped) {
+    struct auth_store *st = calloc(1, sizeof(*st));
+    if (!st) {
+        free(text);
+        return NULL;
+    }
+    for (int i = 0; i < AUTH_CACHE_SHARDS; i++) pthread_mutex_init(&st->shards[i].lock, NULL);
+    st->text = text;
+    text[len] = '\0';
+    *skipped = 0;
+
+    int capacity = 0;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        line += strspn(line, " \t\r");
+        if (!*line || *line == '#') continue;
+
+        if (st->count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct auth_entry *grown = realloc(st->entries, capacity * sizeof(*grown));
+            if (!grown) goto fail;
+            st->entries = grown;
+        }
+        if (auth_parse_entry(line, &st->entries[st->count]) < 0) (*skipped)++;
+        else st->count++;
+    }
+
+    uint32_t slots = 16;
+    while (slots < 2 * (uint32_t)st->count) slots <<= 1;
+    st->slot_mask = slots - 1;
+    st->slots = malloc(slots * sizeof(*st->slots));
+    if (!st->slots) goto fail;
+    for (uint32_t i = 0; i < slots; i++) st->slots[i] = -1;
+    st->dummy_iterations = AUTH_HASH_ITERATIONS;
+    for (int i = 0; i < st->count; i++) {
+        struct auth_entry *e = &st->entries[i];
+        if (e->kind == AUTH_USER && e->iterations > st->dummy_iterations) st->dummy_iterations = e->iterations;
+        struct auth_entry *prev = auth_find(st, e->kind, e->name, e->digest);
+        e->hash = auth_slot_hash(e->kind, e->name, e->digest);
+        if (prev) {
+            *prev = *e;
+            continue;
+        }
+        uint32_t slot = e->hash & st->slot_mask;
+        while (st->slots[slot] >= 0) slot = (slot + 1) & st->slot_mask;
+        st->slots[slot] = i;
+    }
+
+    int per_shard = (config.auth_cache + AUTH_CACHE_SHARDS - 1) / AUTH_CACHE_SHARDS;
+    for (int i = 0; i < AUTH_CACHE_SHARDS && per_shard > 0; i++) {
+        struct auth_shard *sh = &st->shards[i];
+        uint32_t buckets = 1;
+        while (buckets < (uint32_t)per_shard) buckets <<= 1;
+        sh->nodes = malloc(per_shard * sizeof(*sh->nodes));
+        sh->buckets = malloc(buckets * sizeof(*sh->buckets));
+        if (!sh->nodes || !sh->buckets) goto fail;
+        for (uint32_t b = 0; b < buckets; b++) sh->buckets[b] = -1;
+        sh->bucket_mask = buckets - 1;
+        sh->head = sh->tail = -1;
+        sh->capacity = per_shard;
+    }
+    return st;
+
+fail:
+    auth_free(st);
+    return NULL;
+}
+
+struct auth_store *auth_load(const char *path) {
+    char msg[512];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        snprintf(msg, sizeof(msg), "Cannot open user store %s: %s", path, strerror(errno));
+        LOG_ERROR(msg);
+        return NULL;
+    }
+
+    long size = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    char *data = size >= 0 && size <= AUTH_FILE_MAX ? malloc(size + 1) : NULL;
+    size_t len = data && fseek(f, 0, SEEK_SET) == 0 ? fread(data, 1, size, f) : 0;
+    fclose(f);
+    int skipped = 0;
+    struct auth_store *st = NULL;
+    if (data && len == (size_t)size) st = auth_compile(data, len, &skipped);
+    else free(data);
+    if (!st) {
+        snprintf(msg, sizeof(msg), "Cannot load user store %s", path);
+        LOG_ERROR(msg);
+        return NULL;
+    }
+
+    snprintf(msg, sizeof(msg), "Authenticating against %d credential%s from %s (%d skipped)", st->count, st->count == 1 ? "" : "s", path, skipped);
+    if (st->count == 0) LOG_WARN(msg);
+    else LOG_INFO(msg);
+    return st;
+}
+
+/* Whether the name or address in f is still serving out the wait its last miss earned. */
+int auth_fail_blocked(const struct auth_failure *f, uint32_t key, uint64_t now) {
+    return f->seen_ms && f->key == key && now < f->until_ms;
+}
+
+/* Past AUTH_FAIL_FREE misses in a row, each one doubles the wait before the next derivation, up to AUTH_FAIL_MAX_MS;
+ * a quiet spell that long starts the count over. */
+void auth_fail_note(struct auth_failure *f, uint32_t key, uint64_t now) {
+    if (!f->seen_ms || f->key != key || now - f->seen_ms > AUTH_FAIL_MAX_MS) {
+        f->key = key;
+        f->count = 0;
+        f->until_ms = 0;
+    }
+    f->seen_ms = now;
+    if (++f->count <= AUTH_FAIL_FREE) return;
+    int shift = f->count - AUTH_FAIL_FREE - 1;
+    uint64_t wait = shift < 7 ? (uint64_t)AUTH_FAIL_BASE_MS << shift : AUTH_FAIL_MAX_MS;
+    f->until_ms = now + (wait < AUTH_FAIL_MAX_MS ? wait : AUTH_FAIL_MAX_MS);
+}
+
+/* Checks (note < 0), records a miss (note > 0) or clears (note == 0) the throttle on a client address and, when
+ * name is set, on that user name. Returns 1 while either is held off. */
+int auth_throttle(const char *name, uint32_t client_addr, int note) {
+    uint64_t now = now_ms();
+    uint32_t user_key = name ? hash_string(name) : 0;
+    struct auth_failure *user = &auth_user_failures[user_key % AUTH_FAIL_SLOTS];
+    struct auth_failure *addr = &auth_addr_failures[(client_addr * 2654435761u) % AUTH_FAIL_SLOTS];
+    int blocked = 0;
+
+    pthread_mutex_lock(&auth_fail_lock);
+    if (note < 0) {
+        blocked = auth_fail_blocked(addr, client_addr, now) || (name && auth_fail_blocked(user, user_key, now));
+    } else if (note > 0) {
+        auth_fail_note(addr, client_addr, now);
+        if (name) auth_fail_note(user, user_key, now);
+    } else {
+        if (addr->key == client_addr) addr->seen_ms = 0;
+        if (name && user->key == user_key) user->seen_ms = 0;
+    }
+    pthread_mutex_unlock(&auth_fail_lock);
+    return blocked;
+}
+
+/* Checks one Proxy-Authorization value. The cache key is the SHA-256 of the whole value, so a hit costs one hash and
+ * no password derivation, and the cache never holds a secret. A name missing from the store is derived against a
+ * dummy salt all the same, so the time a miss takes does not tell which users exist. Returns 0 to admit, -1 to
+ * refuse, or 1 when only a derivation can tell and derive is 0. */
+int auth_verify(struct auth_store *st, const char *value, size_t len, uint32_t client_addr, int derive) {
+    uint8_t key[32];
+    sha256(value, len, key);
+    if (auth_cache_lookup(st, key)) {
+        metrics_add(METRIC_AUTH_CACHED, 1);
+        return 0;
+    }
+
+    char credentials[512];
+    const char *name = NULL;
+    int ok = 0;
+    if (len > 7 && strncasecmp(value, "Bearer ", 7) == 0) {
+        uint8_t digest[32];
+        sha256(value + 7, len - 7, digest);
+        ok = auth_find(st, AUTH_TOKEN, NULL, digest) != NULL;
+    } else if (len > 6 && strncasecmp(value, "Basic ", 6) == 0) {
+        int n = base64_decode(value + 6, len - 6, (uint8_t *)credentials, sizeof(credentials) - 1);
+        char *colon = n > 0 ? memchr(credentials, ':', n) : NULL;
+        if (colon) {
+            credentials[n] = '\0';
+            *colon = '\0';
+            name = credentials;
+            if (auth_throttle(name, client_addr, -1)) {
+                memset(credentials, 0, sizeof(credentials));
+                metrics_add(METRIC_AUTH_THROTTLED, 1);
+                return -1;
+            }
+            if (!derive) {
+                memset(credentials, 0, sizeof(credentials));
+                return 1;
+            }
+            static const uint8_t dummy_salt[16];
+            struct auth_entry *e = auth_find(st, AUTH_USER, credentials, NULL);
+            uint8_t digest[32];
+            if (e) {
+                pbkdf2_sha256(colon + 1, credentials + n - colon - 1, e->salt, e->salt_len, e->iterations, digest);
+                ok = digest_equal(digest, e->digest, 32);
+            } else {
+                pbkdf2_sha256(colon + 1, credentials + n - colon - 1, dummy_salt, sizeof(dummy_salt), st->dummy_iterations, digest);
+            }
+        }
+    }
+
+    auth_throttle(name, client_addr, !ok);
+    memset(credentials, 0, sizeof(credentials));
+    if (!ok) {
+        metrics_add(METRIC_AUTH_FAILED, 1);
+        return -1;
+    }
+    metrics_add(METRIC_AUTH_VERIFIED, 1);
+    auth_cache_insert(st, key);
+    return 0;
+}
+
+/* Whether a request may use the proxy. With derive set a cache miss derives the password hash on the calling thread,
+ * which only the thread engine can afford; otherwise a miss that needs one returns 1 and is left to the caller. */
+int auth_check(const struct http_message *m, uint32_t client_addr, int derive) {
+    if (!config.users) return 0;
+    size_t len;
+    const char *value = http_find_header(m, "Proxy-Authorization", &len);
+    int rc = -1;
+    if (value && rcu_read_lock() == 0) {
+        rc = auth_verify(__atomic_load_n(&auth_store, __ATOMIC_ACQUIRE), value, len, client_addr, derive);
+        rcu_read_unlock();
+    } else if (!value) {
+        metrics_add(METRIC_AUTH_FAILED, 1);
+    }
+    return rc;
+}
+
+/* Queues a value for the verifier pool; refused once AUTH_QUEUE_MAX are already waiting. */
+int verifier_submit(struct conn *c, const char *value, size_t len) {
+    struct auth_job *job = malloc(sizeof(*job) + len);
+    if (!job) return -1;
+    job->next = NULL;
+    job->conn = c;
+    job->client_addr = c->client_addr;
+    job->len = len;
+    memcpy(job->value, value, len);
+
+    pthread_mutex_lock(&verifier.lock);
+    int full = verifier.queued >= AUTH_QUEUE_MAX;
+    if (!full) {
+        if (verifier.tail) verifier.tail->next = job;
+        else verifier.head = job;
+        verifier.tail = job;
+        verifier.queued++;
+        pthread_cond_signal(&verifier.cond);
+    }
+    pthread_mutex_unlock(&verifier.lock);
+    if (full) free(job);
+    return full ? -1 : 0;
+}
+
+/* Derives off the reactor threads and hands each conn back through its worker's mailbox, as the resolver does. */
+void *verifier_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&verifier.lock);
+        while (!verifier.head) pthread_cond_wait(&verifier.cond, &verifier.lock);
+        struct auth_job *job = verifier.head;
+        verifier.head = job->next;
+        if (!verifier.head) verifier.tail = NULL;
+        verifier.queued--;
+        pthread_mutex_unlock(&verifier.lock);
+
+        int rc = -1;
+        if (rcu_read_lock() == 0) {
+            rc = auth_verify(__atomic_load_n(&auth_store, __ATOMIC_ACQUIRE), job->value, job->len, job->client_addr, 1);
+            rcu_read_unlock();
+        }
+        struct conn *c = job->conn;
+        memset(job->value, 0, job->len);
+        free(job);
+        c->auth_verdict = rc == 0 ? 1 : -1;
+        mailbox_post(&c->worker->mailbox, c);
+    }
+    return NULL;
+}
+
+void verifier_init(void) {
+    for (int i = 0; i < config.auth_threads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, verifier_main, NULL) != 0) {
+            metrics_error(ERROR_RESOURCE);
+            LOG_ERROR("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(tid);
+    }
+}
+
+/* Removes the client's credentials from a head about to be forwarded, keeping the parsed headers pointing at the
+ * right bytes. Returns the number of bytes cut from buf. Only heads the proxy parses pass through here; without
+ * pooling, later requests on the same connection are relayed as they are. */
+size_t auth_strip(char *buf, size_t len, struct http_message *m) {
+    size_t cut = 0;
+    for (size_t i = 0; config.users && i < m->num_headers;) {
+        struct http_header *h = &m->headers[i];
+        if (h->name_len != 19 || strncasecmp(h->name, "Proxy-Authorization", 19) != 0) {
+            h->name -= cut;
+            h->value -= cut;
+            i++;
+            continue;
+        }
+        char *line = (char *)h->name - cut;
+        char *end = memchr(h->value - cut + h->value_len, '\n', buf + len - cut - (h->value - cut + h->value_len));
+        if (!end) break;
+        size_t line_len = end + 1 - line;
+        memmove(line, end + 1, buf + len - cut - (end + 1));
+        cut += line_len;
+        memmove(h, h + 1, (m->num_headers - i - 1) * sizeof(*h));
+        m->num_headers--;
+    }
+    return cut;
+}
+
+/* Only the watch thread swaps stores; readers never keep a pointer past their read section. */
+void auth_reload(void) {
+    struct auth_store *st = auth_load(config.users);
+    if (!st) {
+        LOG_WARN("Keeping the current user store");
+        return;
+    }
+
+    struct auth_store *old = auth_store;
+    __atomic_store_n(&auth_store, st, __ATOMIC_RELEASE);
+    rcu_synchronize();
+    metrics_add(METRIC_AUTH_RELOADS, 1);
+    auth_free(old);
+}
+
+/* Prints a store line for NAME with the password read from stdin's first line. */
+int auth_hash_password(const char *name) {
+    char password[512];
+    uint8_t salt[16], digest[32];
+    if (!fgets(password, sizeof(password), stdin)) return EXIT_FAILURE;
+    password[strcspn(password, "\r\n")] = '\0';
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    ssize_t got = fd >= 0 ? read(fd, salt, sizeof(salt)) : -1;
+    if (fd >= 0) close(fd);
+    if (got != (ssize_t)sizeof(salt)) {
+        fprintf(stderr, "Cannot read /dev/urandom\n");
+        return EXIT_FAILURE;
+    }
+
+    pbkdf2_sha256(password, strlen(password), salt, sizeof(salt), AUTH_HASH_ITERATIONS, digest);
+    memset(password, 0, sizeof(password));
+    printf("user %s pbkdf2-sha256$%d$", name, AUTH_HASH_ITERATIONS);
+    for (size_t i = 0; i < sizeof(salt); i++) printf("%02x", salt[i]);
+    printf("$");
+    for (size_t i = 0; i < sizeof(digest); i++) printf("%02x", digest[i]);
+    printf("\n");
+    return EXIT_SUCCESS;
+}
+
+void policy_request_reload(void) {
+    pthread_mutex_lock(&watch_lock);
+    policy_reload_requested = 1;
+    pthread_cond_signal(&watch_cond);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+void auth_request_reload(void) {
+    pthread_mutex_lock(&watch_lock);
+    auth_reload_requested = 1;
+    pthread_cond_signal(&watch_cond);
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/* Reloads the policy and the user store when asked to or when their files change. */
+void *watch_main(void *arg) {
+    (void)arg;
+    struct stat policy_seen, users_seen;
+    if (!config.policy || stat(config.policy, &policy_seen) < 0) memset(&policy_seen, 0, sizeof(policy_seen));
+    if (!config.users || stat(config.users, &users_seen) < 0) memset(&users_seen, 0, sizeof(users_seen));
+
+    for (;;) {
+        pthread_mutex_lock(&watch_lock);
+        if (!policy_reload_requested && !auth_reload_requested) {
+            struct timespec wake;
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec++;
+            pthread_cond_timedwait(&watch_cond, &watch_lock, &wake);
+        }
+        int reload_policy = policy_reload_requested, reload_users = auth_reload_requested;
+        policy_reload_requested = auth_reload_requested = 0;
+        pthread_mutex_unlock(&watch_lock);
+
+        if (config.policy && (file_changed(config.policy, &policy_seen) || reload_policy)) policy_reload();
+        if (config.users && (file_changed(config.users, &users_seen) || reload_users)) auth_reload();
+    }
+    return NULL;
+}
+
+void start_watch(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, watch_main, NULL) != 0) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Thread creation failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+}
+
+/* Maps the block store into an unlinked file under --cache-dir, so nothing outlives the process. */
+void cache_init(void) {
+    char msg[PATH_MAX + 128];
+    if (!config.cache_dir) return;
+    if (config.engine != ENGINE_THREAD) {
+        LOG_WARN("The HTTP cache is only used by the thread engine");
+        return;
+    }
+
+    snprintf(msg, sizeof(msg), "%s/anonynet-cache.XXXXXX", config.cache_dir);
+    cache.fd = mkstemp(msg);
+    if (cache.fd >= 0) unlink(msg);
+    size_t size = (size_t)config.cache_size * 1024 * 1024;
+    cache.blocks = size / CACHE_BLOCK;
+    if (cache.fd < 0 || cache.blocks == 0 || ftruncate(cache.fd, (off_t)cache.blocks * CACHE_BLOCK) < 0) {
+        snprintf(msg, sizeof(msg), "Cannot create the cache store in %s: %s", config.cache_dir, strerror(errno));
+        LOG_ERROR(msg);
+        exit(EXIT_FAILURE);
+    }
+    cache.map = mmap(NULL, (size_t)cache.blocks * CACHE_BLOCK, PROT_READ | PROT_WRITE, MAP_SHARED, cache.fd, 0);
+
+    uint32_t buckets = 1024;
+    while (buckets < cache.blocks / 2) buckets <<= 1;
+    cache.bucket_mask = buckets - 1;
+    cache.sketch_mask = buckets * 4 - 1;
+    cache.buckets = calloc(buckets, sizeof(*cache.buckets));
+    cache.sketch = calloc(CACHE_SKETCH_ROWS, (size_t)cache.sketch_mask + 1);
+    cache.free_blocks = malloc(cache.blocks * sizeof(*cache.free_blocks));
+    if (cache.map == MAP_FAILED || !cache.buckets || !cache.sketch || !cache.free_blocks) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    /* Popped from the end, so a cold store hands out runs of adjacent blocks. */
+    for (uint32_t i = 0; i < cache.blocks; i++) cache.free_blocks[i] = cache.blocks - 1 - i;
+    cache.free_count = cache.blocks;
+
+    snprintf(msg, sizeof(msg), "Caching up to %d MiB of HTTP responses in %s", config.cache_size, config.cache_dir);
+    LOG_INFO(msg);
+}
+
+uint8_t *cache_sketch_counter(uint32_t hash, int row) {
+    static const uint32_t seeds[CACHE_SKETCH_ROWS] = {0x9e3779b1, 0x85ebca77, 0xc2b2ae3d, 0x27d4eb2f};
+    uint32_t h = hash * seeds[row];
+    return &cache.sketch[(size_t)row * (cache.sketch_mask + 1) + ((h ^ h >> 15) & cache.sketch_mask)];
+}
+
+/* Counts one use of a key. Every counter is halved after ten uses per slot, so old popularity fades. */
+void cache_touch(uint32_t hash) {
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t *c = cache_sketch_counter(hash, row);
+        if (*c < 15) (*c)++;
+    }
+    if (++cache.sketch_ops < 10 * (cache.sketch_mask + 1)) return;
+    for (size_t i = 0; i < CACHE_SKETCH_ROWS * ((size_t)cache.sketch_mask + 1); i++) cache.sketch[i] >>= 1;
+    cache.sketch_ops = 0;
+}
+
+int cache_frequency(uint32_t hash) {
+    int min = 15;
+    for (int row = 0; row < CACHE_SKETCH_ROWS; row++) {
+        uint8_t *c = cache_sketch_counter(hash, row);
+        if (*c < min) min = *c;
+    }
+    return min;
+}
+
+/* The cache lock is held for everything from here to cache_publish. */
+void cache_put(struct cache_object *o) {
+    if (--o->refs > 0) return;
+    for (uint32_t i = 0; i < o->block_count; i++) cache.free_blocks[cache.free_count++] = o->blocks[i];
+    free(o);
+}
+
+void cache_lru_remove(struct cache_object *o) {
+    if (o->lru_prev) o->lru_prev->lru_next = o->lru_next;
+    else cache.lru_head = o->lru_next;
+    if (o->lru_next) o->lru_next->lru_prev = o->lru_prev;
+    else cache.lru_tail = o->lru_prev;
+}
+
+void cache_lru_push(struct cache_object *o) {
+    o->lru_prev = NULL;
+    o->lru_next = cache.lru_head;
+    if (cache.lru_head) cache.lru_head->lru_prev = o;
+    cache.lru_head = o;
+    if (!cache.lru_tail) cache.lru_tail = o;
+}
+
+/* Takes the object out of the index; a hit still sending it keeps the blocks until it is done. */
+void cache_unlink(struct cache_object *o) {
+    struct cache_object **link = &cache.buckets[o->hash & cache.bucket_mask];
+    while (*link != o) link = &(*link)->next;
+    *link = o->next;
+    cache_lru_remove(o);
+    o->indexed = 0;
+    metrics_add(METRIC_CACHE_BYTES, -(int64_t)o->body_len);
+    cache_put(o);
+}
+
+struct cache_object *cache_find(const char *key, uint32_t hash) {
+    for (struct cache_object *o = cache.buckets[hash & cache.bucket_mask]; o; o = o->next) {
+        if (o->hash == hash && strcmp(o->key, key) == 0) return o;
+    }
+    return NULL;
+}
+
+struct cache_pending *cache_pending_find(const char *key, uint32_t hash) {
+    for (struct cache_pending *p = cache.pending; p; p = p->next) {
+        if (p->hash == hash && strcmp(p->key, key) == 0) return p;
+    }
+    return NULL;
+}
+
+/* Lets any lookups waiting on this request's fetch go ahead. */
+void cache_release(struct cache_fill *fill) {
+    if (!fill->pending) return;
+    pthread_mutex_lock(&cache.lock);
+    struct cache_pending **link = &cache.pending;
+    while (*link != fill->pending) link = &(*link)->next;
+    *link = fill->pending->next;
+    free(fill->pending);
+    fill->pending = NULL;
+    pthread_cond_broadcast(&cache.filled);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* Finds blocks for the object, evicting from the cold end. TinyLFU admission: a victim is only evicted for a key that
+ * has been asked for more often, and an older copy of the same key always makes way. */
+int cache_reserve(struct cache_fill *fill, struct cache_object *o) {
+    pthread_mutex_lock(&cache.lock);
+    while (cache.free_count < o->block_count && cache.lru_tail) {
+        struct cache_object *victim = cache.lru_tail;
+        int same = victim->hash == fill->hash && strcmp(victim->key, fill->key) == 0;
+        if (!same && cache_frequency(fill->hash) <= cache_frequency(victim->hash)) break;
+        cache_unlink(victim);
+        metrics_add(METRIC_CACHE_EVICTIONS, 1);
+    }
+    int ok = cache.free_count >= o->block_count;
+    for (uint32_t i = 0; ok && i < o->block_count; i++) o->blocks[i] = cache.free_blocks[--cache.free_count];
+    pthread_mutex_unlock(&cache.lock);
+    if (!ok) metrics_add(METRIC_CACHE_REJECTED, 1);
+    return ok ? 0 : -1;
+}
+
+/* Replaces any older copy of the key and wakes the lookups that were waiting for it. */
+void cache_publish(struct cache_fill *fill, struct cache_object *o) {
+    pthread_mutex_lock(&cache.lock);
+    struct cache_object *old = cache_find(o->key, o->hash);
+    if (old) cache_unlink(old);
+    o->next = cache.buckets[o->hash & cache.bucket_mask];
+    cache.buckets[o->hash & cache.bucket_mask] = o;
+    cache_lru_push(o);
+    o->indexed = 1;
+    pthread_mutex_unlock(&cache.lock);
+    metrics_add(METRIC_CACHE_BYTES, o->body_len);
+    metrics_add(METRIC_CACHE_STORED, 1);
+    cache_release(fill);
+}
+
+void cache_discard(struct cache_fill *fill, struct cache_object *o) {
+    pthread_mutex_lock(&cache.lock);
+    cache_put(o);
+    pthread_mutex_unlock(&cache.lock);
+    cache_release(fill);
+}
+
+void cache_object_release(struct cache_object *o) {
+    pthread_mutex_lock(&cache.lock);
+    cache_put(o);
+    pthread_mutex_unlock(&cache.lock);
+}
+
+/* Delta-seconds (RFC 9111 section 1.2.2), saturating at 2^31; -1 if malformed. */
+int64_t delta_seconds(const char *p, size_t len) {
+    int64_t value = 0;
+    if (len == 0) return -1;
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] < '0' || p[i] > '9') return -1;
+        if (value < 2147483648LL) value = value * 10 + (p[i] - '0');
+    }
+    return value < 2147483648LL ? value : 2147483648LL;
+}
+
+/* Whether any Cache-Control field carries the directive; its argument, if asked for, is 0 when missing or malformed. */
+int cache_control(const struct http_message *m, const char *directive, int64_t *arg) {
+    size_t directive_len = strlen(directive);
+    for (size_t h = 0; h < m->num_headers; h++) {
+        const struct http_header *hdr = &m->headers[h];
+        if (hdr->name_len != 13 || strncasecmp(hdr->name, "Cache-Control", 13) != 0) continue;
+
+        const char *p = hdr->value, *end = p + hdr->value_len;
+        while (p < end) {
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+            const char *name = p;
+            while (p < end && *p != ',' && *p != '=' && *p != ' ' && *p != '\t') p++;
+            size_t name_len = p - name;
+            const char *value = p, *value_end = p;
+            while (p < end && (*p == ' ' || *p == '\t')) p++;
+            if (p < end && *p == '=') {
+                p++;
+                int quoted = p < end && *p == '"';
+                value = p += quoted;
+                while (p < end && (quoted ? *p != '"' : *p != ',' && *p != ' ' && *p != '\t')) p++;
+                value_end = p;
+            }
+            while (p < end && *p != ',') p++;
+            if (name_len != directive_len || strncasecmp(name, directive, name_len) != 0) continue;
+            if (arg) {
+                *arg = delta_seconds(value, value_end - value);
+                if (*arg < 0) *arg = 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* IMF-fixdate only (RFC 9110 section 5.6.7); -1 if the field is missing or in another form. */
+int64_t http_date(const struct http_message *m, const char *name) {
+    size_t len;
+    const char *value = http_find_header(m, name, &len);
+    char copy[64];
+    if (!value || len >= sizeof(copy)) return -1;
+    memcpy(copy, value, len);
+    copy[len] = '\0';
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char *end = strptime(copy, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if (!end || *end) return -1;
+    return timegm(&tm);
+}
+
+/* The primary key: the target's authority and path, so absolute and origin-form requests share entries. */
+int cache_key(const struct request *req, char *out, size_t size) {
+    const char *target = req->msg.target;
+    size_t len = req->msg.target_len;
+    if (len > 7 && strncasecmp(target, "http://", 7) == 0) {
+        const char *path = memchr(target + 7, '/', len - 7);
+        len = path ? len - (path - target) : 1;
+        target = path ? path : "/";
+    } else if (len == 0 || target[0] != '/') {
+        return -1;
+    }
+
+    int n = snprintf(out, size, "%s:%d", req->host, req->port);
+    if (n < 0 || (size_t)n + len >= size) return -1;
+    for (int i = 0; i < n; i++) {
+        if (out[i] >= 'A' && out[i] <= 'Z') out[i] += 'a' - 'A';
+    }
+    memcpy(out + n, target, len);
+    out[n + len] = '\0';
+    return 0;
+}
+
+/* The secondary key: the request's value for each field the response varies on, one per line. */
+int cache_vary_values(const struct http_message *req, const char *names, size_t names_len, char *out, size_t size) {
+    const char *p = names, *end = names + names_len;
+    size_t n = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+        const char *name = p;
+        while (p < end && *p != ',' && *p != ' ' && *p != '\t') p++;
+        char field[64];
+        if (p == name) continue;
+        if ((size_t)(p - name) >= sizeof(field)) return -1;
+        memcpy(field, name, p - name);
+        field[p - name] = '\0';
+
+        size_t value_len = 0;
+        const char *value = http_find_header(req, field, &value_len);
+        if (n + value_len + 2 > size) return -1;
+        if (value) memcpy(out + n, value, value_len);
+        n += value_len;
+        out[n++] = '\n';
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/* Whether the stored response may answer this request: same Vary inputs, and fresh enough for the request's own
+ * max-age and min-fresh (RFC 9111 sections 4.1, 4.2 and 5.2.1). */
+int cache_usable(const struct cache_object *o, const struct http_message *req, int64_t now, int64_t max_age, int64_t min_fresh) {
+    if (o->vary_names) {
+        char values[CACHE_VARY_MAX];
+        if (cache_vary_values(req, o->vary_names, strlen(o->vary_names), values, sizeof(values)) < 0 || strcmp(values, o->vary_values) != 0) return 0;
+    }
+    int64_t age = o->initial_age + (now > o->response_time ? now - o->response_time : 0);
+    if (age + min_fresh >= o->lifetime) return 0;
+    return max_age < 0 || age <= max_age;
+}
+
+enum cache_result { CACHE_BYPASS, CACHE_MISS, CACHE_HIT, CACHE_UNAVAILABLE };
+
+/* Looks the request up, waiting out a concurrent fetch of the same key once. A miss that finds nobody fetching
+ * becomes the fetch others wait on. Unsafe methods drop the stored copy of their target (RFC 9111 section 4.4). */
+int cache_lookup(const struct request *req, struct cache_fill *fill, struct cache_object **hit) {
+    const struct http_message *m = &req->msg;
+    size_t len;
+    fill->cacheable = 0;
+    fill->pending = NULL;
+    *hit = NULL;
+    if (!cache.map) return CACHE_BYPASS;
+
+    int safe = strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0 || strcmp(req->method, "OPTIONS") == 0 ||
+               strcmp(req->method, "TRACE") == 0;
+    if (!safe && cache_key(req, fill->key, sizeof(fill->key)) == 0) {
+        fill->hash = hash_string(fill->key);
+        pthread_mutex_lock(&cache.lock);
+        struct cache_object *o = cache_find(fill->key, fill->hash);
+        if (o) cache_unlink(o);
+        pthread_mutex_unlock(&cache.lock);
+    }
+    static const char *bypass_fields[] = {"Authorization", "Range", "If-Match", "If-None-Match", "If-Modified-Since", "If-Unmodified-Since", "If-Range"};
+    int bypass = strcmp(req->method, "GET") != 0 || cache_control(m, "no-store", NULL);
+    for (size_t i = 0; i < sizeof(bypass_fields) / sizeof(bypass_fields[0]) && !bypass; i++) bypass = http_find_header(m, bypass_fields[i], &len) != NULL;
+    if (bypass || cache_key(req, fill->key, sizeof(fill->key)) < 0) {
+        metrics_add(METRIC_CACHE_BYPASSES, 1);
+        return CACHE_BYPASS;
+    }
+    fill->cacheable = 1;
+    fill->hash = hash_string(fill->key);
+    fill->request_time = time(NULL);
+
+    int64_t max_age = -1, min_fresh = 0;
+    const char *pragma = http_find_header(m, "Pragma", &len);
+    int revalidate = cache_control(m, "no-cache", NULL) || (cache_control(m, "max-age", &max_age) && max_age == 0) ||
+                     (!http_find_header(m, "Cache-Control", &len) && pragma && header_has_token(pragma, len, "no-cache"));
+    cache_control(m, "min-fresh", &min_fresh);
+    int only_cached = cache_control(m, "only-if-cached", NULL);
+
+    pthread_mutex_lock(&cache.lock);
+    cache_touch(fill->hash);
+    for (int waited = 0;; waited = 1) {
+        struct cache_object *o = revalidate ? NULL : cache_find(fill->key, fill->hash);
+        if (o && cache_usable(o, m, time(NULL), max_age, min_fresh)) {
+            o->refs++;
+            cache_lru_remove(o);
+            cache_lru_push(o);
+            pthread_mutex_unlock(&cache.lock);
+            metrics_add(waited ? METRIC_CACHE_COALESCED : METRIC_CACHE_HITS, 1);
+            *hit = o;
+            return CACHE_HIT;
+        }
+        if (only_cached) {
+            pthread_mutex_unlock(&cache.lock);
+            metrics_add(METRIC_CACHE_MISSES, 1);
+            return CACHE_UNAVAILABLE;
+        }
+        if (waited || revalidate || !cache_pending_find(fill->key, fill->hash)) break;
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += CACHE_COALESCE_WAIT_MS / 1000;
+        while (cache_pending_find(fill->key, fill->hash)) {
+            if (pthread_cond_timedwait(&cache.filled, &cache.lock, &deadline) == ETIMEDOUT) break;
+        }
+    }
+
+    if (!cache_pending_find(fill->key, fill->hash)) {
+        size_t key_len = strlen(fill->key);
+        fill->pending = malloc(sizeof(*fill->pending) + key_len + 1);
+        if (fill->pending) {
+            fill->pending->hash = fill->hash;
+            memcpy(fill->pending->key, fill->key, key_len + 1);
+            fill->pending->next = cache.pending;
+            cache.pending = fill->pending;
+        }
+    }
+    pthread_mutex_unlock(&cache.lock);
+    metrics_add(METRIC_CACHE_MISSES, 1);
+    return CACHE_MISS;
+}
+
+/* Freshness lifetime and initial age (RFC 9111 sections 4.2.1 and 4.2.3), or -1 if a shared cache must not store the
+ * response or it would be stale on arrival. Responses with cookies or field-qualified no-cache/private are left alone. */
+int cache_freshness(const struct cache_fill *fill, const struct http_message *m, int64_t response_time, int64_t *lifetime, int64_t *initial_age) {
+    static const int cacheable_status[] = {200, 203, 204, 300, 301, 308, 404, 405, 410, 414, 501};
+    size_t len;
+    int status_ok = 0;
+    for (size_t i = 0; i < sizeof(cacheable_status) / sizeof(cacheable_status[0]); i++) status_ok |= m->status == cacheable_status[i];
+    if (!status_ok || cache_control(m, "no-store", NULL) || cache_control(m, "private", NULL) || cache_control(m, "no-cache", NULL) ||
+        http_find_header(m, "Set-Cookie", &len)) {
+        return -1;
+    }
+
+    int64_t date = http_date(m, "Date");
+    if (date < 0) date = response_time;
+    int64_t value;
+    if (cache_control(m, "s-maxage", &value) || cache_control(m, "max-age", &value)) {
+        *lifetime = value;
+    } else if (http_find_header(m, "Expires", &len)) {
+        int64_t expires = http_date(m, "Expires");
+        *lifetime = expires > date ? expires - date : 0;
+    } else {
+        int64_t modified = http_date(m, "Last-Modified");
+        *lifetime = modified >= 0 && modified < date ? (date - modified) / 10 : 0;
+        if (*lifetime > CACHE_HEURISTIC_MAX) *lifetime = CACHE_HEURISTIC_MAX;
+    }
+
+    const char *age_field = http_find_header(m, "Age", &len);
+    int64_t age = age_field ? delta_seconds(age_field, len) : 0;
+    if (age < 0) age = 0;
+    int64_t apparent = response_time > date ? response_time - date : 0;
+    int64_t corrected = age + (response_time > fill->request_time ? response_time - fill->request_time : 0);
+    *initial_age = apparent > corrected ? apparent : corrected;
+    return *lifetime > *initial_age ? 0 : -1;
+}
+
+/* Fields that only describe this hop, or the age we recompute on every hit, are not stored (RFC 9111 section 3.1). */
+int cache_hop_field(const struct http_header *h, const char *connection, size_t connection_len) {
+    static const char *fields[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Transfer-Encoding", "Trailer", "Upgrade", "Age", "Proxy-Authenticate"};
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        if (h->name_len == strlen(fields[i]) && strncasecmp(h->name, fields[i], h->name_len) == 0) return 1;
+    }
+    char name[64];
+    if (!connection || h->name_len >= sizeof(name)) return 0;
+    memcpy(name, h->name, h->name_len);
+    name[h->name_len] = '\0';
+    return header_has_token(connection, connection_len, name);
+}
+
+/* Builds the object for a storable response with a known length and reserves its blocks; NULL means relay it uncached. */
+struct cache_object *cache_prepare(struct cache_fill *fill, const struct request *req, const struct http_message *m, const struct response_head *rh, const char *buf, size_t head_len) {
+    int64_t response_time = time(NULL), lifetime, initial_age;
+    if (!fill->cacheable || cache_freshness(fill, m, response_time, &lifetime, &initial_age) < 0) return NULL;
+    if (rh->body.kind != BODY_LENGTH && !(rh->body.kind == BODY_NONE && m->status == 204)) return NULL;
+    uint64_t body_len = rh->body.kind == BODY_LENGTH ? rh->body.remaining : 0;
+    if (body_len > (uint64_t)config.cache_object_max * 1024 * 1024) return NULL;
+
+    size_t vary_len = 0, connection_len = 0;
+    const char *vary = http_find_header(m, "Vary", &vary_len);
+    const char *connection = http_find_header(m, "Connection", &connection_len);
+    char values[CACHE_VARY_MAX];
+    int values_len = 0;
+    if (vary && (header_has_token(vary, vary_len, "*") || (values_len = cache_vary_values(&req->msg, vary, vary_len, values, sizeof(values))) < 0)) return NULL;
+
+    const char *status_end = memchr(buf, '\n', head_len);
+    size_t status_len = status_end ? status_end + 1 - buf : 0, fields_len = 0;
+    for (size_t i = 0; i < m->num_headers; i++) {
+        if (!cache_hop_field(&m->headers[i], connection, connection_len)) fields_len += m->headers[i].name_len + m->headers[i].value_len + 4;
+    }
+    uint32_t blocks = (body_len + CACHE_BLOCK - 1) / CACHE_BLOCK;
+    size_t key_len = strlen(fill->key);
+    struct cache_object *o = calloc(1, sizeof(*o) + blocks * sizeof(uint32_t) + key_len + 1 + status_len + fields_len + 1 + (vary ? vary_len + values_len + 2 : 0));
+    if (!o) return NULL;
+
+    char *p = (char *)&o->blocks[blocks];
+    o->key = memcpy(p, fill->key, key_len + 1);
+    p += key_len + 1;
+    o->head = p;
+    memcpy(p, buf, status_len);
+    p += status_len;
+    for (size_t i = 0; i < m->num_headers; i++) {
+        const struct http_header *h = &m->headers[i];
+        if (cache_hop_field(h, connection, connection_len)) continue;
+        p += sprintf(p, "%.*s: %.*s\r\n", (int)h->name_len, h->name, (int)h->value_len, h->value);
+    }
+    o->head_len = p - o->head;
+    *p++ = '\0';
+    if (vary) {
+        o->vary_names = memcpy(p, vary, vary_len);
+        p[vary_len] = '\0';
+        o->vary_values = memcpy(p + vary_len + 1, values, values_len + 1);
+    }
+    o->hash = fill->hash;
+    o->refs = 1;
+    o->response_time = response_time;
+    o->initial_age = initial_age;
+    o->lifetime = lifetime;
+    o->body_len = body_len;
+    o->block_count = blocks;
+    if (cache_reserve(fill, o) < 0) {
+        free(o);
+        return NULL;
+    }
+    return o;
+}
+
+void cache_write(struct cache_object *o, uint64_t offset, const char *data, size_t len) {
+    while (len > 0) {
+        uint32_t block = offset / CACHE_BLOCK;
+        size_t at = offset % CACHE_BLOCK, take = CACHE_BLOCK - at < len ? CACHE_BLOCK - at : len;
+        memcpy(cache.map + (size_t)o->blocks[block] * CACHE_BLOCK + at, data, take);
+        offset += take;
+        data += take;
+        len -= take;
+    }
+}
+
+/* Thread engine: bytes sent to the client outside the tunnel still count against its rate and in the trace. */
+int cache_send_down(int fd, const char *data, size_t len, struct rate_bucket *rate, struct trace *trace) {
+    if (len > 0) trace_mark(trace, TRACE_FIRST_DOWN);
+    while (len > 0) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return -1;
+        metrics_add(METRIC_BYTES_DOWN, sent);
+        rate_charge(rate, sent);
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/* Thread engine: the stored head with a fresh Age, then the body straight from the store with sendfile, one call per
+ * run of adjacent blocks. */
+int cache_serve_blocking(struct cache_object *o, int client_socket, struct rate_bucket *rate, struct trace *trace) {
+    char tail[96];
+    int64_t age = o->initial_age + (time(NULL) - o->response_time);
+    int tail_len = snprintf(tail, sizeof(tail), "Age: %lld\r\nConnection: close\r\n\r\n", (long long)(age > 0 ? age : 0));
+    if (cache_send_down(client_socket, o->head, o->head_len, rate, trace) < 0 || cache_send_down(client_socket, tail, tail_len, rate, trace) < 0) return -1;
+
+    for (uint32_t i = 0; i < o->block_count;) {
+        uint32_t run = 1;
+        while (i + run < o->block_count && o->blocks[i + run] == o->blocks[i] + run) run++;
+        off_t offset = (off_t)o->blocks[i] * CACHE_BLOCK;
+        uint64_t left = o->body_len - (uint64_t)i * CACHE_BLOCK;
+        size_t len = left < (uint64_t)run * CACHE_BLOCK ? left : (size_t)run * CACHE_BLOCK;
+        while (len > 0) {
+            ssize_t sent = sendfile(client_socket, cache.fd, &offset, len);
+            if (sent < 0 && errno == EINTR) continue;
+            if (sent <= 0) return -1;
+            metrics_add(METRIC_BYTES_DOWN, sent);
+            rate_charge(rate, sent);
+            len -= sent;
+        }
+        i += run;
+    }
+    return 0;
+}
+
+/* Thread engine: reads the response head for a cacheable miss. A storable response is relayed and written to the
+ * store as it arrives; anything else is handed on as it came, with the tunnel relaying the rest. Returns -1 if
+ * either side failed mid-body. */
+int cache_fill_blocking(struct cache_fill *fill, const struct request *req, int client_socket, int remote_socket, struct rate_bucket *rate, struct trace *trace) {
+    char buf[BUFFER_SIZE];
+    struct http_message msg;
+    struct response_head rh;
+    size_t got = 0;
+    int head_len = 0;
+    while (head_len == 0 && got < sizeof(buf)) {
+        ssize_t received = recv(remote_socket, buf + got, sizeof(buf) - got, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        got += received;
+        head_len = http_parse_response_head(buf, got, &msg);
+    }
+
+    struct cache_object *o = NULL;
+    if (head_len > 0 && parse_response_head(&msg, 0, &rh) == 0) o = cache_prepare(fill, req, &msg, &rh, buf, head_len);
+    if (!o) {
+        cache_release(fill);
+        return cache_send_down(client_socket, buf, got, rate, trace);
+    }
+
+    uint64_t stored = got - head_len < o->body_len ? got - head_len : o->body_len;
+    cache_write(o, 0, buf + head_len, stored);
+    if (cache_send_down(client_socket, buf, got, rate, trace) < 0) goto abort;
+    while (stored < o->body_len) {
+        ssize_t received = recv(remote_socket, buf, sizeof(buf), 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) goto abort;
+        uint64_t take = (uint64_t)received < o->body_len - stored ? (uint64_t)received : o->body_len - stored;
+        cache_write(o, stored, buf, take);
+        stored += take;
+        if (cache_send_down(client_socket, buf, received, rate, trace) < 0) goto abort;
+    }
+    cache_publish(fill, o);
+    return 0;
+
+abort:
+    cache_discard(fill, o);
+    return -1;
+}
+
+/* Thread engine: the 407 tells the client which scheme to retry with. */
+void auth_refuse_blocking(struct worker *w, int slot, int client_socket, struct trace *trace) {
+    metrics_error(ERROR_AUTH);
+    LOG_WARN("Proxy authentication failed");
+    send(client_socket, proxy_auth_response, strlen(proxy_auth_response), MSG_NOSIGNAL);
+    cleanup_connection(w, slot, client_socket, trace);
+}
+
+/* Thread engine: a transparent client cannot read an HTTP answer, so it only sees the close. */
+void policy_forbid_blocking(struct worker *w, int slot, int client_socket, int transparent, struct trace *trace) {
+    metrics_error(ERROR_POLICY);
+    LOG_WARN("Destination denied by policy");
+    if (!transparent) send(client_socket, forbidden_response, strlen(forbidden_response), MSG_NOSIGNAL);
+    cleanup_connection(w, slot, client_socket, trace);
+}
+
+/* Dials a tunnel's target and relays it on the calling thread; only CONNECT clients expect our 200. */
+void tunnel_blocking(struct worker *w, int slot, int client_socket, struct rate_bucket *rate, const struct request *req, int transparent, int chain, struct trace *trace) {
+    int remote_socket;
+    char reply[BUFFER_SIZE];
+    size_t extra = 0;
+    if (chain) {
+        remote_socket = upstream_dial_blocking(req->host, req->port, 1, reply, &extra);
+        if (remote_socket < 0) {
+            if (!transparent) send(client_socket, bad_gateway_response, strlen(bad_gateway_response), MSG_NOSIGNAL);
+            cleanup_connection(w, slot, client_socket, trace);
+            return;
+        }
+    } else {
+        union sockaddr_any remote_addrs[DNS_MAX_ADDRS];
+        int count = dns_resolve_all_sync(req->host, req->port, remote_addrs);
+        if (count < 0) {
+            metrics_error(ERROR_DNS);
+            LOG_ERROR("Failed to resolve host");
+            cleanup_connection(w, slot, client_socket, trace);
+            return;
+        }
+        trace_mark(trace, TRACE_RESOLVED);
+
+        uint64_t connect_start = now_us();
+        remote_socket = dial_blocking(remote_addrs, count);
+        if (remote_socket < 0) {
+            metrics_error(errno == ETIMEDOUT ? ERROR_CONNECT_TIMEOUT : ERROR_CONNECT);
+            LOG_ERROR("Failed to connect to remote host");
+            cleanup_connection(w, slot, client_socket, trace);
+            return;
+        }
+        metrics_observe_connect(now_us() - connect_start);
+    }
+    trace_mark(trace, TRACE_CONNECTED);
+
+    /* Our 200 and whatever the upstream sent behind its reply leave in one segment. */
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    struct iovec head[2] = { { (void *)established, transparent ? 0 : sizeof(established) - 1 }, { reply, extra } };
+    struct msghdr msg = { .msg_iov = head, .msg_iovlen = 2 };
+    if (head[0].iov_len + extra > 0) sendmsg(client_socket, &msg, MSG_NOSIGNAL);
+    trace_mark(trace, TRACE_ESTABLISHED);
+    metrics_add(METRIC_TUNNELS, 1);
+
+    struct tunnel t;
+    tunnel_init(&t, w, slot, client_socket, remote_socket, rate, 1, trace);
+    slot_timer_set(w, slot, SLOT_RELAY, client_socket, remote_socket);
+    tunnel_run(&t);
+    tunnel_close(&t);
+}
+
+/* Nothing is consumed, so the ClientHello is relayed, or spliced, along with the rest of the flow. */
+int peek_client_hello(int fd, struct request *req) {
+    unsigned char hello[BUFFER_SIZE];
+    size_t want = 5;
+    for (;;) {
+        ssize_t got = recv(fd, hello, want, MSG_PEEK | MSG_WAITALL);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) return -1;
+        int rc = tls_parse_sni(hello, got, req->host, sizeof(req->host));
+        if (rc == 0 && (size_t)got < want) return -1;
+        if (rc == 0 && want == 5) {
+            want = 5 + ((size_t)hello[3] << 8 | hello[4]);
+            if (want > sizeof(hello)) want = sizeof(hello);
+            continue;
+        }
+        return transparent_target(fd, rc > 0, req);
+    }
+}
+
+void *handle_client(void *arg) {
+    struct client_arg *client = arg;
+    struct worker *w = client->worker;
+    int client_socket = client->fd;
+    struct rate_bucket *rate = client->rate;
+    int transparent = client->transparent;
+    struct trace client_trace = client->trace;
+    struct trace *trace = &client_trace;
+    free(client);
+
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    getpeername(client_socket, (struct sockaddr *)&client_addr, &addr_len);
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    int client_port = ntohs(client_addr.sin_port);
+    trace->client_ip = client_ip;
+    trace->client_port = client_port;
+
+    int slot = registry_add(&w->registry, client_socket);
+    if (slot < 0) {
+        metrics_error(ERROR_CAPACITY);
+        LOG_WARN("Connection table full");
+        cleanup_connection(w, -1, client_socket, trace);
+        return NULL;
+    }
+    metrics_add(METRIC_CONNECTIONS, 1);
+    slot_timer_set(w, slot, SLOT_HEADER, client_socket, -1);
+
+    if (transparent) {
+        struct request req;
+        if (peek_client_hello(client_socket, &req) < 0) {
+            metrics_error(ERROR_BAD_REQUEST);
+            LOG_WARN("ClientHello carries no server name");
+            cleanup_connection(w, slot, client_socket, trace);
+            return NULL;
+        }
+        trace_mark(trace, TRACE_PARSED);
+        trace->host = req.host;
+        trace->port = req.port;
+        slot_timer_set(w, slot, SLOT_DIALING, client_socket, -1);
+        if (log_enabled(LOG_KIND_HTTPS)) {
+            char log_msg_buf[512];
+            snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> TLS %s:%d", client_ip, client_port, req.host, req.port);
+            LOG_HTTPS(log_msg_buf);
+        }
+        int action = policy_decide(req.host, client_addr.sin_addr.s_addr);
+        if (action == POLICY_DENY) {
+            policy_forbid_blocking(w, slot, client_socket, 1, trace);
+            return NULL;
+        }
+        tunnel_blocking(w, slot, client_socket, rate, &req, 1, policy_chains(action), trace);
+        return NULL;
+    }
+
+    char buffer[BUFFER_SIZE];
+    size_t bytes = 0;
+    struct request req;
+    int head_len = 0;
+    while (head_len == 0 && bytes < BUFFER_SIZE - 1) {
+        ssize_t received = recv(client_socket, buffer + bytes, BUFFER_SIZE - 1 - bytes, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) break;
+        bytes += received;
+        metrics_add(METRIC_BYTES_UP, received);
+        head_len = parse_request(buffer, bytes, &req);
+    }
+    if (head_len <= 0) {
+        if (head_len < 0 || bytes == BUFFER_SIZE - 1) metrics_error(ERROR_BAD_REQUEST);
+        cleanup_connection(w, slot, client_socket, trace);
+        return NULL;
+    }
+    trace_mark(trace, TRACE_PARSED);
+    if (req.host[0]) {
+        trace->host = req.host;
+        trace->port = req.port;
+    }
+    slot_timer_set(w, slot, SLOT_DIALING, client_socket, -1);
+
+    if (strcmp(req.method, "CONNECT") == 0) {
+        if (log_enabled(LOG_KIND_HTTPS)) {
+            char log_msg_buf[512];
+            snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> CONNECT %s:%d", client_ip, client_port, req.host, req.port);
+            LOG_HTTPS(log_msg_buf);
+        }
+
+        if (auth_check(&req.msg, client_addr.sin_addr.s_addr, 1) < 0) {
+            auth_refuse_blocking(w, slot, client_socket, trace);
+            return NULL;
+        }
+        int action = policy_decide(req.host, client_addr.sin_addr.s_addr);
+        if (action == POLICY_DENY) {
+            policy_forbid_blocking(w, slot, client_socket, 0, trace);
+            return NULL;
+        }
+        tunnel_blocking(w, slot, client_socket, rate, &req, 0, policy_chains(action), trace);
+    } else {
+        if (strcmp(req.method, "GET") == 0 && strcmp(req.path, "/") == 0) {
+            if (log_enabled(LOG_KIND_INFO)) {
+                char log_msg_buf[256];
+                snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> health check", client_ip, client_port);
+                LOG_INFO(log_msg_buf);
+            }
+
+            const char *response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK";
+            send(client_socket, response, strlen(response), 0);
+            cleanup_connection(w, slot, client_socket, trace);
+            return NULL;
+        }
+
+        if (auth_check(&req.msg, client_addr.sin_addr.s_addr, 1) < 0) {
+            auth_refuse_blocking(w, slot, client_socket, trace);
+            return NULL;
+        }
+        if (!req.host[0]) {
+            metrics_error(ERROR_BAD_REQUEST);
+            LOG_WARN("No Host header");
+            cleanup_connection(w, slot, client_socket, trace);
+            return NULL;
+        }
+        bytes -= auth_strip(buffer, bytes, &req.msg);
+        int action = policy_decide(req.host, client_addr.sin_addr.s_addr);
+        if (action == POLICY_DENY) {
+            policy_forbid_blocking(w, slot, client_socket, 0, trace);
+            return NULL;
+        }
+
+        struct cache_fill fill;
+        struct cache_object *hit;
+        int cached = cache_lookup(&req, &fill, &hit);
+        if (cached == CACHE_HIT || cached == CACHE_UNAVAILABLE) {
+            if (hit) {
+                cache_serve_blocking(hit, client_socket, rate, trace);
+                cache_object_release(hit);
+            } else {
+                send(client_socket, gateway_timeout_response, strlen(gateway_timeout_response), MSG_NOSIGNAL);
+            }
+            cleanup_connection(w, slot, client_socket, trace);
+            return NULL;
+        }
+
+        int remote_socket;
+        if (policy_chains(action)) {
+            char reply[BUFFER_SIZE];
+            size_t extra;
+            remote_socket = upstream_dial_blocking(req.host, req.port, 0, reply, &extra);
+            if (remote_socket < 0) {
+                cache_release(&fill);
+                send(client_socket, bad_gateway_response, strlen(bad_gateway_response), MSG_NOSIGNAL);
+                cleanup_connection(w, slot, client_socket, trace);
+                return NULL;
+            }
+        } else {
+            union sockaddr_any remote_addrs[DNS_MAX_ADDRS];
+            int count = dns_resolve_all_sync(req.host, req.port, remote_addrs);
+            if (count < 0) {
+                metrics_error(ERROR_DNS);
+                LOG_ERROR("Failed to resolve host");
+                cache_release(&fill);
+                cleanup_connection(w, slot, client_socket, trace);
+                return NULL;
+            }
+            trace_mark(trace, TRACE_RESOLVED);
+
+            uint64_t connect_start = now_us();
+            remote_socket = dial_blocking(remote_addrs, count);
+            if (remote_socket < 0) {
+                metrics_error(errno == ETIMEDOUT ? ERROR_CONNECT_TIMEOUT : ERROR_CONNECT);
+                LOG_ERROR("Failed to connect to remote host");
+                cache_release(&fill);
+                cleanup_connection(w, slot, client_socket, trace);
+                return NULL;
+            }
+            metrics_observe_connect(now_us() - connect_start);
+        }
+        trace_mark(trace, TRACE_CONNECTED);
+
+        send(remote_socket, buffer, bytes, 0);
+        trace_mark(trace, TRACE_ESTABLISHED);
+
+        struct tunnel t;
+        tunnel_init(&t, w, slot, client_socket, remote_socket, rate, 0, trace);
+        slot_timer_set(w, slot, SLOT_RELAY, client_socket, remote_socket);
+        if (fill.cacheable && cache_fill_blocking(&fill, &req, client_socket, remote_socket, rate, trace) < 0) {
+            tunnel_close(&t);
+            return NULL;
+        }
+        tunnel_run(&t);
+        tunnel_close(&t);
+    }
+
+    return NULL;
+}
+
+struct pool_host *pool_host_get(struct upstream_pool *pool, const char *host, int port) {
+    uint32_t hash = hash_string(host) ^ (uint32_t)port * 2654435761u;
+    struct pool_host **bucket = &pool->buckets[hash % POOL_BUCKETS];
+
+    for (struct pool_host *ph = *bucket; ph; ph = ph->next) {
+        if (ph->hash == hash && ph->port == port && strcmp(ph->host, host) == 0) return ph;
+    }
+
+    size_t host_len = strlen(host);
+    struct pool_host *ph = calloc(1, sizeof(*ph) + host_len + 1);
+    if (!ph) return NULL;
+    ph->hash = hash;
+    ph->port = port;
+    memcpy(ph->host, host, host_len + 1);
+    ph->next = *bucket;
+    *bucket = ph;
+    return ph;
+}
+
+/* An idle upstream is healthy only if it has neither closed nor sent anything unsolicited. */
+int pool_conn_alive(int fd) {
+    char byte;
+    ssize_t rc = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+int pool_checkout(struct upstream_pool *pool, struct pool_host *ph, uint64_t now) {
+    while (ph->idle_count > 0) {
+        struct pool_idle *idle = &ph->idle[--ph->idle_count];
+        pool->idle_total--;
+        if (now - idle->since < (uint64_t)config.pool_idle_timeout * 1000 && pool_conn_alive(idle->fd)) return idle->fd;
+        close(idle->fd);
+    }
+    return -1;
+}
+
+void pool_checkin(struct upstream_pool *pool, struct pool_host *ph, int fd, uint64_t now) {
+    if (ph->idle_count >= config.pool_idle_per_host || pool->idle_total >= config.pool_max_idle) {
+        close(fd);
+        return;
+    }
+    ph->idle[ph->idle_count].fd = fd;
+    ph->idle[ph->idle_count].since = now;
+    ph->idle_count++;
+    pool->idle_total++;
+}
+
+void pool_sweep(struct upstream_pool *pool, uint64_t now) {
+    uint64_t timeout = (uint64_t)config.pool_idle_timeout * 1000;
+    pool->last_sweep = now;
+
+    for (int b = 0; b < POOL_BUCKETS; b++) {
+        struct pool_host **link = &pool->buckets[b];
+        while (*link) {
+            struct pool_host *ph = *link;
+            int kept = 0;
+            for (int i = 0; i < ph->idle_count; i++) {
+                if (now - ph->idle[i].since < timeout && pool_conn_alive(ph->idle[i].fd)) {
+                    ph->idle[kept++] = ph->idle[i];
+                } else {
+                    close(ph->idle[i].fd);
+                    pool->idle_total--;
+                }
+            }
+            ph->idle_count = kept;
+
+            if (ph->idle_count == 0 && ph->active == 0) {
+                *link = ph->next;
+                free(ph);
+            } else {
+                link = &ph->next;
+            }
+        }
+    }
+}
+
+int epoll_watch(struct reactor *r, struct endpoint *ep) {
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = ep;
+    return epoll_ctl(r->epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+/* Earliest deadline in ms the conn's state is held to, or 0 for none; io_uring bounds its connects itself. */
+uint64_t conn_deadline(const struct conn *c, int connect) {
+    uint64_t deadline = 0;
+    if (c->state == CONN_READ_REQUEST) {
+        if (config.header_timeout > 0) deadline = c->request_ms + (uint64_t)config.header_timeout * 1000;
+    } else if (c->state == CONN_CONNECTING) {
+        if (connect) {
+            deadline = c->connect_start / 1000 + config.connect_timeout;
+            struct dial *d = c->dial;
+            if (d && d->started < d->count && d->next_attempt_us / 1000 < deadline) deadline = d->next_attempt_us / 1000;
+        }
+    } else if (c->state != CONN_RESOLVING && c->state != CONN_VERIFYING && config.idle_timeout > 0) {
+        deadline = c->active_ms + (uint64_t)config.idle_timeout * 1000;
+    }
+    if (config.max_lifetime > 0) {
+        uint64_t end = c->accepted_ms + (uint64_t)config.max_lifetime * 1000;
+        if (!deadline || end < deadline) deadline = end;
+    }
+    /* A direction paused by bandwidth shaping resumes on the same timer. */
+    if (c->up.resume_ms && (!deadline || c->up.resume_ms < deadline)) deadline = c->up.resume_ms;
+    if (c->down.resume_ms && (!deadline || c->down.resume_ms < deadline)) deadline = c->down.resume_ms;
+    return deadline;
+}
+
+int conn_resume_due(const struct relay_dir *d, uint64_t now) {
+    return d->resume_ms && d->resume_ms <= now;
+}
+
+void conn_trace_start(struct conn *c) {
+    trace_start(&c->trace, c->client.fd);
+    c->trace.client_ip = c->client_ip;
+    c->trace.client_port = c->client_port;
+    c->up.trace = c->down.trace = &c->trace;
+}
+
+void conn_trace_finish(struct conn *c) {
+    c->trace.host = c->target_host;
+    c->trace.port = c->target_port;
+    trace_finish(&c->trace, c->up.bytes, c->down.bytes);
+}
+
+/* The deadline the conn has passed, as an error cause, or -1 while none has. */
+int conn_expired(const struct conn *c, uint64_t now, int connect) {
+    if (config.max_lifetime > 0 && now >= c->accepted_ms + (uint64_t)config.max_lifetime * 1000) return ERROR_LIFETIME;
+    if (c->state == CONN_READ_REQUEST) {
+        if (config.header_timeout > 0 && now >= c->request_ms + (uint64_t)config.header_timeout * 1000) return ERROR_HEADER_TIMEOUT;
+    } else if (c->state == CONN_CONNECTING) {
+        if (connect && now >= c->connect_start / 1000 + config.connect_timeout) return ERROR_CONNECT_TIMEOUT;
+    } else if (c->state != CONN_RESOLVING && c->state != CONN_VERIFYING && config.idle_timeout > 0) {
+        if (now >= c->active_ms + (uint64_t)config.idle_timeout * 1000) return ERROR_IDLE_TIMEOUT;
+    }
+    return -1;
+}
+
+/* Re-arms only when the deadline moved earlier; a later one is picked up when the pending timer fires. */
+void conn_arm_timer(struct reactor *r, struct conn *c, uint64_t deadline) {
+    if (!deadline) return;
+    uint64_t expires = (deadline + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (c->timer.pprev && c->timer.expires <= expires) return;
+    timer_remove(&r->timers, &c->timer);
+    timer_add(&r->timers, &c->timer, expires);
+}
+
+/* Closes the losing attempts; the dial itself is freed after the event batch, which may still name its endpoints. */
+void conn_dial_end(struct reactor *r, struct conn *c) {
+    struct dial *d = c->dial;
+    if (!d) return;
+    for (int i = 0; i < d->started; i++) {
+        if (d->attempts[i].fd >= 0) close(d->attempts[i].fd);
+        d->attempts[i].fd = -1;
+    }
+    c->dial = NULL;
+    d->next = r->retired_dials;
+    r->retired_dials = d;
+}
+
+int dial_racing(const struct dial *d) {
+    for (int i = 0; i < d->started; i++) {
+        if (d->attempts[i].fd >= 0) return 1;
+    }
+    return 0;
+}
+
+void conn_close(struct reactor *r, struct conn *c) {
+    if (c->state == CONN_CLOSED) return;
+    c->state = CONN_CLOSED;
+    conn_trace_finish(c);
+
+    if (c->client.fd >= 0) close(c->client.fd);
+    if (c->remote.fd >= 0) close(c->remote.fd);
+    if (c->pool_host) c->pool_host->active--;
+    if (c->upstream) upstream_release(c->upstream);
+    free(c->target_host);
+    conn_dial_end(r, c);
+    timer_remove(&r->timers, &c->timer);
+    metrics_add(METRIC_CONNECTIONS, -1);
+    capacity_release();
+    if (c->tunnel) metrics_add(METRIC_TUNNELS, -1);
+    pipe_release(&r->worker->pipes, c->up.pipe_fds, c->up.piped == 0);
+    pipe_release(&r->worker->pipes, c->down.pipe_fds, c->down.piped == 0);
+    relay_buf_free(r, &c->up);
+    relay_buf_free(r, &c->down);
+
+    if (c->prev) c->prev->next = c->next;
+    else r->conns = c->next;
+    if (c->next) c->next->prev = c->prev;
+
+    /* The resolver or a verifier still holds a pointer; the mailbox frees it once the answer lands. */
+    if (c->resolving || c->verifying) return;
+    c->next = r->closed;
+    r->closed = c;
+}
+
+void reactor_defer(struct reactor *r, struct conn *c) {
+    if (c->queued) return;
+    c->queued = 1;
+    c->ready_next = r->ready;
+    r->ready = c;
+}
+
+/* Sends [off, len) and then slides any bytes held past len to the front of the buffer. */
+int http_flush(struct relay_dir *d, int dst) {
+    while (d->off < d->len) {
+        ssize_t sent = send(dst, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        d->off += sent;
+    }
+    if (d->fill > d->len) memmove(d->buf, d->buf + d->len, d->fill - d->len);
+    d->fill -= d->len;
+    d->off = d->len = 0;
+    return 1;
+}
+
+int http_pump_request(struct conn *c) {
+    struct relay_dir *d = &c->up;
+    struct http_exchange *x = &c->http;
+
+    for (int budget = RELAY_BUDGET; budget > 0; budget--) {
+        int flushed = http_flush(d, c->remote.fd);
+        if (flushed <= 0) return flushed;
+        if (x->req_done) return 0;
+
+        size_t quota = shape_quota(d);
+        if (!quota) return 0;
+
+        if (relay_buf_acquire(&c->worker->reactor, d) < 0) return -1;
+        size_t room = BUFFER_SIZE - d->fill;
+        ssize_t bytes = recv(c->client.fd, d->buf + d->fill, quota < room ? quota : room, 0);
+        if (bytes == 0) return -1;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+
+        relay_count(d, bytes);
+        size_t consumed = http_body_feed(&x->req_body, d->buf + d->fill, bytes);
+        if (x->req_body.error) return -1;
+        d->len = d->fill + consumed;
+        d->fill += bytes;
+        x->req_done = x->req_body.done;
+    }
+    return 1;
+}
+
+/* Parses a complete response head at the front of the buffer. Returns 1 if one was consumed. */
+int http_parse_response(struct conn *c) {
+    struct relay_dir *d = &c->down;
+    struct http_exchange *x = &c->http;
+
+    struct http_message msg;
+    int head_len = http_parse_response_head(d->buf, d->fill, &msg);
+    if (head_len == 0) return d->fill < BUFFER_SIZE - 1 ? 0 : -1;
+    if (head_len < 0 || parse_response_head(&msg, x->head_request, &x->resp) < 0) return -1;
+
+    if (x->resp.status == 101) {
+        /* Protocol upgrade: the rest of the connection is an opaque tunnel. */
+        x->active = 0;
+        d->len = d->fill;
+        c->up.len = c->up.fill;
+        c->up.copy_only = c->down.copy_only = 1;
+        return 1;
+    }
+
+    d->len = head_len;
+    if (x->resp.status < 200) return 1;
+
+    x->resp_head_done = 1;
+    size_t consumed = http_body_feed(&x->resp.body, d->buf + head_len, d->fill - head_len);
+    if (x->resp.body.error) return -1;
+    d->len += consumed;
+    x->resp_done = x->resp.body.done;
+    return 1;
+}
+
+/* Returns 2 once the whole response has been relayed to the client. */
+int http_pump_response(struct conn *c) {
+    struct relay_dir *d = &c->down;
+    struct http_exchange *x = &c->http;
+
+    for (int budget = RELAY_BUDGET; budget > 0 && x->active; budget--) {
+        int flushed = http_flush(d, c->client.fd);
+        if (flushed <= 0) return flushed;
+        if (x->resp_done) return 2;
+
+        if (!x->resp_head_done && d->fill > 0) {
+            int parsed = http_parse_response(c);
+            if (parsed < 0) return -1;
+            if (parsed > 0) continue;
+        }
+
+        size_t quota = shape_quota(d);
+        if (!quota) return 0;
+
+        size_t start = d->fill;
+        if (relay_buf_acquire(&c->worker->reactor, d) < 0) return -1;
+        size_t room = BUFFER_SIZE - 1 - start;
+        ssize_t bytes = recv(c->remote.fd, d->buf + start, quota < room ? quota : room, 0);
+        if (bytes == 0) {
+            if (!x->resp_head_done || x->resp.body.kind != BODY_UNTIL_CLOSE) return -1;
+            x->resp_done = 1;
+            continue;
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        d->fill += bytes;
+        relay_count(d, bytes);
+
+        if (x->resp_head_done) {
+            size_t consumed = http_body_feed(&x->resp.body, d->buf + start, bytes);
+            if (x->resp.body.error) return -1;
+            d->len = start + consumed;
+            x->resp_done = x->resp.body.done;
+        }
+        if (x->resp_done && d->fill > d->len) {
+            /* Bytes past the end of the response mean the upstream is out of sync. */
+            x->resp.keepalive = 0;
+            d->fill = d->len;
+        }
+    }
+    return 1;
+}
+
+/* Hands the upstream back to the pool and, if the client asked for it, waits for its next request. */
+void http_finish_exchange(struct reactor *r, struct conn *c) {
+    struct http_exchange *x = &c->http;
+
+    if (c->pool_host && x->req_done && x->resp.keepalive) {
+        epoll_ctl(r->epfd, EPOLL_CTL_DEL, c->remote.fd, NULL);
+        c->pool_host->active--;
+        pool_checkin(&r->pool, c->pool_host, c->remote.fd, now_ms());
+        c->pool_host = NULL;
+        c->remote.fd = -1;
+    }
+    if (!x->client_keepalive || !x->req_done || x->resp.body.kind == BODY_UNTIL_CLOSE || r->draining) {
+        conn_close(r, c);
+        return;
+    }
+
+    if (c->remote.fd >= 0) close(c->remote.fd);
+    if (c->pool_host) c->pool_host->active--;
+    c->pool_host = NULL;
+    c->remote.fd = -1;
+
+    /* Anything the client pipelined behind this request is already at the front of the buffer. */
+    c->up.len = c->up.fill;
+    c->up.off = c->up.fill = 0;
+    c->down.off = c->down.len = c->down.fill = 0;
+    relay_buf_release(r, &c->down);
+    c->head_scanned = 0;
+    memset(x, 0, sizeof(*x));
+    c->state = CONN_READ_REQUEST;
+    c->kept_alive = 1;
+    c->request_ms = r->now_ms;
+    reactor_defer(r, c);
+}
+
+/* Points the connection at the best upstream proxy for its next attempt. */
+int conn_pick_upstream(struct conn *c) {
+    c->upstream = upstream_pick();
+    if (!c->upstream) return -1;
+    c->remote_addr = c->upstream->addr;
+    c->attempts++;
+    metrics_add(METRIC_UPSTREAM_DIALS, 1);
+    return 0;
+}
+
+/* Chained requests pool by upstream proxy, or by proxy and origin when SOCKS ties the connection to one origin. */
+struct pool_host *conn_pool_host(struct reactor *r, struct conn *c, const char *host, int port) {
+    if (!c->upstream) return pool_host_get(&r->pool, host, port);
+    if (c->upstream->type == UPSTREAM_HTTP) return pool_host_get(&r->pool, c->upstream->host, c->upstream->port);
+
+    char key[INET6_ADDRSTRLEN + 280];
+    snprintf(key, sizeof(key), "%s:%d/%s", c->upstream->host, c->upstream->port, host);
+    return pool_host_get(&r->pool, key, port);
+}
+
+/* Nothing has reached the client yet, so a chaining failure can still be answered. */
+int conn_upstream_unavailable(struct conn *c) {
+    metrics_error(ERROR_UPSTREAM);
+    LOG_ERROR("No upstream proxy available");
+    if (conn_queue_response(c, bad_gateway_response) < 0) return REQUEST_REJECT;
+    return REQUEST_RESPOND;
+}
+
+/* Routes the request through an upstream proxy, which resolves the target itself. */
+int conn_chain(struct conn *c, const struct request *req) {
+    free(c->target_host);
+    c->target_host = strdup(req->host);
+    c->target_port = req->port;
+    c->attempts = 0;
+    if (!c->target_host) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
+        return REQUEST_REJECT;
+    }
+    if (conn_pick_upstream(c) < 0) return conn_upstream_unavailable(c);
+    return REQUEST_DIAL;
+}
+
+/* Queues the upstream handshake in the down buffer, which stays idle until the upstream has answered. */
+int conn_begin_handshake(struct conn *c) {
+    struct relay_dir *d = &c->down;
+    if (relay_buf_acquire(&c->worker->reactor, d) < 0) return -1;
+    d->len = upstream_handshake(c->upstream, c->target_host, c->target_port, d->buf, UPSTREAM_REPLY_MAX);
+    d->off = d->fill = 0;
+    if (d->len == 0) return -1;
+    c->state = CONN_HANDSHAKE;
+    return 0;
+}
+
+/* Once the TCP connect lands: returns 1 to start relaying, 0 if an upstream handshake comes first, -1 on error. */
+int conn_connected(struct conn *c) {
+    trace_mark(&c->trace, TRACE_CONNECTED);
+    if (!c->upstream) {
+        trace_mark(&c->trace, TRACE_ESTABLISHED);
+        c->state = CONN_RELAY;
+        return 1;
+    }
+    if (c->tunnel || c->upstream->type != UPSTREAM_HTTP) return conn_begin_handshake(c);
+
+    upstream_observe(c->upstream, now_us() - c->connect_start, 1);
+    c->upstream = NULL;
+    trace_mark(&c->trace, TRACE_ESTABLISHED);
+    c->state = CONN_RELAY;
+    return 1;
+}
+
+/* Checks the reply gathered in the down buffer; on success a tunnel's client gets our 200 plus anything sent behind the reply. */
+int conn_check_handshake(struct conn *c) {
+    static const char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    struct relay_dir *d = &c->down;
+
+    int reply_len = upstream_reply(c->upstream, d->buf, d->fill);
+    if (reply_len == 0) return d->fill < UPSTREAM_REPLY_MAX ? 0 : -1;
+    if (reply_len < 0) {
+        metrics_error(ERROR_UPSTREAM);
+        LOG_WARN("Upstream proxy refused the connection");
+        return -1;
+    }
+    upstream_observe(c->upstream, now_us() - c->connect_start, 1);
+    c->upstream = NULL;
+
+    size_t extra = d->fill - reply_len;
+    d->off = d->len = d->fill = 0;
+    if (c->tunnel) {
+        size_t head = c->transparent ? 0 : sizeof(established) - 1;
+        memmove(d->buf + head, d->buf + reply_len, extra);
+        memcpy(d->buf, established, head);
+        d->len = head + extra;
+    }
+    trace_mark(&c->trace, TRACE_ESTABLISHED);
+    c->state = CONN_RELAY;
+    return 1;
+}
+
+/* Charges the failed attempt to its upstream and points the connection at another; -1 once the attempts are spent. */
+int conn_retry_upstream(struct conn *c) {
+    upstream_observe(c->upstream, now_us() - c->connect_start, 0);
+    c->upstream = NULL;
+    if (c->attempts >= UPSTREAM_ATTEMPTS || conn_pick_upstream(c) < 0) return -1;
+
+    if (c->pool_host) {
+        c->pool_host->active--;
+        c->pool_host = conn_pool_host(&c->worker->reactor, c, c->target_host, c->target_port);
+        if (!c->pool_host) return -1;
+        c->pool_host->active++;
+    }
+    return 0;
+}
+
+int conn_dial_target(struct conn *c, const struct request *req) {
+    /* Only a trace needs to remember a direct target. */
+    if (c->trace.at_us[TRACE_ACCEPTED] && !c->target_host) {
+        c->target_host = strdup(req->host);
+        c->target_port = req->port;
+    }
+    switch (dns_lookup_async(c, req->host, req->port)) {
+    case DNS_READY:
+        trace_mark(&c->trace, TRACE_RESOLVED);
+        return REQUEST_DIAL;
+    case DNS_PENDING:
+        c->state = CONN_RESOLVING;
+        c->resolving = 1;
+        return REQUEST_RESOLVING;
+    default:
+        metrics_error(ERROR_DNS);
+        LOG_ERROR("Failed to resolve host");
+        return REQUEST_REJECT;
+    }
+}
+
+/* The event engines' auth_check: a value that needs its password derived goes to the verifier pool and the conn waits
+ * in CONN_VERIFYING. The mailbox hands it back with the verdict and the request is handled again from the top. Returns
+ * 0 to admit, -1 to refuse, 1 while the conn waits, or 2 when the pool is too backed up to take it. */
+int conn_auth(struct conn *c, const struct http_message *m) {
+    if (c->auth_verdict) {
+        int verdict = c->auth_verdict;
+        c->auth_verdict = 0;
+        return verdict > 0 ? 0 : -1;
+    }
+    int rc = auth_check(m, c->client_addr, 0);
+    if (rc <= 0) return rc;
+
+    size_t len;
+    const char *value = http_find_header(m, "Proxy-Authorization", &len);
+    if (verifier_submit(c, value, len) < 0) return 2;
+    c->state = CONN_VERIFYING;
+    c->verifying = 1;
+    return 1;
+}
+
+int conn_auth_required(struct conn *c) {
+    metrics_error(ERROR_AUTH);
+    LOG_WARN("Proxy authentication failed");
+    if (conn_queue_response(c, proxy_auth_response) < 0) return REQUEST_REJECT;
+    return REQUEST_RESPOND;
+}
+
+/* The credentials were never checked, so a full verifier queue is overload rather than a failed login. */
+int conn_auth_busy(struct conn *c) {
+    metrics_error(ERROR_CAPACITY);
+    LOG_WARN("Password verifier queue full");
+    if (conn_queue_response(c, service_unavailable_response) < 0) return REQUEST_REJECT;
+    return REQUEST_RESPOND;
+}
+
+/* Answers a denied request with a 403; a transparent client cannot read one and is closed instead. */
+int conn_forbid(struct conn *c) {
+    metrics_error(ERROR_POLICY);
+    LOG_WARN("Destination denied by policy");
+    if (c->transparent || conn_queue_response(c, forbidden_response) < 0) return REQUEST_REJECT;
+    return REQUEST_RESPOND;
+}
+
+/* Frames a plain-HTTP request so its upstream can go back to the pool, and tries a pooled upstream first. */
+int conn_prepare_http(struct conn *c, const struct request *req, size_t head_len, int chain) {
+    struct http_exchange *x = &c->http;
+    struct reactor *r = &c->worker->reactor;
+
+    memset(x, 0, sizeof(*x));
+    x->active = 1;
+    x->head_request = strcmp(req->method, "HEAD") == 0;
+    x->client_keepalive = req->keepalive;
+    if (http_body_framing(&req->msg, &x->req_body) < 0) {
+        metrics_error(ERROR_BAD_REQUEST);
+        return REQUEST_REJECT;
+    }
+    metrics_add(METRIC_REQUESTS, 1);
+
+    size_t consumed = http_body_feed(&x->req_body, c->up.buf + head_len, c->up.len - head_len);
+    if (x->req_body.error) return REQUEST_REJECT;
+    c->up.fill = c->up.len;
+    c->up.len = head_len + consumed;
+    x->req_done = x->req_body.done;
+
+    if (chain) {
+        int action = conn_chain(c, req);
+        if (action != REQUEST_DIAL) return action;
+    }
+    c->pool_host = conn_pool_host(r, c, req->host, req->port);
+    if (!c->pool_host) return REQUEST_REJECT;
+    c->pool_host->active++;
+
+    c->remote.fd = pool_checkout(&r->pool, c->pool_host, now_ms());
+    if (c->remote.fd >= 0) {
+        if (c->upstream) upstream_release(c->upstream);
+        c->upstream = NULL;
+        metrics_add(METRIC_POOL_REUSED, 1);
+        return REQUEST_REUSE;
+    }
+
+    if (config.pool_max_per_host > 0 && c->pool_host->active + c->pool_host->idle_count > config.pool_max_per_host) {
+        metrics_error(ERROR_UPSTREAM_LIMIT);
+        LOG_WARN("Upstream connection limit reached");
+        if (conn_queue_response(c, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n") < 0) return REQUEST_REJECT;
+        return REQUEST_RESPOND;
+    }
+    return c->upstream ? REQUEST_DIAL : conn_dial_target(c, req);
+}
+
+/* The ClientHello stays in the up buffer, so it reaches the origin ahead of the rest of the flow once the tunnel is up. */
+int conn_handle_client_hello(struct conn *c) {
+    struct request req;
+    int rc = tls_parse_sni((const unsigned char *)c->up.buf, c->up.len, req.host, sizeof(req.host));
+    if (rc == 0 && c->up.len < BUFFER_SIZE - 1) return REQUEST_INCOMPLETE;
+    if (transparent_target(c->client.fd, rc > 0, &req) < 0) {
+        metrics_error(ERROR_BAD_REQUEST);
+        LOG_WARN("ClientHello carries no server name");
+        return REQUEST_REJECT;
+    }
+    trace_mark(&c->trace, TRACE_PARSED);
+
+    if (log_enabled(LOG_KIND_HTTPS)) {
+        char log_msg_buf[512];
+        snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> TLS %s:%d", c->client_ip, c->client_port, req.host, req.port);
+        LOG_HTTPS(log_msg_buf);
+    }
+    int action = policy_decide(req.host, c->client_addr);
+    if (action == POLICY_DENY) return conn_forbid(c);
+    c->tunnel = 1;
+    metrics_add(METRIC_TUNNELS, 1);
+    if (policy_chains(action)) return conn_chain(c, &req);
+    return conn_dial_target(c, &req);
+}
+
+/* Engine-neutral: inspects the buffered request header and decides what the engine does next. */
+int conn_handle_request(struct conn *c) {
+    struct request req;
+    int head_len = 0;
+
+    if (c->transparent) return conn_handle_client_hello(c);
+
+    /* A head can only have completed if the new bytes carry a line end. */
+    if (memchr(c->up.buf + c->head_scanned, '\n', c->up.len - c->head_scanned)) head_len = parse_request(c->up.buf, c->up.len, &req);
+    if (head_len == 0) {
+        c->head_scanned = c->up.len;
+        if (c->up.len < BUFFER_SIZE - 1) return REQUEST_INCOMPLETE;
+    }
+    if (head_len <= 0) {
+        metrics_error(ERROR_BAD_REQUEST);
+        return REQUEST_REJECT;
+    }
+    trace_mark(&c->trace, TRACE_PARSED);
+
+    if (strcmp(req.method, "CONNECT") == 0) {
+        /* A verdict means this head was logged before it went to the verifier. */
+        if (log_enabled(LOG_KIND_HTTPS) && !c->auth_verdict) {
+            char log_msg_buf[512];
+            snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> CONNECT %s:%d", c->client_ip, c->client_port, req.host, req.port);
+            LOG_HTTPS(log_msg_buf);
+        }
+        int auth = conn_auth(c, &req.msg);
+        if (auth > 1) return conn_auth_busy(c);
+        if (auth > 0) return REQUEST_RESOLVING;
+        if (auth < 0) return conn_auth_required(c);
+        int action = policy_decide(req.host, c->client_addr);
+        if (action == POLICY_DENY) return conn_forbid(c);
+
+        memmove(c->up.buf, c->up.buf + head_len, c->up.len - head_len);
+        c->up.len -= head_len;
+        c->tunnel = 1;
+        metrics_add(METRIC_TUNNELS, 1);
+        /* A chained tunnel's 200 waits for the upstream proxy to accept. */
+        if (policy_chains(action)) return conn_chain(c, &req);
+        if (conn_queue_response(c, "HTTP/1.1 200 Connection Established\r\n\r\n") < 0) return REQUEST_REJECT;
+        return conn_dial_target(c, &req);
+    }
+
+    if (strcmp(req.method, "GET") == 0 && strcmp(req.path, "/") == 0) {
+        if (log_enabled(LOG_KIND_INFO)) {
+            char log_msg_buf[256];
+            snprintf(log_msg_buf, sizeof(log_msg_buf), "%s:%d -> health check", c->client_ip, c->client_port);
+            LOG_INFO(log_msg_buf);
+        }
+
+        if (conn_queue_response(c, "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: 2\r\n\r\nOK") < 0) return REQUEST_REJECT;
+        return REQUEST_RESPOND;
+    }
+
+    int auth = conn_auth(c, &req.msg);
+    if (auth > 1) return conn_auth_busy(c);
+    if (auth > 0) return REQUEST_RESOLVING;
+    if (auth < 0) return conn_auth_required(c);
+    if (!req.host[0]) {
+        metrics_error(ERROR_BAD_REQUEST);
+        LOG_WARN("No Host header");
+        return REQUEST_REJECT;
+    }
+    size_t cut = auth_strip(c->up.buf, c->up.len, &req.msg);
+    c->up.len -= cut;
+    head_len -= cut;
+    int action = policy_decide(req.host, c->client_addr);
+    if (action == POLICY_DENY) return conn_forbid(c);
+    if (c->worker->reactor.pooling) return conn_prepare_http(c, &req, head_len, policy_chains(action));
+    if (policy_chains(action)) return conn_chain(c, &req);
+    return conn_dial_target(c, &req);
+}
+
+/* Starts the next address; one that fails on the spot moves straight on to the one after it. */
+int conn_dial_next(struct reactor *r, struct conn *c) {
+    struct dial *d = c->dial;
+    while (d->started < d->count) {
+        const union sockaddr_any *addr = &d->addrs[d->started];
+        struct endpoint *ep = &d->attempts[d->started++];
+        ep->conn = c;
+        ep->fd = remote_socket_open(addr->sa.sa_family, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (ep->fd >= 0 && (connect(ep->fd, &addr->sa, sockaddr_len(addr)) == 0 || errno == EINPROGRESS) && epoll_watch(r, ep) == 0) {
+            d->next_attempt_us = now_us() + (uint64_t)config.connect_attempt_delay * 1000;
+            return 0;
+        }
+        if (ep->fd >= 0) close(ep->fd);
+        ep->fd = -1;
+    }
+    return dial_racing(d) ? 0 : -1;
+}
+
+/* Returns 1 once an attempt has won (its socket becomes c->remote), 0 while the race goes on, -1 when all failed. */
+int conn_dial_poll(struct reactor *r, struct conn *c) {
+    struct dial *d = c->dial;
+    int failed = 0;
+    for (int i = 0; i < d->started; i++) {
+        struct endpoint *ep = &d->attempts[i];
+        if (ep->fd < 0) continue;
+        int rc = connect_status(ep->fd);
+        if (rc < 0) {
+            close(ep->fd);
+            ep->fd = -1;
+            failed = 1;
+        } else if (rc > 0) {
+            struct epoll_event ev = {0};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = &c->remote;
+            if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, ep->fd, &ev) < 0) return -1;
+            c->remote.fd = ep->fd;
+            c->remote_addr = d->addrs[i];
+            ep->fd = -1;
+            conn_dial_end(r, c);
+            return 1;
+        }
+    }
+    /* A failed attempt hands over to the next address without waiting out the delay. */
+    if (failed || !dial_racing(d)) return conn_dial_next(r, c);
+    return 0;
+}
+
+int conn_start_remote(struct reactor *r, struct conn *c) {
+    c->connect_start = now_us();
+    if (c->dial) {
+        c->state = CONN_CONNECTING;
+        if (conn_dial_next(r, c) == 0) {
+            conn_arm_timer(r, c, conn_deadline(c, 1));
+            return 0;
+        }
+        metrics_error(ERROR_CONNECT);
+        LOG_ERROR("Failed to connect to remote host");
+        return -1;
+    }
+
+    c->remote.fd = remote_socket_open(c->remote_addr.sa.sa_family, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (c->remote.fd < 0) {
+        metrics_error(ERROR_CONNECT);
+        LOG_ERROR("Failed to connect to remote host");
+        return -1;
+    }
+
+    if (connect(c->remote.fd, &c->remote_addr.sa, sockaddr_len(&c->remote_addr)) < 0 && errno != EINPROGRESS) {
+        metrics_error(ERROR_CONNECT);
+        LOG_ERROR("Failed to connect to remote host");
+        return -1;
+    }
+
+    if (epoll_watch(r, &c->remote) < 0) return -1;
+    c->state = CONN_CONNECTING;
+    conn_arm_timer(r, c, conn_deadline(c, 1));
+    return 0;
+}
+
+/* Epoll engine: sends the queued handshake, then reads the upstream's reply into the same buffer. */
+int conn_handshake(struct conn *c) {
+    struct relay_dir *d = &c->down;
+    while (d->off < d->len) {
+        ssize_t sent = send(c->remote.fd, d->buf + d->off, d->len - d->off, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        d->off += sent;
+    }
+    d->off = d->len = 0;
+
+    for (;;) {
+        ssize_t bytes = recv(c->remote.fd, d->buf + d->fill, UPSTREAM_REPLY_MAX - d->fill, 0);
+        if (bytes == 0) return -1;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        d->fill += bytes;
+        int rc = conn_check_handshake(c);
+        if (rc != 0) return rc;
+    }
+}
+
+/* Epoll engine: drops the failed upstream socket and dials the next pick, or answers 502 once out of attempts. */
+void conn_redial(struct reactor *r, struct conn *c) {
+    close(c->remote.fd);
+    c->remote.fd = -1;
+    if (conn_retry_upstream(c) == 0) {
+        if (conn_start_remote(r, c) < 0) conn_redial(r, c);
+        return;
+    }
+    if (conn_upstream_unavailable(c) != REQUEST_RESPOND) {
+        conn_close(r, c);
+        return;
+    }
+    c->state = CONN_FLUSH_CLOSE;
+    reactor_defer(r, c);
+}
+
+int conn_read_request(struct reactor *r, struct conn *c) {
+    if (relay_buf_acquire(r, &c->up) < 0) return -1;
+    while (c->up.len < BUFFER_SIZE - 1) {
+        ssize_t bytes = recv(c->client.fd, c->up.buf + c->up.len, BUFFER_SIZE - 1 - c->up.len, 0);
+        if (bytes == 0) return -1;
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        c->up.len += bytes;
+        metrics_add(METRIC_BYTES_UP, bytes);
+    }
+
+    switch (conn_handle_request(c)) {
+    case REQUEST_INCOMPLETE:
+        /* A keep-alive client waiting between requests holds no buffer. */
+        relay_buf_release(r, &c->up);
+        return 0;
+    case REQUEST_RESOLVING:
+        return 0;
+    case REQUEST_REUSE:
+        trace_mark(&c->trace, TRACE_ESTABLISHED);
+        if (epoll_watch(r, &c->remote) < 0) return -1;
+        c->state = CONN_RELAY;
+        return 0;
+    case REQUEST_RESPOND:
+        c->state = CONN_FLUSH_CLOSE;
+        return 0;
+    case REQUEST_DIAL:
+        if (conn_start_remote(r, c) == 0) return 0;
+        if (!c->upstream) return -1;
+        conn_redial(r, c);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+int conn_finish_connect(struct conn *c) {
+    struct reactor *r = &c->worker->reactor;
+    int rc = c->dial ? conn_dial_poll(r, c) : connect_status(c->remote.fd);
+    if (rc == 0) return 0;
+    if (rc < 0) {
+        metrics_error(ERROR_CONNECT);
+        LOG_ERROR("Failed to connect to remote host");
+        return -1;
+    }
+
+    metrics_observe_connect(now_us() - c->connect_start);
+    return conn_connected(c);
+}
+
+/* Epoll engine: acts on whichever deadline came due, then re-arms for the next one. */
+void conn_timer_fire(struct reactor *r, struct conn *c) {
+    int cause = conn_expired(c, r->now_ms, 1);
+    if (cause == ERROR_CONNECT_TIMEOUT) {
+        conn_dial_end(r, c);
+        metrics_error(ERROR_CONNECT_TIMEOUT);
+        LOG_ERROR("Connect to remote host timed out");
+        if (c->upstream) conn_redial(r, c);
+        else conn_close(r, c);
+        return;
+    }
+    if (cause >= 0) {
+        metrics_error(cause);
+        LOG_WARN(close_reasons[cause]);
+        conn_close(r, c);
+        return;
+    }
+
+    struct dial *d = c->dial;
+    if (c->state == CONN_CONNECTING && d && d->started < d->count && r->now_ms >= d->next_attempt_us / 1000 && conn_dial_next(r, c) < 0) {
+        metrics_error(ERROR_CONNECT);
+        LOG_ERROR("Failed to connect to remote host");
+        conn_close(r, c);
+        return;
+    }
+    if (conn_resume_due(&c->up, r->now_ms) || conn_resume_due(&c->down, r->now_ms)) reactor_defer(r, c);
+    conn_arm_timer(r, c, conn_deadline(c, 1));
+}
+
+void conn_process(struct reactor *r, struct conn *c) {
+    int rc = 0;
+    c->active_ms = r->now_ms;
+
+    if (c->state == CONN_READ_REQUEST) {
+        rc = conn_read_request(r, c);
+        if (rc < 0) goto fail;
+    }
+    if (c->state == CONN_RESOLVING || c->state == CONN_VERIFYING) return;
+
+    if (c->state == CONN_CONNECTING) {
+        rc = conn_finish_connect(c);
+        if (rc < 0 && c->upstream) {
+            conn_redial(r, c);
+            return;
+        }
+        if (rc < 0) goto fail;
+        if (c->state == CONN_CONNECTING) return;
+    }
+
+    if (c->state == CONN_HANDSHAKE) {
+        rc = conn_handshake(c);
+        if (rc < 0) {
+            conn_redial(r, c);
+            return;
+        }
+        if (rc == 0) return;
+    }
+
+    if (c->state == CONN_FLUSH_CLOSE) {
+        rc = relay_flush(&c->down, c->client.fd);
+        if (rc != 0) goto fail;
+        return;
+    }
+
+    if (c->state == CONN_RELAY && c->http.active) {
+        int up = http_pump_request(c);
+        int down = up < 0 ? up : http_pump_response(c);
+        if (up < 0 || down < 0) goto fail;
+        if (down == 2) {
+            http_finish_exchange(r, c);
+            return;
+        }
+        if (c->http.active) {
+            relay_buf_release(r, &c->up);
+            relay_buf_release(r, &c->down);
+            if (up > 0 || down > 0) reactor_defer(r, c);
+            return;
+        }
+    }
+
+    if (c->state == CONN_RELAY) {
+        int up = relay_pump(r, &c->up, c->client.fd, c->remote.fd);
+        int down = relay_pump(r, &c->down, c->remote.fd, c->client.fd);
+        if (up < 0 || down < 0) goto fail;
+        relay_buf_release(r, &c->up);
+        relay_buf_release(r, &c->down);
+        if (c->up.shut && c->down.shut) goto fail;
+        if (up > 0 || down > 0) reactor_defer(r, c);
+    }
+    return;
+
+fail:
+    conn_close(r, c);
+}
+
+void reactor_drain_mailbox(struct reactor *r) {
+    struct conn *c = mailbox_take(&r->worker->mailbox);
+    for (struct conn *next; c; c = next) {
+        next = c->dns_next;
+        c->resolving = c->verifying = 0;
+        if (c->state == CONN_CLOSED) {
+            free(c->dial);
+            c->next = r->closed;
+            r->closed = c;
+        } else if (c->state == CONN_VERIFYING) {
+            c->state = CONN_READ_REQUEST;
+            reactor_defer(r, c);
+        } else if (c->dns_status != DNS_READY) {
+            metrics_error(ERROR_DNS);
+            LOG_ERROR("Failed to resolve host");
+            conn_close(r, c);
+        } else {
+            trace_mark(&c->trace, TRACE_RESOLVED);
+            if (conn_start_remote(r, c) < 0) conn_close(r, c);
+        }
+    }
+}
+
+void reactor_pause_accept(struct reactor *r) {
+    metrics_add(METRIC_ACCEPT_PAUSES, 1);
+    r->accept_resume_ms = r->now_ms + ACCEPT_PAUSE_MS;
+}
+
+/* Listeners are edge-triggered, so a paused reactor ignores their wakeups and drains the backlogs again on resume. */
+void reactor_accept(struct reactor *r, struct endpoint *listener) {
+    if (r->accept_resume_ms || listener->fd < 0) return;
+    for (;;) {
+        if (config.overload == OVERLOAD_PAUSE && capacity_full()) {
+            reactor_pause_accept(r);
+            return;
+        }
+
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_socket = accept4(listener->fd, (struct sockaddr *)&client_addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !shutdown_flag) {
+                metrics_error(ERROR_ACCEPT);
+                perror("accept");
+                if (accept_should_pause(errno)) reactor_pause_accept(r);
+            }
+            return;
+        }
+        steer_check(r->worker, client_socket);
+
+        struct rate_bucket *rate;
+        int refused = rate_admit(client_addr.sin_addr.s_addr, &rate);
+        if (refused >= 0) {
+            metrics_add(METRIC_ACCEPTED, 1);
+            metrics_error(refused);
+            LOG_WARN(close_reasons[refused]);
+            close(client_socket);
+            continue;
+        }
+        if (capacity_acquire() < 0) {
+            metrics_add(METRIC_ACCEPTED, 1);
+            capacity_refuse(client_socket);
+            continue;
+        }
+
+        struct conn *c = slab_alloc(&r->conn_slab);
+        if (!c) {
+            metrics_error(ERROR_RESOURCE);
+            LOG_ERROR("Memory allocation failed");
+            capacity_release();
+            close(client_socket);
+            continue;
+        }
+        memset(c, 0, sizeof(*c));
+        metrics_add(METRIC_ACCEPTED, 1);
+        metrics_add(METRIC_CONNECTIONS, 1);
+
+        c->worker = r->worker;
+        c->client.conn = c;
+        c->client.fd = client_socket;
+        c->remote.conn = c;
+        c->remote.fd = -1;
+        c->up.pipe_fds[0] = c->up.pipe_fds[1] = -1;
+        c->down.pipe_fds[0] = c->down.pipe_fds[1] = -1;
+        c->up.bytes_metric = METRIC_BYTES_UP;
+        c->down.bytes_metric = METRIC_BYTES_DOWN;
+        c->up.rate = c->down.rate = rate;
+        if (config.tunnel_bandwidth > 0) c->up.tunnel_tat = c->down.tunnel_tat = &c->tunnel_tat;
+        c->transparent = listener == &r->transparent;
+        c->state = CONN_READ_REQUEST;
+        inet_ntop(AF_INET, &client_addr.sin_addr, c->client_ip, INET_ADDRSTRLEN);
+        c->client_port = ntohs(client_addr.sin_port);
+        c->client_addr = client_addr.sin_addr.s_addr;
+        conn_trace_start(c);
+        c->timer.owner = c;
+        c->accepted_ms = c->request_ms = c->active_ms = r->now_ms;
+        conn_arm_timer(r, c, conn_deadline(c, 1));
+
+        c->next = r->conns;
+        if (r->conns) r->conns->prev = c;
+        r->conns = c;
+
+        if (epoll_watch(r, &c->client) < 0) {
+            LOG_ERROR("epoll_ctl failed");
+            conn_close(r, c);
+        }
+    }
+}
+
+/* Stops taking clients and drops keep-alive clients idling between requests; everything in flight runs on.
+ * The listeners leave the epoll set first: after a handoff their sockets outlive the close. */
+void reactor_start_drain(struct reactor *r) {
+    r->draining = 1;
+    for (int i = 0; i < 2; i++) {
+        struct endpoint *listener = i ? &r->transparent : &r->listener;
+        if (listener->fd >= 0) epoll_ctl(r->epfd, EPOLL_CTL_DEL, listener->fd, NULL);
+        listener->fd = -1;
+    }
+    listener_close(&r->worker->listen_fd);
+    listener_close(&r->worker->transparent_fd);
+
+    for (struct conn *c = r->conns, *next; c; c = next) {
+        next = c->next;
+        if (c->state == CONN_READ_REQUEST && c->kept_alive && c->up.len == 0) conn_close(r, c);
+    }
+}
+
+void run_epoll_engine(struct worker *w) {
+    struct reactor *r = &w->reactor;
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+
+    r->worker = w;
+    r->pooling = 1;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd < 0) {
+        perror("epoll_create1");
+        exit(EXIT_FAILURE);
+    }
+
+    set_nonblocking(w->listen_fd);
+    r->listener.fd = w->listen_fd;
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &r->listener;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, w->listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    r->transparent.fd = w->transparent_fd;
+    if (r->transparent.fd >= 0) {
+        set_nonblocking(r->transparent.fd);
+        ev.data.ptr = &r->transparent;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->transparent.fd, &ev) < 0) {
+            perror("epoll_ctl");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    r->mailbox.fd = w->mailbox.efd;
+    ev.data.ptr = &r->mailbox;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, w->mailbox.efd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+
+    timer_wheel_init(&r->timers, now_ms());
+    while (!shutdown_flag) {
+        int wait_ms = r->ready ? 0 : timer_next_ms(&r->timers, now_ms(), r->accept_resume_ms ? ACCEPT_PAUSE_MS : 1000);
+        int n = epoll_wait(r->epfd, events, EPOLL_MAX_EVENTS, wait_ms);
+        r->now_ms = now_ms();
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        if (r->accept_resume_ms && r->now_ms >= r->accept_resume_ms) {
+            r->accept_resume_ms = 0;
+            reactor_accept(r, &r->listener);
+            if (r->transparent.fd >= 0) reactor_accept(r, &r->transparent);
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct endpoint *ep = events[i].data.ptr;
+            if (ep == &r->listener || ep == &r->transparent) {
+                reactor_accept(r, ep);
+            } else if (ep == &r->mailbox) {
+                reactor_drain_mailbox(r);
+                if (drain_pending(r)) reactor_start_drain(r);
+            } else if (ep->conn->state != CONN_CLOSED) {
+                conn_process(r, ep->conn);
+                if (ep->conn->state != CONN_CLOSED) conn_arm_timer(r, ep->conn, conn_deadline(ep->conn, 1));
+            }
+        }
+
+        struct conn *ready = r->ready;
+        r->ready = NULL;
+        for (struct conn *c = ready, *next; c; c = next) {
+            next = c->ready_next;
+            c->queued = 0;
+            if (c->state != CONN_CLOSED) conn_process(r, c);
+            if (c->state != CONN_CLOSED) conn_arm_timer(r, c, conn_deadline(c, 1));
+        }
+
+        for (struct timer *t = timer_expire(&r->timers, r->now_ms), *next; t; t = next) {
+            next = t->next;
+            struct conn *c = t->owner;
+            if (c->state != CONN_CLOSED) conn_timer_fire(r, c);
+        }
+        while (r->closed) {
+            struct conn *c = r->closed;
+            r->closed = c->next;
+            slab_free(&r->conn_slab, c);
+        }
+        while (r->retired_dials) {
+            struct dial *d = r->retired_dials;
+            r->retired_dials = d->next;
+            free(d);
+        }
+
+        uint64_t now = now_ms();
+        if (now - r->pool.last_sweep >= 1000) pool_sweep(&r->pool, now);
+    }
+
+    while (r->conns) conn_close(r, r->conns);
+    while (r->closed) {
+        struct conn *c = r->closed;
+        r->closed = c->next;
+        slab_free(&r->conn_slab, c);
+    }
+    while (r->retired_dials) {
+        struct dial *d = r->retired_dials;
+        r->retired_dials = d->next;
+        free(d);
+    }
+    close(r->epfd);
+}
+
+#ifdef HAVE_IO_URING
+enum uring_op {
+    UOP_ACCEPT = 1,
+    UOP_FILES_UPDATE,
+    UOP_RECV_REQUEST,
+    UOP_SEND_RESPONSE,
+    UOP_CONNECT,
+    UOP_READ_UP,
+    UOP_WRITE_UP,
+    UOP_READ_DOWN,
+    UOP_WRITE_DOWN,
+    UOP_SHUTDOWN,
+    UOP_CANCEL,
+    UOP_MAILBOX,
+    UOP_HANDSHAKE_SEND,
+    UOP_HANDSHAKE_RECV
+};
+
+#define UOP_MASK 15UL
+
+static const int uring_empty_slot = -1;
+
+int uring_setup(struct uring *u) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    p.flags |= IORING_SETUP_CQSIZE;
+
+    u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        p.flags = IORING_SETUP_CQSIZE;
+        u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    }
+    if (u->fd < 0) return -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(u->fd);
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        close(u->fd);
+        return -1;
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+        close(u->fd);
+        return -1;
+    }
+
+    char *ring = u->ring;
+    u->sq_head = (unsigned *)(ring + p.sq_off.head);
+    u->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->sq_array = (unsigned *)(ring + p.sq_off.array);
+    u->cq_head = (unsigned *)(ring + p.cq_off.head);
+    u->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    u->sqe_tail = *u->sq_tail;
+    u->to_submit = 0;
+
+    /* A sparse fixed-file table indexed by fd number, so a socket's slot is just its fd. */
+    struct rlimit nofile;
+    u->file_slots = 4096;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 && nofile.rlim_cur != RLIM_INFINITY) u->file_slots = nofile.rlim_cur;
+    if (u->file_slots > URING_MAX_FILE_SLOTS) u->file_slots = URING_MAX_FILE_SLOTS;
+    int *slots = malloc(u->file_slots * sizeof(int));
+    if (slots) {
+        for (unsigned i = 0; i < u->file_slots; i++) slots[i] = -1;
+        u->fixed_files = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES, slots, u->file_slots) == 0;
+        free(slots);
+    }
+
+    size_t region = (size_t)URING_BUFFERS * BUFFER_SIZE;
+    u->buffers = mmap(NULL, region, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buffers != MAP_FAILED) {
+        struct iovec *iov = malloc(URING_BUFFERS * sizeof(*iov));
+        if (iov) {
+            for (int i = 0; i < URING_BUFFERS; i++) {
+                iov[i].iov_base = u->buffers + (size_t)i * BUFFER_SIZE;
+                iov[i].iov_len = BUFFER_SIZE;
+                u->free_buffers[i] = URING_BUFFERS - 1 - i;
+            }
+            if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0) {
+                u->free_buffer_count = URING_BUFFERS;
+            }
+            free(iov);
+        }
+        if (u->free_buffer_count == 0) {
+            munmap(u->buffers, region);
+            u->buffers = NULL;
+        }
+    } else {
+        u->buffers = NULL;
+    }
+    return 0;
+}
+
+/* Closing the ring drops its registered files and buffers and cancels whatever was still in flight. */
+void uring_teardown(struct uring *u) {
+    close(u->fd);
+    if (u->buffers) munmap(u->buffers, (size_t)URING_BUFFERS * BUFFER_SIZE);
+    munmap(u->sqes, u->sqes_size);
+    munmap(u->ring, u->ring_size);
+    free(u);
+}
+
+int uring_submit(struct uring *u, unsigned wait) {
+    for (;;) {
+        int rc = syscall(__NR_io_uring_enter, u->fd, u->to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (rc >= 0) {
+            u->to_submit -= rc;
+            return 0;
+        }
+        if (errno == EINTR) {
+            if (shutdown_flag) return -1;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) {
+            if (!wait) return 0;
+            wait = 0;
+            continue;
+        }
+        return -1;
+    }
+}
+
+/* Submits and blocks for a completion, but no longer than timeout_ms, so the timer wheel keeps turning. */
+int uring_wait(struct uring *u, int timeout_ms) {
+    struct __kernel_timespec ts = { .tv_sec = timeout_ms / 1000, .tv_nsec = (long long)(timeout_ms % 1000) * 1000000 };
+    struct io_uring_getevents_arg arg = { .ts = (uintptr_t)&ts };
+    for (;;) {
+        int rc = syscall(__NR_io_uring_enter, u->fd, u->to_submit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        if (rc >= 0) {
+            u->to_submit -= rc;
+            return 0;
+        }
+        if (errno == ETIME) return 0;
+        if (errno == EINTR) {
+            if (shutdown_flag) return -1;
+            continue;
+        }
+        if (errno == EAGAIN || errno == EBUSY) return uring_submit(u, 0);
+        return -1;
+    }
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sqe_tail - head >= u->sq_entries) {
+        uring_submit(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sqe_tail - head >= u->sq_entries) return NULL;
+    }
+
+    unsigned index = u->sqe_tail & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sqe_tail++;
+    u->to_submit++;
+    __atomic_store_n(u->sq_tail, u->sqe_tail, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+void uring_set_file(struct uring *u, struct io_uring_sqe *sqe, int fd) {
+    sqe->fd = fd;
+    if (u->fixed_files && (unsigned)fd < u->file_slots) sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+int uring_prep(struct uring *u, struct conn *c, int op, int opcode, int fd, void *addr, unsigned len) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (!sqe) return -1;
+
+    sqe->opcode = opcode;
+    if (fd >= 0) uring_set_file(u, sqe, fd);
+    else sqe->fd = fd;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->user_data = (uintptr_t)c | op;
+    if (c) c->inflight++;
+    return 0;
+}
+
+/* Links a fixed-file table update for fd in front of the next submitted operation. */
+int uring_install_file(struct uring *u, struct conn *c, int *fd) {
+    if (!u->fixed_files || (unsigned)*fd >= u->file_slots) return 0;
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)fd;
+    sqe->len = 1;
+    sqe->off = *fd;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = (uintptr_t)c | UOP_FILES_UPDATE;
+    c->inflight++;
+    return 0;
+}
+
+void uring_remove_file(struct uring *u, int fd) {
+    if (!u->fixed_files || fd < 0 || (unsigned)fd >= u->file_slots) return;
+
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (!sqe) {
+        syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_FILES_UPDATE, &(struct io_uring_files_update){ .offset = fd, .fds = (uintptr_t)&uring_empty_slot }, 1);
+        return;
+    }
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)&uring_empty_slot;
+    sqe->len = 1;
+    sqe->off = fd;
+    sqe->user_data = UOP_FILES_UPDATE;
+}
+
+/* Listener 0 takes proxy clients and 1 transparent ones; accepts carry the index where other ops carry a conn. */
+int uring_arm_accept(struct uring *u, struct worker *w, int listener) {
+    int fd = listener ? w->transparent_fd : w->listen_fd;
+    if (fd < 0) return 0;
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (u->multishot_accept) sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = (uint64_t)listener << 4 | UOP_ACCEPT;
+    u->accept_armed[listener] = 1;
+    return 0;
+}
+
+void uring_cancel_accept(struct uring *u) {
+    for (int i = 0; i < 2; i++) {
+        if (!u->accept_armed[i]) continue;
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        if (!sqe) return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uint64_t)i << 4 | UOP_ACCEPT;
+        sqe->user_data = UOP_CANCEL;
+    }
+}
+
+/* Multishot accept keeps taking clients on its own, so pausing has to cancel it; the loop re-arms it on resume. */
+void uring_pause_accept(struct uring *u, struct reactor *r) {
+    if (r->accept_resume_ms) return;
+    metrics_add(METRIC_ACCEPT_PAUSES, 1);
+    r->accept_resume_ms = r->now_ms + ACCEPT_PAUSE_MS;
+    uring_cancel_accept(u);
+}
+
+void uring_close_listener(struct worker *w, int listener) {
+    listener_close(listener ? &w->transparent_fd : &w->listen_fd);
+}
+
+/* A listener is closed only once no accept is armed on it; the rest close as their cancellations complete. */
+void uring_start_drain(struct uring *u, struct worker *w) {
+    w->reactor.draining = 1;
+    uring_cancel_accept(u);
+    for (int i = 0; i < 2; i++) {
+        if (!u->accept_armed[i]) uring_close_listener(w, i);
+    }
+}
+
+char *uring_dir_buffer(struct uring *u, struct relay_dir *d) {
+    return d->fixed_buf >= 0 ? u->buffers + (size_t)d->fixed_buf * BUFFER_SIZE : d->buf;
+}
+
+/* A direction paused by shaping posts nothing; uring_timer_fire() posts its read once the bucket has room. */
+int uring_post_read(struct uring *u, struct conn *c, struct relay_dir *d, int src, int op) {
+    struct reactor *r = &c->worker->reactor;
+    d->off = d->len = 0;
+    size_t quota = shape_quota(d);
+    if (!quota) return 0;
+    unsigned len = quota < BUFFER_SIZE ? quota : BUFFER_SIZE;
+
+    if (d->fixed_buf < 0 && u->free_buffer_count > 0) d->fixed_buf = u->free_buffers[--u->free_buffer_count];
+    if (d->fixed_buf < 0) {
+        if (relay_buf_acquire(r, d) < 0) return -1;
+        return uring_prep(u, c, op, IORING_OP_RECV, src, d->buf, len < d->size ? len : d->size);
+    }
+    relay_buf_release(r, d);
+
+    if (uring_prep(u, c, op, IORING_OP_READ_FIXED, src, uring_dir_buffer(u, d), len) < 0) return -1;
+    struct io_uring_sqe *sqe = &u->sqes[(u->sqe_tail - 1) & u->sq_mask];
+    sqe->buf_index = d->fixed_buf;
+    return 0;
+}
+
+int uring_post_write(struct uring *u, struct conn *c, struct relay_dir *d, int dst, int op) {
+    char *data = uring_dir_buffer(u, d) + d->off;
+    unsigned len = d->len - d->off;
+
+    /* Bytes staged before the relay started (a 200 reply, a pipelined request) live in d->buf. */
+    if (d->fixed_buf < 0 || d->staged) {
+        if (d->staged) data = d->buf + d->off;
+        if (uring_prep(u, c, op, IORING_OP_SEND, dst, data, len) < 0) return -1;
+        u->sqes[(u->sqe_tail - 1) & u->sq_mask].msg_flags = MSG_NOSIGNAL;
+        return 0;
+    }
+
+    if (uring_prep(u, c, op, IORING_OP_WRITE_FIXED, dst, data, len) < 0) return -1;
+    u->sqes[(u->sqe_tail - 1) & u->sq_mask].buf_index = d->fixed_buf;
+    return 0;
+}
+
+void uring_release_buffers(struct uring *u, struct conn *c) {
+    if (c->up.fixed_buf >= 0) u->free_buffers[u->free_buffer_count++] = c->up.fixed_buf;
+    if (c->down.fixed_buf >= 0) u->free_buffers[u->free_buffer_count++] = c->down.fixed_buf;
+    c->up.fixed_buf = c->down.fixed_buf = -1;
+}
+
+void uring_close(struct reactor *r, struct uring *u, struct conn *c) {
+    if (c->state == CONN_CLOSED) {
+        if (c->inflight > 0) return;
+    } else {
+        c->state = CONN_CLOSED;
+        conn_trace_finish(c);
+        timer_remove(&r->timers, &c->timer);
+        if (c->prev) c->prev->next = c->next;
+        else r->conns = c->next;
+        if (c->next) c->next->prev = c->prev;
+        metrics_add(METRIC_CONNECTIONS, -1);
+        capacity_release();
+        if (c->tunnel) metrics_add(METRIC_TUNNELS, -1);
+
+        /* Shutting the sockets down completes any parked reads; a pending connect needs a cancel. */
+        if (c->client.fd >= 0) shutdown(c->client.fd, SHUT_RDWR);
+        if (c->remote.fd >= 0) shutdown(c->remote.fd, SHUT_RDWR);
+        if (c->connecting) {
+            struct io_uring_sqe *sqe = uring_sqe(u);
+            if (sqe) {
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->fd = -1;
+                sqe->addr = (uintptr_t)c | UOP_CONNECT;
+                sqe->user_data = UOP_CANCEL;
+            }
+        }
+        if (c->inflight > 0) return;
+    }
+
+    uring_remove_file(u, c->client.fd);
+    uring_remove_file(u, c->remote.fd);
+    if (c->client.fd >= 0) close(c->client.fd);
+    if (c->remote.fd >= 0) close(c->remote.fd);
+    uring_release_buffers(u, c);
+    if (c->upstream) upstream_release(c->upstream);
+    free(c->target_host);
+    free(c->dial);
+    relay_buf_free(r, &c->up);
+    relay_buf_free(r, &c->down);
+    slab_free(&r->conn_slab, c);
+}
+
+int uring_start_relay(struct uring *u, struct conn *c) {
+    c->state = CONN_RELAY;
+    c->up.staged = c->up.len > 0;
+    c->down.staged = c->down.len > 0;
+
+    int rc = c->up.staged ? uring_post_write(u, c, &c->up, c->remote.fd, UOP_WRITE_UP)
+                          : uring_post_read(u, c, &c->up, c->client.fd, UOP_READ_UP);
+    if (rc < 0) return -1;
+    return c->down.staged ? uring_post_write(u, c, &c->down, c->client.fd, UOP_WRITE_DOWN)
+                          : uring_post_read(u, c, &c->down, c->remote.fd, UOP_READ_DOWN);
+}
+
+/* A multi-address host is dialed one address after another, each bounded by a linked timeout. */
+int uring_start_remote(struct uring *u, struct conn *c) {
+    struct dial *d = c->dial;
+    if (!d || d->started == 0) c->connect_start = now_us();
+    if (d) c->remote_addr = d->addrs[d->started++];
+
+    c->remote.fd = remote_socket_open(c->remote_addr.sa.sa_family, SOCK_CLOEXEC);
+    if (c->remote.fd < 0) {
+        metrics_error(ERROR_CONNECT);
+        LOG_ERROR("Failed to connect to remote host");
+        return -1;
+    }
+    if (uring_install_file(u, c, &c->remote.fd) < 0) return -1;
+    if (uring_prep(u, c, UOP_CONNECT, IORING_OP_CONNECT, c->remote.fd, &c->remote_addr, 0) < 0) return -1;
+    struct io_uring_sqe *connect_sqe = &u->sqes[(u->sqe_tail - 1) & u->sq_mask];
+    connect_sqe->off = sockaddr_len(&c->remote_addr);
+    c->connecting = 1;
+    c->state = CONN_CONNECTING;
+
+    /* The timeout cancels the connect, which then completes with -ECANCELED. */
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    if (sqe) {
+        connect_sqe->flags |= IOSQE_IO_LINK;
+        sqe->opcode = IORING_OP_LINK_TIMEOUT;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)&u->connect_timeout;
+        sqe->len = 1;
+        sqe->user_data = UOP_CANCEL;
+    }
+    return 0;
+}
+
+/* The next address gets its socket before the failed one leaves the file table, as in uring_redial. */
+int uring_dial_next(struct uring *u, struct conn *c) {
+    int failed = c->remote.fd;
+    c->remote.fd = -1;
+    int rc = uring_start_remote(u, c);
+    uring_remove_file(u, failed);
+    close(failed);
+    return rc;
+}
+
+/* Sends whatever is left of the upstream handshake, then waits for the reply. */
+int uring_post_handshake(struct uring *u, struct conn *c) {
+    struct relay_dir *d = &c->down;
+    if (d->off < d->len) {
+        if (uring_prep(u, c, UOP_HANDSHAKE_SEND, IORING_OP_SEND, c->remote.fd, d->buf + d->off, d->len - d->off) < 0) return -1;
+        u->sqes[(u->sqe_tail - 1) & u->sq_mask].msg_flags = MSG_NOSIGNAL;
+        return 0;
+    }
+    d->off = d->len = 0;
+    return uring_prep(u, c, UOP_HANDSHAKE_RECV, IORING_OP_RECV, c->remote.fd, d->buf + d->fill, UPSTREAM_REPLY_MAX - d->fill);
+}
+
+/* The new socket is made before the old one leaves the file table, so the two never share a slot. */
+int uring_redial(struct uring *u, struct conn *c) {
+    int failed = c->remote.fd;
+    c->remote.fd = -1;
+    int rc = conn_retry_upstream(c) == 0 ? uring_start_remote(u, c) : -1;
+    if (failed >= 0) {
+        uring_remove_file(u, failed);
+        close(failed);
+    }
+    if (rc == 0) return 0;
+
+    if (conn_upstream_unavailable(c) != REQUEST_RESPOND) return -1;
+    c->state = CONN_FLUSH_CLOSE;
+    return uring_prep(u, c, UOP_SEND_RESPONSE, IORING_OP_SEND, c->client.fd, c->down.buf, c->down.len);
+}
+
+/* Hands the connection to the relay, or to the upstream handshake when one comes first. */
+int uring_connected(struct uring *u, struct conn *c) {
+    int rc = conn_connected(c);
+    if (rc > 0) return uring_start_relay(u, c);
+    if (rc == 0) return uring_post_handshake(u, c);
+    return c->upstream ? uring_redial(u, c) : -1;
+}
+
+int uring_on_relay(struct uring *u, struct conn *c, int op, int res) {
+    int upward = op == UOP_READ_UP || op == UOP_WRITE_UP;
+    struct relay_dir *d = upward ? &c->up : &c->down;
+    int src = upward ? c->client.fd : c->remote.fd;
+    int dst = upward ? c->remote.fd : c->client.fd;
+    int read_op = upward ? UOP_READ_UP : UOP_READ_DOWN;
+    int write_op = upward ? UOP_WRITE_UP : UOP_WRITE_DOWN;
+
+    if (res < 0) return -1;
+
+    if (op == read_op) {
+        if (res == 0) {
+            d->eof = 1;
+            d->shut = 1;
+            if (uring_prep(u, c, UOP_SHUTDOWN, IORING_OP_SHUTDOWN, dst, NULL, 0) < 0) return -1;
+            u->sqes[(u->sqe_tail - 1) & u->sq_mask].len = SHUT_WR;
+            return 0;
+        }
+        d->len = res;
+        relay_count(d, res);
+        return uring_post_write(u, c, d, dst, write_op);
+    }
+
+    d->off += res;
+    if (d->off < d->len) return uring_post_write(u, c, d, dst, write_op);
+    d->staged = 0;
+    return uring_post_read(u, c, d, src, read_op);
+}
+
+void uring_accept(struct uring *u, struct worker *w, int fd, int transparent) {
+    struct reactor *r = &w->reactor;
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    getpeername(fd, (struct sockaddr *)&client_addr, &addr_len);
+    steer_check(w, fd);
+    struct rate_bucket *rate;
+    int refused = rate_admit(client_addr.sin_addr.s_addr, &rate);
+    if (refused >= 0) {
+        metrics_add(METRIC_ACCEPTED, 1);
+        metrics_error(refused);
+        LOG_WARN(close_reasons[refused]);
+        close(fd);
+        return;
+    }
+    if (capacity_acquire() < 0) {
+        metrics_add(METRIC_ACCEPTED, 1);
+        capacity_refuse(fd);
+        if (config.overload == OVERLOAD_PAUSE) uring_pause_accept(u, r);
+        return;
+    }
+    if (config.overload == OVERLOAD_PAUSE && capacity_full()) uring_pause_accept(u, r);
+
+    struct conn *c = slab_alloc(&r->conn_slab);
+    if (!c) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
+        capacity_release();
+        close(fd);
+        return;
+    }
+    memset(c, 0, sizeof(*c));
+    metrics_add(METRIC_ACCEPTED, 1);
+    metrics_add(METRIC_CONNECTIONS, 1);
+
+    c->worker = w;
+    c->client.conn = c;
+    c->client.fd = fd;
+    c->remote.conn = c;
+    c->remote.fd = -1;
+    c->up.fixed_buf = c->down.fixed_buf = -1;
+    c->up.bytes_metric = METRIC_BYTES_UP;
+    c->down.bytes_metric = METRIC_BYTES_DOWN;
+    c->up.rate = c->down.rate = rate;
+    if (config.tunnel_bandwidth > 0) c->up.tunnel_tat = c->down.tunnel_tat = &c->tunnel_tat;
+    c->transparent = transparent;
+    c->state = CONN_READ_REQUEST;
+    inet_ntop(AF_INET, &client_addr.sin_addr, c->client_ip, INET_ADDRSTRLEN);
+    c->client_port = ntohs(client_addr.sin_port);
+    c->client_addr = client_addr.sin_addr.s_addr;
+    conn_trace_start(c);
+    c->timer.owner = c;
+    c->accepted_ms = c->request_ms = c->active_ms = r->now_ms;
+    conn_arm_timer(r, c, conn_deadline(c, 0));
+
+    c->next = r->conns;
+    if (r->conns) r->conns->prev = c;
+    r->conns = c;
+
+    if (relay_buf_acquire(r, &c->up) < 0 || uring_install_file(u, c, &c->client.fd) < 0 ||
+        uring_prep(u, c, UOP_RECV_REQUEST, IORING_OP_RECV, fd, c->up.buf, BUFFER_SIZE - 1) < 0) {
+        uring_close(r, u, c);
+    }
+}
+
+int uring_arm_mailbox(struct uring *u, struct worker *w) {
+    return uring_prep(u, NULL, UOP_MAILBOX, IORING_OP_READ, w->mailbox.efd, &u->mailbox_count, sizeof(u->mailbox_count));
+}
+
+/* Acts on the buffered request; a conn waiting on the resolver or a verifier counts as an op in flight. */
+int uring_handle_request(struct uring *u, struct conn *c) {
+    int rc = 0;
+    switch (conn_handle_request(c)) {
+    case REQUEST_INCOMPLETE:
+        rc = uring_prep(u, c, UOP_RECV_REQUEST, IORING_OP_RECV, c->client.fd, c->up.buf + c->up.len, BUFFER_SIZE - 1 - c->up.len);
+        break;
+    case REQUEST_RESPOND:
+        c->state = CONN_FLUSH_CLOSE;
+        rc = uring_prep(u, c, UOP_SEND_RESPONSE, IORING_OP_SEND, c->client.fd, c->down.buf, c->down.len);
+        break;
+    case REQUEST_DIAL:
+        rc = uring_start_remote(u, c);
+        if (rc < 0 && c->upstream) rc = uring_redial(u, c);
+        break;
+    case REQUEST_RESOLVING:
+        c->inflight++;
+        break;
+    default:
+        rc = -1;
+    }
+    return rc;
+}
+
+void uring_drain_mailbox(struct uring *u, struct worker *w) {
+    struct conn *c = mailbox_take(&w->mailbox);
+    for (struct conn *next; c; c = next) {
+        next = c->dns_next;
+        c->inflight--;
+        c->verifying = 0;
+        if (c->state == CONN_CLOSED) {
+            uring_close(&w->reactor, u, c);
+        } else if (c->state == CONN_VERIFYING) {
+            c->state = CONN_READ_REQUEST;
+            if (uring_handle_request(u, c) < 0) uring_close(&w->reactor, u, c);
+            else if (c->state != CONN_CLOSED) conn_arm_timer(&w->reactor, c, conn_deadline(c, 0));
+        } else if (c->dns_status != DNS_READY) {
+            metrics_error(ERROR_DNS);
+            LOG_ERROR("Failed to resolve host");
+            uring_close(&w->reactor, u, c);
+        } else {
+            trace_mark(&c->trace, TRACE_RESOLVED);
+            if (uring_start_remote(u, c) < 0) uring_close(&w->reactor, u, c);
+        }
+    }
+}
+
+void uring_complete(struct uring *u, struct worker *w, struct io_uring_cqe *cqe) {
+    struct reactor *r = &w->reactor;
+    int op = cqe->user_data & UOP_MASK;
+    struct conn *c = (struct conn *)(uintptr_t)(cqe->user_data & ~UOP_MASK);
+    int res = cqe->res;
+
+    if (op == UOP_ACCEPT) {
+        int listener = (int)(cqe->user_data >> 4);
+        if (!(cqe->flags & IORING_CQE_F_MORE)) u->accept_armed[listener] = 0;
+        if (res >= 0) uring_accept(u, w, res, listener);
+        else if (res == -EINVAL && u->multishot_accept) u->multishot_accept = 0;
+        else if (res != -ECANCELED && !shutdown_flag) {
+            metrics_error(ERROR_ACCEPT);
+            LOG_ERROR("accept failed");
+            if (accept_should_pause(-res)) uring_pause_accept(u, r);
+        }
+        if (u->accept_armed[listener]) return;
+        if (r->draining) uring_close_listener(w, listener);
+        else if (!r->accept_resume_ms && !shutdown_flag) uring_arm_accept(u, w, listener);
+        return;
+    }
+    if (op == UOP_MAILBOX) {
+        uring_drain_mailbox(u, w);
+        if (drain_pending(r)) uring_start_drain(u, w);
+        if (!shutdown_flag) uring_arm_mailbox(u, w);
+        return;
+    }
+    if (!c) return;
+
+    c->inflight--;
+    if (c->state == CONN_CLOSED) {
+        uring_close(r, u, c);
+        return;
+    }
+    c->active_ms = r->now_ms;
+
+    int rc = 0;
+    switch (op) {
+    case UOP_FILES_UPDATE:
+        if (res < 0) LOG_ERROR("Failed to register fixed file");
+        return;
+    case UOP_RECV_REQUEST:
+        if (res <= 0) {
+            rc = -1;
+            break;
+        }
+        c->up.len += res;
+        metrics_add(METRIC_BYTES_UP, res);
+        rc = uring_handle_request(u, c);
+        break;
+    case UOP_SEND_RESPONSE:
+        c->down.off += res > 0 ? res : 0;
+        if (res > 0 && c->down.off < c->down.len) {
+            rc = uring_prep(u, c, UOP_SEND_RESPONSE, IORING_OP_SEND, c->client.fd, c->down.buf + c->down.off, c->down.len - c->down.off);
+        } else {
+            rc = -1;
+        }
+        break;
+    case UOP_CONNECT:
+        c->connecting = 0;
+        if (res < 0 && !c->upstream && c->dial && c->dial->started < c->dial->count) {
+            rc = uring_dial_next(u, c);
+        } else if (res < 0) {
+            metrics_error(res == -ECANCELED ? ERROR_CONNECT_TIMEOUT : ERROR_CONNECT);
+            LOG_ERROR(res == -ECANCELED ? "Connect to remote host timed out" : "Failed to connect to remote host");
+            rc = c->upstream ? uring_redial(u, c) : -1;
+        } else {
+            free(c->dial);
+            c->dial = NULL;
+            metrics_observe_connect(now_us() - c->connect_start);
+            rc = uring_connected(u, c);
+        }
+        break;
+    case UOP_HANDSHAKE_SEND:
+        if (res < 0) {
+            rc = uring_redial(u, c);
+            break;
+        }
+        c->down.off += res;
+        rc = uring_post_handshake(u, c);
+        break;
+    case UOP_HANDSHAKE_RECV:
+        if (res <= 0) {
+            rc = uring_redial(u, c);
+            break;
+        }
+        c->down.fill += res;
+        rc = conn_check_handshake(c);
+        if (rc == 0) rc = uring_post_handshake(u, c);
+        else if (rc > 0) rc = uring_start_relay(u, c);
+        else rc = uring_redial(u, c);
+        break;
+    case UOP_SHUTDOWN:
+        if (c->up.shut && c->down.shut) rc = -1;
+        break;
+    default:
+        rc = uring_on_relay(u, c, op, res);
+        break;
+    }
+
+    if (rc < 0) uring_close(r, u, c);
+    else if (c->state != CONN_CLOSED) conn_arm_timer(r, c, conn_deadline(c, 0));
+}
+
+/* Connects carry their own linked timeouts; the wheel covers header, idle and lifetime deadlines. */
+void uring_timer_fire(struct uring *u, struct reactor *r, struct conn *c) {
+    int cause = conn_expired(c, r->now_ms, 0);
+    if (cause < 0) {
+        if ((conn_resume_due(&c->up, r->now_ms) && uring_post_read(u, c, &c->up, c->client.fd, UOP_READ_UP) < 0) ||
+            (conn_resume_due(&c->down, r->now_ms) && uring_post_read(u, c, &c->down, c->remote.fd, UOP_READ_DOWN) < 0)) {
+            uring_close(r, u, c);
+            return;
+        }
+        conn_arm_timer(r, c, conn_deadline(c, 0));
+        return;
+    }
+    metrics_error(cause);
+    LOG_WARN(close_reasons[cause]);
+    uring_close(r, u, c);
+}
+
+int run_uring_engine(struct worker *w) {
+    struct uring *u = calloc(1, sizeof(*u));
+    if (!u || uring_setup(u) < 0) {
+        free(u);
+        return -1;
+    }
+    u->multishot_accept = 1;
+    u->connect_timeout.tv_sec = config.connect_timeout / 1000;
+    u->connect_timeout.tv_nsec = (long long)(config.connect_timeout % 1000) * 1000000;
+    w->reactor.worker = w;
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Worker %d: io_uring ready (fixed files %s, %d registered buffers)", w->id, u->fixed_files ? "on" : "off", u->free_buffer_count);
+    LOG_INFO(msg);
+
+    if (uring_arm_accept(u, w, 0) < 0 || uring_arm_accept(u, w, 1) < 0 || uring_arm_mailbox(u, w) < 0) {
+        uring_teardown(u);
+        return -1;
+    }
+
+    struct reactor *r = &w->reactor;
+    timer_wheel_init(&r->timers, now_ms());
+    while (!shutdown_flag) {
+        if (uring_wait(u, timer_next_ms(&r->timers, now_ms(), r->accept_resume_ms ? ACCEPT_PAUSE_MS : 1000)) < 0) {
+            if (!shutdown_flag) perror("io_uring_enter");
+            break;
+        }
+        r->now_ms = now_ms();
+        if (r->accept_resume_ms && r->now_ms >= r->accept_resume_ms) {
+            r->accept_resume_ms = 0;
+            if (config.overload == OVERLOAD_PAUSE && capacity_full()) uring_pause_accept(u, r);
+            else {
+                if (!u->accept_armed[0]) uring_arm_accept(u, w, 0);
+                if (!u->accept_armed[1]) uring_arm_accept(u, w, 1);
+            }
+        }
+
+        unsigned head = *u->cq_head;
+        unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            uring_complete(u, w, &u->cqes[head & u->cq_mask]);
+            head++;
+            __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+        }
+
+        for (struct timer *t = timer_expire(&r->timers, r->now_ms), *next; t; t = next) {
+            next = t->next;
+            uring_timer_fire(u, r, t->owner);
+        }
+    }
+    uring_teardown(u);
+    return 0;
+}
+#endif
+
+void shutdown_server(int sig) {
+    (void)sig;
+    shutdown_flag = 1;
+    LOG_WARN("Shutting down server...");
+
+    for (int w = 0; w < config.workers; w++) {
+        struct worker *worker = &workers[w];
+        listener_close(&worker->listen_fd);
+        listener_close(&worker->transparent_fd);
+
+        struct conn_registry *reg = &worker->registry;
+        for (uint32_t i = 0; i < reg->size; i++) {
+            int fd = __atomic_exchange_n(&reg->slots[i].fd, -1, __ATOMIC_ACQ_REL);
+            if (fd >= 0) {
+                shutdown(fd, SHUT_RDWR);
+                close(fd);
+            }
+        }
+    }
+
+    LOG_INFO("Proxy shutdown complete.");
+    exit(0);
+}
+
+void listener_tune(int fd) {
+    socket_tune(fd);
+    if (config.tcp_defer_accept > 0) sockopt_set(fd, SOCKOPT_DEFER_ACCEPT, IPPROTO_TCP, TCP_DEFER_ACCEPT, config.tcp_defer_accept);
+    if (config.tcp_fastopen > 0) sockopt_set(fd, SOCKOPT_FASTOPEN, IPPROTO_TCP, TCP_FASTOPEN, config.tcp_fastopen);
+}
+
+int create_listener(const char *host, int port, int tuned) {
+    struct sockaddr_in server_addr = {0};
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("socket");
+        exit(EXIT_FAILURE);
+    }
+
+    int opt = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (config.workers > 1 && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+        perror("setsockopt(SO_REUSEPORT)");
+        exit(EXIT_FAILURE);
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, host, &server_addr.sin_addr);
+
+    if (bind(listen_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        perror("bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (tuned) listener_tune(listen_fd);
+    if (listen(listen_fd, LISTEN_BACKLOG) < 0) {
+        perror("listen");
+        exit(EXIT_FAILURE);
+    }
+    return listen_fd;
+}
+
+/* Takes over a listener inherited through an upgrade if it is bound where this process was asked to listen,
+ * picking up the current socket profile; otherwise the inherited one is dropped and a fresh one bound. */
+int listener_take(int *inherited_fd, const char *host, int port, int tuned) {
+    int fd = inherited_fd ? *inherited_fd : -1;
+    if (fd >= 0) {
+        *inherited_fd = -1;
+        struct sockaddr_in bound;
+        socklen_t len = sizeof(bound);
+        struct in_addr want = {0};
+        inet_pton(AF_INET, host, &want);
+        if (getsockname(fd, (struct sockaddr *)&bound, &len) == 0 && bound.sin_port == htons(port) && bound.sin_addr.s_addr == want.s_addr) {
+            if (tuned) listener_tune(fd);
+            return fd;
+        }
+        close(fd);
+    }
+    return create_listener(host, port, tuned);
+}
+
+void admin_respond(int fd, const char *status, const char *type, const char *body, size_t len) {
+    char head[256];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n", status, type, len);
+    send(fd, head, head_len, MSG_NOSIGNAL | MSG_MORE);
+    send(fd, body, len, MSG_NOSIGNAL);
+}
+
+/* The admin plane: one blocking thread, one request per connection, off the data path entirely.
+ * It polls so that it can step aside once its listener has gone to a new process. */
+void *admin_main(void *arg) {
+    int listen_fd = *(int *)arg;
+    static char body[METRICS_OUTPUT_BUFFER];
+
+    while (!shutdown_flag && !__atomic_load_n(&handed_off, __ATOMIC_ACQUIRE)) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, 1000) <= 0) continue;
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && !shutdown_flag) perror("accept");
+            continue;
+        }
+
+        struct timeval timeout = {2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        char buf[2048];
+        size_t len = 0;
+        struct http_message msg;
+        int head_len = 0;
+        while (head_len == 0 && len < sizeof(buf)) {
+            ssize_t got = recv(fd, buf + len, sizeof(buf) - len, 0);
+            if (got <= 0) break;
+            len += got;
+            head_len = http_parse_request_head(buf, len, &msg);
+        }
+
+        if (head_len <= 0) {
+            admin_respond(fd, "400 Bad Request", "text/plain", "", 0);
+        } else if (msg.method_len == 3 && memcmp(msg.method, "GET", 3) == 0 && msg.target_len == 8 && memcmp(msg.target, "/metrics", 8) == 0) {
+            size_t body_len = metrics_render(body, sizeof(body));
+            body_len += upstream_render(body + body_len, sizeof(body) - body_len);
+            admin_respond(fd, "200 OK", "text/plain; version=0.0.4", body, body_len);
+        } else if (msg.method_len == 3 && memcmp(msg.method, "GET", 3) == 0 && msg.target_len == 7 && memcmp(msg.target, "/traces", 7) == 0) {
+            size_t body_len = trace_render(body, sizeof(body));
+            admin_respond(fd, "200 OK", "application/x-ndjson", body, body_len);
+        } else if (msg.method_len == 3 && memcmp(msg.method, "GET", 3) == 0 && msg.target_len == 8 && memcmp(msg.target, "/healthz", 8) == 0) {
+            admin_respond(fd, "200 OK", "text/plain", "OK", 2);
+        } else {
+            admin_respond(fd, "404 Not Found", "text/plain", "", 0);
+        }
+        close(fd);
+    }
+    listener_close(arg);
+    return NULL;
+}
+
+void start_admin(void) {
+    admin_fd = listener_take(&inherited.admin_fd, config.admin_host, config.admin_port, 0);
+    set_nonblocking(admin_fd);
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, admin_main, &admin_fd) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(tid);
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Admin metrics on http://%s:%d/metrics", config.admin_host, config.admin_port);
+    LOG_INFO(msg);
+}
+
+void thread_pause_accept(struct reactor *r) {
+    metrics_add(METRIC_ACCEPT_PAUSES, 1);
+    r->accept_resume_ms = now_ms() + ACCEPT_PAUSE_MS;
+}
+
+void thread_accept(struct worker *w, int listen_fd, int transparent) {
+    struct sockaddr_in client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+    int client_socket = accept(listen_fd, (struct sockaddr *)&client_addr, &addr_len);
+    if (client_socket < 0) {
+        if (shutdown_flag || errno == EAGAIN || errno == EWOULDBLOCK) return;
+        metrics_error(ERROR_ACCEPT);
+        perror("accept");
+        if (accept_should_pause(errno)) thread_pause_accept(&w->reactor);
+        return;
+    }
+    metrics_add(METRIC_ACCEPTED, 1);
+    steer_check(w, client_socket);
+
+    struct rate_bucket *rate;
+    int refused = rate_admit(client_addr.sin_addr.s_addr, &rate);
+    if (refused >= 0) {
+        metrics_error(refused);
+        LOG_WARN(close_reasons[refused]);
+        close(client_socket);
+        return;
+    }
+    if (capacity_acquire() < 0) {
+        capacity_refuse(client_socket);
+        return;
+    }
+
+    struct client_arg *client = malloc(sizeof(*client));
+    if (!client) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
+        capacity_release();
+        close(client_socket);
+        return;
+    }
+
+    client->worker = w;
+    client->rate = rate;
+    client->fd = client_socket;
+    client->transparent = transparent;
+    trace_start(&client->trace, client_socket);
+    pthread_t tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (w->cpu >= 0) pthread_attr_setaffinity_np(&attr, sizeof(w->node_cpus), &w->node_cpus);
+    int err = pthread_create(&tid, &attr, handle_client, client);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Thread creation failed");
+        free(client);
+        capacity_release();
+        close(client_socket);
+        if (accept_should_pause(err) || err == EAGAIN) thread_pause_accept(&w->reactor);
+        return;
+    }
+    pthread_detach(tid);
+}
+
+/* The acceptor doubles as the worker's timer loop: it sleeps in poll() no longer than the wheel allows.
+ * Listeners are non-blocking because after an upgrade another process may win the race to accept. */
+void run_thread_engine(struct worker *w) {
+    struct reactor *r = &w->reactor;
+    r->worker = w;
+    timer_wheel_init(&r->timers, now_ms());
+    set_nonblocking(w->listen_fd);
+    if (w->transparent_fd >= 0) set_nonblocking(w->transparent_fd);
+    struct pollfd fds[3] = { { .fd = w->listen_fd, .events = POLLIN }, { .fd = w->transparent_fd, .events = POLLIN }, { .fd = w->mailbox.efd, .events = POLLIN } };
+    while (!shutdown_flag) {
+        uint64_t now = now_ms();
+        if (r->accept_resume_ms && now >= r->accept_resume_ms) r->accept_resume_ms = 0;
+        if (!r->accept_resume_ms && config.overload == OVERLOAD_PAUSE && capacity_full()) thread_pause_accept(r);
+
+        /* A negative fd makes poll() skip that listener, so a paused acceptor only sleeps out its timers. */
+        fds[0].fd = r->accept_resume_ms ? -1 : w->listen_fd;
+        fds[1].fd = r->accept_resume_ms ? -1 : w->transparent_fd;
+        pthread_mutex_lock(&w->timer_lock);
+        int wait_ms = timer_next_ms(&r->timers, now, r->accept_resume_ms ? ACCEPT_PAUSE_MS : 1000);
+        pthread_mutex_unlock(&w->timer_lock);
+        int ready = poll(fds, 3, wait_ms);
+        slot_timers_fire(w);
+        if (ready <= 0) continue;
+
+        if (fds[2].revents & POLLIN) {
+            uint64_t count;
+            while (read(w->mailbox.efd, &count, sizeof(count)) > 0) {}
+            if (drain_pending(r)) {
+                r->draining = 1;
+                listener_close(&w->listen_fd);
+                listener_close(&w->transparent_fd);
+                continue;
+            }
+        }
+        for (int i = 0; i < 2 && !shutdown_flag; i++) {
+            if (fds[i].fd >= 0 && (fds[i].revents & POLLIN)) thread_accept(w, fds[i].fd, i);
+        }
+    }
+}
+
+/* Parses a kernel cpulist such as "0-3,8,10-11"; returns -1 if it is malformed or names no CPU. */
+int cpulist_parse(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p && *p != '\n') {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        if (last >= CPU_SETSIZE) return -1;
+        for (long cpu = first; cpu <= last; cpu++) CPU_SET(cpu, set);
+        p = end;
+        if (*p == ',') p++;
+        else if (*p && *p != '\n') return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+/* Reads each node's CPUs from sysfs; without it, or on one node, every CPU counts as node 0. */
+void numa_init(void) {
+    for (int node = 0; node < NUMA_MAX_NODES; node++) {
+        char path[64], list[4096];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        size_t n = fread(list, 1, sizeof(list) - 1, f);
+        fclose(f);
+        list[n] = '\0';
+        if (cpulist_parse(list, &node_cpus[node]) < 0) continue;
+        numa_nodes = node + 1;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &node_cpus[node])) cpu_nodes[cpu] = node;
+        }
+    }
+    if (CPU_COUNT(&node_cpus[0]) == 0 && sched_getaffinity(0, sizeof(node_cpus[0]), &node_cpus[0]) < 0) CPU_ZERO(&node_cpus[0]);
+}
+
+/* Points the calling thread's new pages at node, or back to the default policy with -1. MPOL_PREFERRED lets a full
+ * node spill over rather than fail; a single-node machine has nothing to prefer. */
+int numa_prefer(int node) {
+    if (numa_nodes < 2) return 0;
+    unsigned long mask = node >= 0 ? 1UL << node : 0;
+    if (node < 0) return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) < 0 ? -1 : 0;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1) < 0 ? -1 : 0;
+}
+
+/* The index-th CPU a worker may take, out of --cpus (typically the cores taking the NIC's interrupts) or else all
+ * the allowed ones, walked node by node so that consecutive workers share a node and its caches. */
+int pick_cpu(int index) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return -1;
+    if (config.cpus) {
+        cpu_set_t wanted;
+        if (cpulist_parse(config.cpus, &wanted) < 0) return -1;
+        CPU_AND(&allowed, &allowed, &wanted);
+    }
+
+    int count = CPU_COUNT(&allowed);
+    if (count <= 0) return -1;
+    int nth = index % count;
+    for (int node = 0; node < numa_nodes; node++) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && cpu_nodes[cpu] == node && nth-- == 0) return cpu;
+        }
+    }
+    return -1;
+}
+
+/* Places a worker on its CPU's node: thread-engine client threads may float over the node's allowed CPUs,
+ * but not off it. */
+void worker_place(struct worker *w, int cpu) {
+    w->cpu = cpu;
+    w->node = cpu >= 0 ? cpu_nodes[cpu] : -1;
+    CPU_ZERO(&w->node_cpus);
+    if (cpu < 0) return;
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) CPU_AND(&w->node_cpus, &node_cpus[w->node], &allowed);
+    if (CPU_COUNT(&w->node_cpus) == 0) CPU_SET(cpu, &w->node_cpus);
+}
+
+/* Ties each worker's listeners to its CPU: a reuseport group hands a connection to the listener whose
+ * SO_INCOMING_CPU is the CPU that took its SYN, on kernels that honour it within the group. */
+int steer_incoming(const struct worker *w) {
+    if (setsockopt(w->listen_fd, SOL_SOCKET, SO_INCOMING_CPU, &w->cpu, sizeof(w->cpu)) < 0) return -1;
+    if (w->transparent_fd >= 0 && setsockopt(w->transparent_fd, SOL_SOCKET, SO_INCOMING_CPU, &w->cpu, sizeof(w->cpu)) < 0) return -1;
+    return 0;
+}
+
+/* Steers a reuseport group with a classic BPF program run on the CPU that took the SYN: it returns the index of
+ * the worker pinned there, picking at random among them when --workers outnumbers the CPUs and several share one,
+ * and a CPU without one spreads by cpu % workers. The group indexes its sockets in listen() order, which is worker
+ * order; an index it does not have falls back to the kernel's hash. */
+int steer_attach(int fd) {
+    /* Per CPU: its test, a load of a random number and its reduction, then a test and a return per worker. */
+    int len = 4 * config.workers + 3;
+    if (len > BPF_MAXINSNS) return -1;
+    struct sock_filter *code = calloc(len, sizeof(*code));
+    int *shared = malloc(config.workers * sizeof(*shared));
+    if (!code || !shared) {
+        free(code);
+        free(shared);
+        return -1;
+    }
+
+    int n = 0, rc = 0;
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < config.workers && rc == 0; i++) {
+        int cpu = workers[i].cpu, k = 0, seen = 0;
+        if (cpu < 0) continue;
+        for (int j = 0; j < config.workers; j++) {
+            if (workers[j].cpu != cpu) continue;
+            if (j < i) seen = 1;
+            shared[k++] = j;
+        }
+        if (seen) continue;
+
+        /* The block after the CPU test always returns, so A still holds the CPU for the next test. */
+        int block = k == 1 ? 1 : 2 * k + 1;
+        if (block > 255) {
+            rc = -1;
+            break;
+        }
+        code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpu, 0, block);
+        if (k == 1) {
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+            continue;
+        }
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_RANDOM);
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, k);
+        for (int j = 0; j < k - 1; j++) {
+            code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, j, 0, 1);
+            code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, shared[j]);
+        }
+        code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, shared[k - 1]);
+    }
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, config.workers);
+    code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    if (rc == 0) {
+        struct sock_fprog prog = { .len = n, .filter = code };
+        rc = setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+    }
+    free(shared);
+    free(code);
+    return rc;
+}
+
+/* Runs once every listener is listening, so each group holds all of its sockets. */
+void steer_init(void) {
+    if (config.workers < 2 || workers[0].cpu < 0) {
+        LOG_WARN("Connection steering needs more than one pinned worker; left off");
+        config.steering = STEER_NONE;
+        return;
+    }
+    int rc = 0;
+    if (config.steering == STEER_INCOMING_CPU) {
+        for (int i = 0; i < config.workers && rc == 0; i++) rc = steer_incoming(&workers[i]);
+    } else {
+        rc = steer_attach(workers[0].listen_fd);
+        if (rc == 0 && workers[0].transparent_fd >= 0) rc = steer_attach(workers[0].transparent_fd);
+    }
+    if (rc < 0) {
+        perror("setsockopt(steering)");
+        LOG_WARN("Connection steering unavailable; left off");
+        config.steering = STEER_NONE;
+    }
+}
+
+void *worker_main(void *arg) {
+    struct worker *w = arg;
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) LOG_WARN("Failed to pin worker to CPU");
+        /* Slabs, buffers and io_uring rings are allocated from here on, as are client threads, which inherit it. */
+        numa_prefer(w->node);
+    }
+
+#ifdef HAVE_IO_URING
+    if (config.engine == ENGINE_URING) {
+        if (run_uring_engine(w) == 0) return NULL;
+        LOG_WARN("io_uring unavailable, falling back to epoll");
+        run_epoll_engine(w);
+        return NULL;
+    }
+#endif
+    if (config.engine == ENGINE_THREAD) run_thread_engine(w);
+    else run_epoll_engine(w);
+    return NULL;
+}
+
+int handoff_send(int sock, int kind, int index, int fd) {
+    struct handoff_msg msg = { kind, index };
+    struct iovec iov = { &msg, sizeof(msg) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1 };
+    if (fd >= 0) {
+        mh.msg_control = control.buf;
+        mh.msg_controllen = sizeof(control.buf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+    }
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1;
+}
+
+int handoff_send_all(int sock) {
+    for (int i = 0; i < config.workers; i++) {
+        int fd = __atomic_load_n(&workers[i].listen_fd, __ATOMIC_ACQUIRE);
+        if (fd >= 0 && handoff_send(sock, HANDOFF_PROXY, i, fd) < 0) return -1;
+        fd = __atomic_load_n(&workers[i].transparent_fd, __ATOMIC_ACQUIRE);
+        if (fd >= 0 && handoff_send(sock, HANDOFF_TRANSPARENT, i, fd) < 0) return -1;
+    }
+    if (admin_fd >= 0 && handoff_send(sock, HANDOFF_ADMIN, 0, admin_fd) < 0) return -1;
+    return handoff_send(sock, HANDOFF_END, 0, -1);
+}
+
+int handoff_grow(int count) {
+    int *proxy_fds = realloc(inherited.proxy_fds, count * sizeof(int));
+    if (proxy_fds) inherited.proxy_fds = proxy_fds;
+    int *transparent_fds = realloc(inherited.transparent_fds, count * sizeof(int));
+    if (transparent_fds) inherited.transparent_fds = transparent_fds;
+    if (!proxy_fds || !transparent_fds) return -1;
+    for (int i = inherited.count; i < count; i++) proxy_fds[i] = transparent_fds[i] = -1;
+    inherited.count = count;
+    return 0;
+}
+
+/* The new process's half: reads listeners off the upgrade socket until the end marker. */
+int handoff_receive(int sock) {
+    for (;;) {
+        struct handoff_msg msg;
+        struct iovec iov = { &msg, sizeof(msg) };
+        union {
+            struct cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(int))];
+        } control;
+        struct msghdr mh = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf, .msg_controllen = sizeof(control.buf) };
+        if (recvmsg(sock, &mh, MSG_CMSG_CLOEXEC) != sizeof(msg)) return -1;
+        if (msg.kind == HANDOFF_END) return 0;
+
+        int fd = -1;
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+        if (fd < 0 || msg.index < 0) return -1;
+        if (msg.kind == HANDOFF_ADMIN) {
+            inherited.admin_fd = fd;
+            continue;
+        }
+        if (msg.index >= inherited.count && handoff_grow(msg.index + 1) < 0) {
+            close(fd);
+            return -1;
+        }
+        (msg.kind == HANDOFF_TRANSPARENT ? inherited.transparent_fds : inherited.proxy_fds)[msg.index] = fd;
+    }
+}
+
+/* Whatever no worker took, e.g. after the worker count went down, is closed along with its backlog. */
+void handoff_release(void) {
+    for (int i = 0; i < inherited.count; i++) {
+        if (inherited.proxy_fds[i] >= 0) close(inherited.proxy_fds[i]);
+        if (inherited.transparent_fds[i] >= 0) close(inherited.transparent_fds[i]);
+    }
+    if (inherited.admin_fd >= 0) close(inherited.admin_fd);
+    free(inherited.proxy_fds);
+    free(inherited.transparent_fds);
+    memset(&inherited, 0, sizeof(inherited));
+    inherited.admin_fd = -1;
+}
+
+/* Re-executes the binary this process was started from, passing it every listener over a socketpair.
+ * This process keeps accepting until the new one reports its workers running, so no client is refused. */
+int upgrade_spawn(void) {
+    if (!exe_path[0]) {
+        LOG_ERROR("Upgrade failed: executable path unknown");
+        return -1;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    int argc = 0;
+    while (saved_argv[argc]) argc++;
+    char **args = calloc(argc + 3, sizeof(*args));
+    if (!args) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    int n = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(saved_argv[i], "--upgrade-fd") == 0 && i + 1 < argc) i++;
+        else args[n++] = saved_argv[i];
+    }
+    char fd_arg[16];
+    snprintf(fd_arg, sizeof(fd_arg), "%d", sv[1]);
+    args[n++] = "--upgrade-fd";
+    args[n++] = fd_arg;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        fcntl(sv[1], F_SETFD, 0);
+        execv(exe_path, args);
+        _exit(127);
+    }
+    free(args);
+    close(sv[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        return -1;
+    }
+
+    struct timeval timeout = { UPGRADE_TIMEOUT_MS / 1000, 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char ready = 0;
+    int ok = handoff_send_all(sv[0]) == 0 && recv(sv[0], &ready, 1, 0) == 1;
+    close(sv[0]);
+    if (!ok) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        LOG_ERROR("Upgrade failed: new process did not take over the listeners");
+        return -1;
+    }
+
+    __atomic_store_n(&handed_off, 1, __ATOMIC_RELEASE);
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Upgrade: listeners handed to process %d", (int)pid);
+    LOG_INFO(msg);
+    return 0;
+}
+
+/* The mailbox wakeup gets every worker to stop accepting without waiting out its poll timeout. */
+void drain_begin(void) {
+    __atomic_store_n(&draining, 1, __ATOMIC_RELEASE);
+    metrics_add(METRIC_DRAINING, 1);
+    uint64_t one = 1;
+    for (int i = 0; i < config.workers; i++) {
+        if (write(workers[i].mailbox.efd, &one, sizeof(one)) < 0 && errno != EAGAIN) perror("eventfd write");
+    }
+}
+
+/* SIGHUP re-reads the upstream list, the policy and the user store; each keeps its current table if the new file does not load. */
+void request_reloads(void) {
+    if (config.upstreams) upstream_request_reload();
+    if (config.policy) policy_request_reload();
+    if (config.users) auth_request_reload();
+    if (!config.upstreams && !config.policy && !config.users) LOG_INFO("SIGHUP ignored: no upstream list, policy or user store to reload");
+}
+
+/* Workers close their listeners only once nothing more can be accepted on them, io_uring after its cancellations
+ * complete, so a drain is not over while any listener is still open. */
+int drain_listening(void) {
+    for (int i = 0; i < config.workers; i++) {
+        if (__atomic_load_n(&workers[i].listen_fd, __ATOMIC_ACQUIRE) >= 0 || __atomic_load_n(&workers[i].transparent_fd, __ATOMIC_ACQUIRE) >= 0) return 1;
+    }
+    return 0;
+}
+
+/* Waits for the open connections to finish, up to the drain timeout; another SIGTERM or a SIGINT cuts it short. */
+void drain_wait(const sigset_t *signals) {
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Draining %u connection%s for up to %d s", __atomic_load_n(&client_count, __ATOMIC_RELAXED),
+             __atomic_load_n(&client_count, __ATOMIC_RELAXED) == 1 ? "" : "s", config.drain_timeout);
+    LOG_INFO(msg);
+
+    uint64_t deadline = now_ms() + (uint64_t)config.drain_timeout * 1000;
+    struct timespec interval = { 0, DRAIN_POLL_MS * 1000000L };
+    for (;;) {
+        uint32_t open = __atomic_load_n(&client_count, __ATOMIC_RELAXED);
+        if (open == 0 && !drain_listening()) {
+            LOG_INFO("Drain complete");
+            return;
+        }
+        if (now_ms() >= deadline) {
+            snprintf(msg, sizeof(msg), "Drain timeout passed with %u connection%s open", open, open == 1 ? "" : "s");
+            LOG_WARN(msg);
+            return;
+        }
+        int sig = sigtimedwait(signals, NULL, &interval);
+        if (sig == SIGHUP) request_reloads();
+        else if (sig == SIGINT || sig == SIGTERM) return;
+    }
+}
+
+void start_proxy(const char *host, int port) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    /* A peer that resets mid-write has to cost one connection, not the process: io_uring's WRITE_FIXED and
+     * splice() have no MSG_NOSIGNAL. */
+    signal(SIGPIPE, SIG_IGN);
+
+    log_init();
+    if (config.upgrade_fd >= 0 && handoff_receive(config.upgrade_fd) < 0) {
+        LOG_ERROR("Upgrade failed: no listeners received");
+        exit(EXIT_FAILURE);
+    }
+    dns_init();
+    rate_init();
+    limits_init();
+    cache_init();
+    if (config.upstreams) {
+        upstreams = upstream_load(config.upstreams);
+        if (!upstreams) exit(EXIT_FAILURE);
+        start_upstream_health();
+    }
+    if (config.policy) {
+        policy = policy_load(config.policy);
+        if (!policy) exit(EXIT_FAILURE);
+        metrics_add(METRIC_POLICY_RULES, policy->rules);
+    }
+    if (config.users) {
+        auth_store = auth_load(config.users);
+        if (!auth_store) exit(EXIT_FAILURE);
+        if (config.engine != ENGINE_THREAD) verifier_init();
+    }
+    if (config.policy || config.users) start_watch();
+
+    workers = calloc(config.workers, sizeof(*workers));
+    if (!workers) {
+        metrics_error(ERROR_RESOURCE);
+        LOG_ERROR("Memory allocation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    numa_init();
+    for (int i = 0; i < config.workers; i++) {
+        struct worker *w = &workers[i];
+        w->id = i;
+        worker_place(w, config.workers > 1 || config.cpus ? pick_cpu(i) : -1);
+        if (config.cpus && w->cpu < 0 && i == 0) LOG_WARN("No CPU from --cpus is available; workers left unpinned");
+        /* The worker's tables are first touched below, so they land on its node rather than this thread's. */
+        if (w->node >= 0 && numa_prefer(w->node) < 0 && i == 0) LOG_WARN("Failed to set the NUMA memory policy");
+        w->listen_fd = listener_take(i < inherited.count ? &inherited.proxy_fds[i] : NULL, host, port, 1);
+        w->transparent_fd = config.transparent_port > 0 ? listener_take(i < inherited.count ? &inherited.transparent_fds[i] : NULL, host, config.transparent_port, 1) : -1;
+        if (registry_init(&w->registry) < 0) {
+            metrics_error(ERROR_RESOURCE);
+            LOG_ERROR("Memory allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_init(&w->pipes.lock, NULL);
+        slab_init(&w->reactor.conn_slab, sizeof(struct conn));
+        for (int c = 0; c < RELAY_BUFFER_CLASSES; c++) slab_init(&w->reactor.buffer_slabs[c], (size_t)RELAY_BUFFER_MIN << c);
+        pthread_mutex_init(&w->mailbox.lock, NULL);
+        pthread_mutex_init(&w->timer_lock, NULL);
+        w->mailbox.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->mailbox.efd < 0) {
+            perror("eventfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+    numa_prefer(-1);
+    if (config.steering != STEER_NONE) steer_init();
+
+    if (config.admin_port > 0) start_admin();
+    handoff_release();
+
+    char msg[128];
+    snprintf(msg, sizeof(msg), "Proxy server running on %s:%d (%d worker%s)", host, port, config.workers, config.workers == 1 ? "" : "s");
+    LOG_INFO(msg);
+    if (config.transparent_port > 0) {
+        snprintf(msg, sizeof(msg), "Transparent TLS on %s:%d", host, config.transparent_port);
+        LOG_INFO(msg);
+    }
+
+    for (int i = 0; i < config.workers; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            metrics_error(ERROR_RESOURCE);
+            LOG_ERROR("Thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* The old process starts draining once this lands, so it goes out only after every worker is running. */
+    if (config.upgrade_fd >= 0) {
+        if (send(config.upgrade_fd, "R", 1, MSG_NOSIGNAL) != 1) perror("send");
+        close(config.upgrade_fd);
+        config.upgrade_fd = -1;
+    }
+
+    /* SIGTERM drains, SIGUSR2 hands the listeners to a re-executed binary and then drains, SIGINT stops at once. */
+    int sig = 0;
+    for (;;) {
+        if (sigwait(&signals, &sig) != 0) continue;
+        if (sig == SIGHUP) {
+            request_reloads();
+        } else if (sig != SIGUSR2 || upgrade_spawn() == 0) {
+            break;
+        }
+    }
+    if (sig != SIGINT && config.drain_timeout > 0) {
+        drain_begin();
+        drain_wait(&signals);
+    }
+    shutdown_server(sig);
+}
+
+int main(int argc, char *argv[]) {
+    const char *host = DEFAULT_HOST;
+    int port = DEFAULT_PORT;
+
+    /* Resolved now: once a deploy replaces the binary, /proc/self/exe names the deleted original. */
+    saved_argv = argv;
+    ssize_t exe_len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[exe_len > 0 ? exe_len : 0] = '\0';
 
     for (int i = 1; i < argc; i++) {
         if ((strcmp(argv[i], "-H") == 0 || strcmp(argv[i], "--host") == 0) && i + 1 < argc) {
             host = argv[++i];
         } else if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--port") == 0) && i + 1 < argc) {
             port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--engine") == 0 && i + 1 < argc) {
+            const char *engine = argv[++i];
+            if (strcmp(engine, "thread") == 0) {
+                config.engine = ENGINE_THREAD;
+            } else if (strcmp(engine, "epoll") == 0) {
+                config.engine = ENGINE_EPOLL;
+            } else if (strcmp(engine, "io_uring") == 0) {
+                config.engine = ENGINE_URING;
+            } else {
+                fprintf(stderr, "Unknown engine: %s (expected thread, epoll or io_uring)\n", engine);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--relay") == 0 && i + 1 < argc) {
+            const char *relay = argv[++i];
+            if (strcmp(relay, "copy") == 0) {
+                config.relay = RELAY_COPY;
+            } else if (strcmp(relay, "splice") == 0) {
+                config.relay = RELAY_SPLICE;
+            } else {
+                fprintf(stderr, "Unknown relay mode: %s (expected copy or splice)\n", relay);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--dns-threads") == 0 && i + 1 < argc) {
+            config.dns_threads = atoi(argv[++i]);
+            if (config.dns_threads < 1) config.dns_threads = 1;
+        } else if (strcmp(argv[i], "--dns-ttl") == 0 && i + 1 < argc) {
+            config.dns_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dns-negative-ttl") == 0 && i + 1 < argc) {
+            config.dns_negative_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pool-idle-per-host") == 0 && i + 1 < argc) {
+            config.pool_idle_per_host = atoi(argv[++i]);
+            if (config.pool_idle_per_host > POOL_IDLE_PER_HOST_MAX) config.pool_idle_per_host = POOL_IDLE_PER_HOST_MAX;
+        } else if (strcmp(argv[i], "--pool-max-idle") == 0 && i + 1 < argc) {
+            config.pool_max_idle = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pool-idle-timeout") == 0 && i + 1 < argc) {
+            config.pool_idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pool-max-per-host") == 0 && i + 1 < argc) {
+            config.pool_max_per_host = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--connect-timeout") == 0 && i + 1 < argc) {
+            config.connect_timeout = atoi(argv[++i]);
+            if (config.connect_timeout < 1) config.connect_timeout = 1;
+        } else if (strcmp(argv[i], "--connect-attempt-delay") == 0 && i + 1 < argc) {
+            /* RFC 8305 puts a 10 ms floor on the delay between racing attempts. */
+            config.connect_attempt_delay = atoi(argv[++i]);
+            if (config.connect_attempt_delay < 10) config.connect_attempt_delay = 10;
+        } else if (strcmp(argv[i], "--header-timeout") == 0 && i + 1 < argc) {
+            /* Also bounds how long a keep-alive client may sit between requests; 0 disables it. */
+            config.header_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            config.idle_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-lifetime") == 0 && i + 1 < argc) {
+            config.max_lifetime = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate-limit") == 0 && i + 1 < argc) {
+            /* New connections per second from one client IP; 0 disables it. */
+            config.rate_limit = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate-burst") == 0 && i + 1 < argc) {
+            config.rate_burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bandwidth-limit") == 0 && i + 1 < argc) {
+            /* Relayed bytes per second from one client IP, both directions together; 0 disables it. */
+            config.bandwidth_limit = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tunnel-bandwidth") == 0 && i + 1 < argc) {
+            /* Relayed bytes per second through one connection, both directions together; 0 disables it. */
+            config.tunnel_bandwidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--global-bandwidth") == 0 && i + 1 < argc) {
+            /* Relayed bytes per second through the whole proxy; 0 disables it. */
+            config.global_bandwidth = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--transparent-port") == 0 && i + 1 < argc) {
+            /* TLS redirected here (iptables -j REDIRECT) is tunneled to the ClientHello's server name. */
+            config.transparent_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-connections") == 0 && i + 1 < argc) {
+            /* 0 derives the cap from RLIMIT_NOFILE; larger values are lowered to fit it. */
+            config.max_connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--overload") == 0 && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (strcmp(mode, "pause") == 0) {
+                config.overload = OVERLOAD_PAUSE;
+            } else if (strcmp(mode, "reject") == 0) {
+                config.overload = OVERLOAD_REJECT;
+            } else {
+                fprintf(stderr, "Unknown overload mode: %s (expected pause or reject)\n", mode);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            /* CPUs to pin workers to, as a cpulist ("0-3,8-11"), e.g. the ones taking the NIC's interrupts. */
+            cpu_set_t set;
+            config.cpus = argv[++i];
+            if (cpulist_parse(config.cpus, &set) < 0) {
+                fprintf(stderr, "Invalid CPU list: %s\n", config.cpus);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--steering") == 0 && i + 1 < argc) {
+            /* How a reuseport group picks the worker for a new connection: the kernel's hash, or the worker pinned
+             * to the CPU that took it, matched by SO_INCOMING_CPU or by a classic BPF program. */
+            const char *mode = argv[++i];
+            if (strcmp(mode, "none") == 0) {
+                config.steering = STEER_NONE;
+            } else if (strcmp(mode, "incoming-cpu") == 0) {
+                config.steering = STEER_INCOMING_CPU;
+            } else if (strcmp(mode, "cbpf") == 0) {
+                config.steering = STEER_CBPF;
+            } else {
+                fprintf(stderr, "Unknown steering mode: %s (expected none, incoming-cpu or cbpf)\n", mode);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--drain-timeout") == 0 && i + 1 < argc) {
+            /* Seconds SIGTERM or an upgrade waits for open connections before closing them; 0 closes at once. */
+            config.drain_timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--upgrade-fd") == 0 && i + 1 < argc) {
+            /* Set by a running proxy re-executing itself on SIGUSR2; not meant to be passed by hand. */
+            config.upgrade_fd = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-nodelay") == 0 && i + 1 < argc) {
+            config.tcp_nodelay = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-defer-accept") == 0 && i + 1 < argc) {
+            /* Seconds the kernel holds a connection back until the client's first bytes arrive. */
+            config.tcp_defer_accept = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-fastopen") == 0 && i + 1 < argc) {
+            /* Queue length for pending Fast Open requests on the listeners; 0 disables it. */
+            config.tcp_fastopen = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-sndbuf") == 0 && i + 1 < argc) {
+            config.tcp_sndbuf = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-rcvbuf") == 0 && i + 1 < argc) {
+            config.tcp_rcvbuf = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-notsent-lowat") == 0 && i + 1 < argc) {
+            config.tcp_notsent_lowat = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tcp-keepalive") == 0 && i + 1 < argc) {
+            /* Idle seconds before the first probe; a dead peer is dropped after about twice that. */
+            config.tcp_keepalive = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--upstreams") == 0 && i + 1 < argc) {
+            config.upstreams = argv[++i];
+        } else if (strcmp(argv[i], "--health-interval") == 0 && i + 1 < argc) {
+            config.health_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--health-timeout") == 0 && i + 1 < argc) {
+            config.health_timeout = atoi(argv[++i]);
+            if (config.health_timeout < 1) config.health_timeout = 1;
+        } else if (strcmp(argv[i], "--health-target") == 0 && i + 1 < argc) {
+            char target_host[256];
+            int target_port = 0;
+            config.health_target = argv[++i];
+            if (parse_authority(config.health_target, strlen(config.health_target), target_host, sizeof(target_host), &target_port) < 0 || target_port == 0) {
+                fprintf(stderr, "Invalid health target: %s (expected HOST:PORT)\n", config.health_target);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--policy") == 0 && i + 1 < argc) {
+            /* Allow, deny and routing rules by destination suffix and client prefix; reloaded on change or SIGHUP. */
+            config.policy = argv[++i];
+        } else if (strcmp(argv[i], "--users") == 0 && i + 1 < argc) {
+            /* Requires Proxy-Authorization from every client; see auth_parse_entry for the line format. */
+            config.users = argv[++i];
+        } else if (strcmp(argv[i], "--auth-threads") == 0 && i + 1 < argc) {
+            /* Threads deriving password hashes for the epoll and io_uring engines, off their reactors. */
+            config.auth_threads = atoi(argv[++i]);
+            if (config.auth_threads < 1) config.auth_threads = 1;
+        } else if (strcmp(argv[i], "--auth-cache") == 0 && i + 1 < argc) {
+            /* Verified credentials remembered so the password hash runs once per login; 0 verifies every request. */
+            config.auth_cache = atoi(argv[++i]);
+            if (config.auth_cache < 0) config.auth_cache = 0;
+        } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            /* Turns on the shared HTTP response cache, with its block store in an unlinked file here. */
+            config.cache_dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            config.cache_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cache-object-max") == 0 && i + 1 < argc) {
+            /* Largest body stored, in MiB; bigger responses are relayed uncached. */
+            config.cache_object_max = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--hash-password") == 0 && i + 1 < argc) {
+            return auth_hash_password(argv[++i]);
+        } else if (strcmp(argv[i], "--admin-host") == 0 && i + 1 < argc) {
+            config.admin_host = argv[++i];
+        } else if (strcmp(argv[i], "--admin-port") == 0 && i + 1 < argc) {
+            config.admin_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-sample") == 0 && i + 1 < argc) {
+            /* Times every connection's stages for the admin histograms and keeps one in N at /traces; 0 leaves tracing off. */
+            config.trace_sample = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace-slow") == 0 && i + 1 < argc) {
+            /* Also keeps any connection whose setup took longer than this many milliseconds; turns tracing on by itself too. */
+            config.trace_slow = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc) {
+            const char *level = argv[++i];
+            if (strcmp(level, "off") == 0) {
+                config.log_level = LOG_LEVEL_OFF;
+            } else if (strcmp(level, "error") == 0) {
+                config.log_level = LOG_LEVEL_ERROR;
+            } else if (strcmp(level, "warn") == 0) {
+                config.log_level = LOG_LEVEL_WARN;
+            } else if (strcmp(level, "info") == 0) {
+                config.log_level = LOG_LEVEL_INFO;
+            } else if (strcmp(level, "access") == 0) {
+                config.log_level = LOG_LEVEL_ACCESS;
+            } else {
+                fprintf(stderr, "Unknown log level: %s (expected off, error, warn, info or access)\n", level);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--log-format") == 0 && i + 1 < argc) {
+            const char *format = argv[++i];
+            if (strcmp(format, "text") == 0) {
+                config.log_format = LOG_FORMAT_TEXT;
+            } else if (strcmp(format, "json") == 0) {
+                config.log_format = LOG_FORMAT_JSON;
+            } else {
+                fprintf(stderr, "Unknown log format: %s (expected text or json)\n", format);
+                return EXIT_FAILURE;
+            }
+        } else if ((strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--workers") == 0) && i + 1 < argc) {
+            config.workers = atoi(argv[++i]);
+            if (config.workers < 1) {
+                fprintf(stderr, "--workers must be at least 1\n");
+                return EXIT_FAILURE;
+            }
         }
     }
 
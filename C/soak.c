@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <stdint.h>
+
+#include "loadgen.h"
+
+/*
+ * Chaos/soak harness for proxy.c. Mixes good tunnels and GETs to a local sink with failing DNS, refused and
+ * blackholed targets, early client disconnects and slowloris clients. Every --interval it parks the load, lets the
+ * proxy settle and checks that its open fds, threads and RSS are back where the first checkpoint after --warmup
+ * left them. The warmup has to cover the caches filling up: every failed lookup is a fresh resolver entry.
+ *
+ *   gcc -Wall -Wextra -O2 -pthread C/soak.c -o soak
+ *   ./soak --proxy 127.0.0.1:8000 --pid $(pidof proxy) -d 14400 --interval 300
+ */
+
+#define SLOWLORIS_MAX 1024
+#define EARLY_CLOSE_BYTES (4 * 1024 * 1024)
+
+enum scenario { SCENARIO_TUNNEL, SCENARIO_GET, SCENARIO_DNS, SCENARIO_REFUSED, SCENARIO_BLACKHOLE, SCENARIO_EARLY_CLOSE, SCENARIOS };
+
+static const char *scenario_names[SCENARIOS] = { "tunnel", "get", "dns", "refused", "blackhole", "early-close" };
+static const int scenario_weights[SCENARIOS] = { 4, 4, 1, 1, 1, 2 };
+
+struct soak_config {
+    const char *proxy_host;
+    int proxy_port;
+    int pid;
+    int concurrency;
+    int duration;
+    int interval;
+    int warmup;
+    int settle;
+    size_t bytes;
+    int slowloris;
+    int trickle;
+    const char *blackhole_host;
+    int blackhole_port;
+    int timeout;
+    int fd_slack;
+    int thread_slack;
+    long rss_slack;
+    int sink_port;
+    int refused_port;
+};
+
+static struct soak_config config = {
+    .proxy_host = "127.0.0.1",
+    .proxy_port = 8000,
+    .pid = 0,
+    .concurrency = 16,
+    .duration = 3600,
+    .interval = 60,
+    .warmup = 300,
+    .settle = 5,
+    .bytes = 65536,
+    .slowloris = 8,
+    .trickle = 1000,
+    .blackhole_host = "192.0.2.1",
+    .blackhole_port = 80,
+    .timeout = 30,
+    .fd_slack = 32,
+    .thread_slack = 4,
+    .rss_slack = 16384,
+    .sink_port = 0,
+    .refused_port = 0,
+};
+
+struct client_stats {
+    pthread_t thread;
+    unsigned seed;
+    uint64_t ops[SCENARIOS];
+    uint64_t errors[SCENARIOS];
+};
+
+/* One proxy sample; all -1 when /proc could not be read. */
+struct usage {
+    int fds;
+    int threads;
+    long rss_kb;
+};
+
+static volatile int stop_flag = 0;
+static int pause_flag = 0;
+static int active_clients = 0;
+static uint64_t dns_serial = 0;
+static uint64_t slowloris_closed = 0;
+
+int loopback_listener(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 4096) < 0) {
+        perror("sink");
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+int bound_port(int fd) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    return getsockname(fd, (struct sockaddr *)&addr, &len) == 0 ? ntohs(addr.sin_port) : -1;
+}
+
+/* The sink, plus a port that refuses connections: bound once for a number and closed again. */
+void start_fixtures(void) {
+    static int sink_fd;
+    sink_fd = loopback_listener(config.sink_port);
+    config.sink_port = bound_port(sink_fd);
+    pthread_t tid;
+    pthread_create(&tid, NULL, sink_main, &sink_fd);
+    pthread_detach(tid);
+
+    if (config.refused_port == 0) {
+        int fd = loopback_listener(0);
+        config.refused_port = bound_port(fd);
+        close(fd);
+    }
+}
+
+int proxy_connect(void) {
+    return proxy_dial(config.proxy_host, config.proxy_port, config.timeout);
+}
+
+/* Sends a CONNECT for host:port and returns the reply's status as read_head() does, leaving fd open. */
+int connect_status(int fd, const char *host, int port) {
+    char buf[1024];
+    size_t extra;
+    int len = snprintf(buf, sizeof(buf), "CONNECT %s:%d HTTP/1.1\r\nHost: %s:%d\r\n\r\n", host, port, host, port);
+    if (send_all(fd, buf, len) < 0) return -1;
+    int status = read_head(fd, buf, sizeof(buf), &extra);
+    return status == 200 && extra != 0 ? -1 : status;
+}
+
+/* A target that cannot be reached has to come back as an error reply or a close, never as a hang or a 200. */
+int run_unreachable(const char *host, int port) {
+    int fd = proxy_connect();
+    if (fd < 0) return -1;
+    int status = connect_status(fd, host, port);
+    close(fd);
+    return status == -1 || status >= 400 ? 0 : -1;
+}
+
+int run_tunnel(void) {
+    int fd = proxy_connect();
+    if (fd < 0) return -1;
+    char line[32];
+    int len = snprintf(line, sizeof(line), "%zu\n", config.bytes);
+    int rc = connect_status(fd, "127.0.0.1", config.sink_port) != 200 || send_all(fd, line, len) < 0 || drain(fd, config.bytes) < 0 ? -1 : 0;
+    close(fd);
+    return rc;
+}
+
+int run_get(void) {
+    char buf[1024];
+    size_t extra;
+    int fd = proxy_connect();
+    if (fd < 0) return -1;
+    int len = snprintf(buf, sizeof(buf), "GET http://127.0.0.1:%d/%zu HTTP/1.1\r\nHost: 127.0.0.1:%d\r\nConnection: close\r\n\r\n",
+                       config.sink_port, config.bytes, config.sink_port);
+    int rc = send_all(fd, buf, len) < 0 || read_head(fd, buf, sizeof(buf), &extra) != 200 || extra > config.bytes ||
+             drain(fd, config.bytes - extra) < 0 ? -1 : 0;
+    close(fd);
+    return rc;
+}
+
+/* Each lookup names a fresh .invalid host (RFC 6761), so the resolver's negative cache never answers for it. */
+int run_dns(void) {
+    char host[64];
+    snprintf(host, sizeof(host), "soak-%llu.invalid", (unsigned long long)__atomic_add_fetch(&dns_serial, 1, __ATOMIC_RELAXED));
+    return run_unreachable(host, 80);
+}
+
+/* Hangs up partway through a request head, right after a CONNECT, or with a tunnel mid-transfer. */
+int run_early_close(struct client_stats *st) {
+    int fd = proxy_connect();
+    if (fd < 0) return -1;
+    char buf[128];
+    int len, rc = 0;
+    switch (rand_r(&st->seed) % 3) {
+    case 0:
+        len = snprintf(buf, sizeof(buf), "CONNECT 127.0.0.1:%d HTTP/1.1\r\nHo", config.sink_port);
+        rc = send_all(fd, buf, len);
+        break;
+    case 1:
+        len = snprintf(buf, sizeof(buf), "CONNECT 127.0.0.1:%d HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n", config.sink_port);
+        rc = send_all(fd, buf, len);
+        break;
+    default:
+        len = snprintf(buf, sizeof(buf), "%d\n", EARLY_CLOSE_BYTES);
+        if (connect_status(fd, "127.0.0.1", config.sink_port) != 200 || send_all(fd, buf, len) < 0 || drain(fd, 1024) < 0) rc = -1;
+        break;
+    }
+    /* Unread bytes make the close a reset, as a client that gave up would. */
+    close(fd);
+    return rc;
+}
+
+int pick_scenario(struct client_stats *st) {
+    int total = 0;
+    for (int s = 0; s < SCENARIOS; s++) total += scenario_weights[s];
+    int pick = rand_r(&st->seed) % total;
+    for (int s = 0; s < SCENARIOS; s++) {
+        if ((pick -= scenario_weights[s]) < 0) return s;
+    }
+    return SCENARIO_TUNNEL;
+}
+
+/* Clients leave an operation only between operations, so a checkpoint sees none in flight once active is 0. */
+void *client_main(void *arg) {
+    struct client_stats *st = arg;
+    while (!stop_flag) {
+        if (__atomic_load_n(&pause_flag, __ATOMIC_SEQ_CST)) {
+            usleep(10000);
+            continue;
+        }
+        __atomic_add_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&pause_flag, __ATOMIC_SEQ_CST)) {
+            __atomic_sub_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        int s = pick_scenario(st);
+        int rc;
+        switch (s) {
+        case SCENARIO_TUNNEL: rc = run_tunnel(); break;
+        case SCENARIO_GET: rc = run_get(); break;
+        case SCENARIO_DNS: rc = run_dns(); break;
+        case SCENARIO_REFUSED: rc = run_unreachable("127.0.0.1", config.refused_port); break;
+        case SCENARIO_BLACKHOLE: rc = run_unreachable(config.blackhole_host, config.blackhole_port); break;
+        default: rc = run_early_close(st); break;
+        }
+        __atomic_add_fetch(&st->ops[s], 1, __ATOMIC_RELAXED);
+        if (rc < 0) __atomic_add_fetch(&st->errors[s], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+/* Keeps --slowloris connections trickling one header byte each per --trickle ms and reopens any the proxy drops.
+ * The thread counts as active from the moment it may hold a connection until a checkpoint has seen it close all. */
+void *slowloris_main(void *arg) {
+    (void)arg;
+    static const char head[] = "GET http://127.0.0.1/ HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Slow: ";
+    int fds[SLOWLORIS_MAX];
+    size_t sent[SLOWLORIS_MAX];
+    int count = config.slowloris < SLOWLORIS_MAX ? config.slowloris : SLOWLORIS_MAX;
+    for (int i = 0; i < count; i++) fds[i] = -1;
+
+    int parked = 1;
+    while (!stop_flag) {
+        if (__atomic_load_n(&pause_flag, __ATOMIC_SEQ_CST)) {
+            for (int i = 0; i < count; i++) {
+                if (fds[i] >= 0) close(fds[i]);
+                fds[i] = -1;
+            }
+            if (!parked) __atomic_sub_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
+            parked = 1;
+            usleep(10000);
+            continue;
+        }
+        if (parked) {
+            __atomic_add_fetch(&active_clients, 1, __ATOMIC_SEQ_CST);
+            parked = 0;
+            continue;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (fds[i] < 0) {
+                fds[i] = proxy_connect();
+                sent[i] = 0;
+                if (fds[i] < 0) continue;
+            }
+
+            struct pollfd pfd = { .fd = fds[i], .events = POLLIN };
+            char c = sent[i] < sizeof(head) - 1 ? head[sent[i]] : 'x';
+            if (poll(&pfd, 1, 0) > 0 || send(fds[i], &c, 1, MSG_NOSIGNAL | MSG_DONTWAIT) != 1) {
+                __atomic_add_fetch(&slowloris_closed, 1, __ATOMIC_RELAXED);
+                close(fds[i]);
+                fds[i] = -1;
+                continue;
+            }
+            sent[i]++;
+        }
+        usleep(config.trickle * 1000);
+    }
+    for (int i = 0; i < count; i++) {
+        if (fds[i] >= 0) close(fds[i]);
+    }
+    return NULL;
+}
+
+struct usage sample_usage(int pid) {
+    struct usage u = { -1, -1, -1 };
+    char path[64], line[256];
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *dir = opendir(path);
+    if (dir) {
+        u.fds = 0;
+        for (struct dirent *e; (e = readdir(dir));) {
+            if (e->d_name[0] != '.') u.fds++;
+        }
+        closedir(dir);
+    }
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return u;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "VmRSS:", 6) == 0) u.rss_kb = atol(line + 6);
+        else if (strncmp(line, "Threads:", 8) == 0) u.threads = atoi(line + 8);
+    }
+    fclose(f);
+    return u;
+}
+
+/* Parks the load and samples once the proxy has held still for a second, or at --settle regardless. */
+struct usage checkpoint(void) {
+    __atomic_store_n(&pause_flag, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&active_clients, __ATOMIC_SEQ_CST) > 0) usleep(10000);
+
+    uint64_t deadline = now_us() + (uint64_t)config.settle * 1000000;
+    struct usage last = sample_usage(config.pid);
+    uint64_t still_since = now_us();
+    while (now_us() < deadline && now_us() - still_since < 1000000) {
+        usleep(100000);
+        struct usage u = sample_usage(config.pid);
+        if (u.fds != last.fds || u.threads != last.threads) still_since = now_us();
+        last = u;
+    }
+    __atomic_store_n(&pause_flag, 0, __ATOMIC_SEQ_CST);
+    return last;
+}
+
+void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -p, --proxy HOST:PORT      proxy to drive (default 127.0.0.1:8000)\n"
+            "      --pid PID              proxy process to watch; without it only the traffic is checked\n"
+            "  -c, --concurrency N        concurrent clients (default 16)\n"
+            "  -d, --duration SECONDS     run time (default 3600)\n"
+            "      --interval SECONDS     time between checkpoints (default 60)\n"
+            "      --warmup SECONDS       time before the baseline checkpoint (default 300)\n"
+            "      --settle SECONDS       longest wait for the proxy to go quiet at a checkpoint (default 5)\n"
+            "  -b, --bytes N              payload per good tunnel or response (default 65536)\n"
+            "      --slowloris N          slow header clients kept open (default 8)\n"
+            "      --trickle MS           gap between a slow client's bytes (default 1000)\n"
+            "      --blackhole HOST:PORT  target that never answers (default 192.0.2.1:80)\n"
+            "      --timeout SECONDS      client socket timeout (default 30)\n"
+            "      --fd-slack N           open fds allowed over the baseline (default 32)\n"
+            "      --thread-slack N       threads allowed over the baseline (default 4)\n"
+            "      --rss-slack KB         RSS allowed over the baseline (default 16384)\n"
+            "      --sink-port PORT       sink listen port (default: ephemeral)\n",
+            prog);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--proxy") == 0) && i + 1 < argc) {
+            char *spec = argv[++i];
+            char *colon = strrchr(spec, ':');
+            if (colon) {
+                *colon = '\0';
+                config.proxy_port = atoi(colon + 1);
+            }
+            if (*spec) config.proxy_host = spec;
+        } else if (strcmp(argv[i], "--pid") == 0 && i + 1 < argc) {
+            config.pid = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--concurrency") == 0) && i + 1 < argc) {
+            config.concurrency = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "--duration") == 0) && i + 1 < argc) {
+            config.duration = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            config.interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc) {
+            config.warmup = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--settle") == 0 && i + 1 < argc) {
+            config.settle = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bytes") == 0) && i + 1 < argc) {
+            config.bytes = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--slowloris") == 0 && i + 1 < argc) {
+            config.slowloris = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trickle") == 0 && i + 1 < argc) {
+            config.trickle = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--blackhole") == 0 && i + 1 < argc) {
+            char *spec = argv[++i];
+            char *colon = strrchr(spec, ':');
+            if (colon) {
+                *colon = '\0';
+                config.blackhole_port = atoi(colon + 1);
+            }
+            if (*spec) config.blackhole_host = spec;
+        } else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc) {
+            config.timeout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fd-slack") == 0 && i + 1 < argc) {
+            config.fd_slack = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--thread-slack") == 0 && i + 1 < argc) {
+            config.thread_slack = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rss-slack") == 0 && i + 1 < argc) {
+            config.rss_slack = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--sink-port") == 0 && i + 1 < argc) {
+            config.sink_port = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (config.concurrency < 1 || config.duration < 1 || config.interval < 1 || config.warmup < 0 || config.settle < 1 || config.timeout < 1 || config.trickle < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (config.pid > 0 && sample_usage(config.pid).fds < 0) {
+        fprintf(stderr, "Cannot read /proc/%d\n", config.pid);
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit nofile;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+        nofile.rlim_cur = nofile.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &nofile);
+    }
+    start_fixtures();
+
+    struct client_stats *stats = calloc(config.concurrency, sizeof(*stats));
+    if (!stats) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < config.concurrency; i++) {
+        stats[i].seed = (unsigned)now_us() ^ (unsigned)i * 2654435761u;
+        if (pthread_create(&stats[i].thread, NULL, client_main, &stats[i]) != 0) {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    pthread_t slow;
+    int slow_started = config.slowloris > 0 && pthread_create(&slow, NULL, slowloris_main, NULL) == 0;
+
+    /* By the baseline checkpoint pools, caches and slabs have grown to what the mix needs; earlier ones only report. */
+    uint64_t start = now_us();
+    struct usage base = { -1, -1, -1 };
+    int sampled = 0, checkpoints = 0, drifted = 0;
+    while ((now_us() - start) / 1000000 < (uint64_t)config.duration) {
+        uint64_t left = config.duration - (now_us() - start) / 1000000;
+        sleep(left < (uint64_t)config.interval ? left : (uint64_t)config.interval);
+
+        uint64_t ops = 0, errors = 0;
+        for (int i = 0; i < config.concurrency; i++) {
+            for (int s = 0; s < SCENARIOS; s++) {
+                ops += __atomic_load_n(&stats[i].ops[s], __ATOMIC_RELAXED);
+                errors += __atomic_load_n(&stats[i].errors[s], __ATOMIC_RELAXED);
+            }
+        }
+        uint64_t elapsed = (now_us() - start) / 1000000;
+        if (config.pid <= 0) {
+            printf("%02llu:%02llu:%02llu ops %llu, errors %llu\n", (unsigned long long)elapsed / 3600, (unsigned long long)elapsed / 60 % 60,
+                   (unsigned long long)elapsed % 60, (unsigned long long)ops, (unsigned long long)errors);
+            fflush(stdout);
+            continue;
+        }
+
+        struct usage u = checkpoint();
+        if (u.fds < 0) {
+            printf("proxy %d is gone\n", config.pid);
+            drifted = 1;
+            break;
+        }
+        int warming = elapsed < (uint64_t)config.warmup;
+        if (!sampled++ || (!warming && checkpoints++ == 0)) base = u;
+        int bad = !warming && (u.fds - base.fds > config.fd_slack || u.threads - base.threads > config.thread_slack || u.rss_kb - base.rss_kb > config.rss_slack);
+        if (bad) drifted = 1;
+        printf("%02llu:%02llu:%02llu fds %d (%+d), threads %d (%+d), rss %ld KB (%+ld), ops %llu, errors %llu%s\n",
+               (unsigned long long)elapsed / 3600, (unsigned long long)elapsed / 60 % 60, (unsigned long long)elapsed % 60,
+               u.fds, u.fds - base.fds, u.threads, u.threads - base.threads, u.rss_kb, u.rss_kb - base.rss_kb,
+               (unsigned long long)ops, (unsigned long long)errors, warming ? "  (warmup)" : bad ? "  DRIFT" : "");
+        fflush(stdout);
+    }
+
+    stop_flag = 1;
+    for (int i = 0; i < config.concurrency; i++) pthread_join(stats[i].thread, NULL);
+    if (slow_started) pthread_join(slow, NULL);
+
+    uint64_t errors = 0;
+    for (int s = 0; s < SCENARIOS; s++) {
+        uint64_t ops = 0, failed = 0;
+        for (int i = 0; i < config.concurrency; i++) {
+            ops += stats[i].ops[s];
+            failed += stats[i].errors[s];
+        }
+        errors += failed;
+        printf("%-12s %llu ops, %llu unexpected\n", scenario_names[s], (unsigned long long)ops, (unsigned long long)failed);
+    }
+    printf("%-12s %llu dropped by the proxy\n", "slowloris", (unsigned long long)slowloris_closed);
+    if (config.pid > 0) printf("resources:   %s\n", drifted ? "DRIFTED" : checkpoints > 1 ? "flat" : "too few checkpoints to tell");
+
+    free(stats);
+    return drifted || errors > 0 ? 2 : 0;
+}